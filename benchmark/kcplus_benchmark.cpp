@@ -0,0 +1,390 @@
+/*
+    Copyright 2017 Miigon
+
+    Licensed under the Apache License, Version 2.0 (the "License");
+    you may not use this file except in compliance with the License.
+    You may obtain a copy of the License at
+
+        http://www.apache.org/licenses/LICENSE-2.0
+
+    Unless required by applicable law or agreed to in writing, software
+    distributed under the License is distributed on an "AS IS" BASIS,
+    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+    See the License for the specific language governing permissions and
+    limitations under the License.
+*/
+
+/*
+    KCPlus benchmark: two KCPSessions over a simulated link.
+
+    Build from the repository root, with KCP:
+        g++ -std=c++11 -O2 -I. benchmark/kcplus_benchmark.cpp ikcp.c -o kcplus_benchmark
+
+    Usage:
+        kcplus_benchmark [--messages N] [--size BYTES] [--loss RATIO] [--delay MS] [--jitter MS]
+                         [--mtu BYTES] [--preset normal|fast|fastest] [--seed N]
+    Without link options, a matrix of presets and MTUs is run over a perfect in-memory loopback and a lossy link.
+
+    The link runs on a simulated millisecond clock, so latencies are in simulated time and don't depend on the
+    machine. Throughput is measured in wall-clock time, it's the CPU cost of the whole simulation.
+*/
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <new>
+#include <queue>
+#include <random>
+#include <string>
+#include <vector>
+#include "kcplus.hpp"
+
+namespace
+{
+    std::atomic<unsigned long long> gAllocations(0);
+
+    void *countingMalloc(size_t size)
+    {
+        ++gAllocations;
+        return std::malloc(size);
+    }
+
+    struct Options
+    {
+        unsigned long messages = 20000;
+        ikcp::SizeType size = 64;
+        double loss = 0;
+        IUINT32 delay = 0;
+        IUINT32 jitter = 0;
+        int mtu = 1400;
+        std::string preset = "fast";
+        unsigned seed = 1;
+    };
+
+    struct Preset
+    {
+        const char *name;
+        bool nodelay;
+        int interval;
+        int fastResend;
+        bool congestionControl;
+    };
+
+    const Preset Presets[] = {
+        {"normal", false, 40, 0, true},
+        {"fast", true, 20, 2, true},
+        {"fastest", true, 10, 2, false},
+    };
+
+    const Preset *findPreset(const std::string &name)
+    {
+        for(const Preset &preset : Presets)
+        {
+            if(name == preset.name)
+            {
+                return &preset;
+            }
+        }
+        return nullptr;
+    }
+
+    // One direction of a lossy link with delay and jitter. No allocation after construction.
+    class Link
+    {
+    public:
+        Link(const Options &options, unsigned seed, ikcp::SizeType capacity)
+            :mLoss(options.loss),mDelay(options.delay),mJitter(options.jitter),mRandom(seed),
+            mSlots(capacity),mPending(Later(mSlots), reserved(capacity)),mSequence(0)
+        {
+            mFree.reserve(capacity);
+            for(ikcp::SizeType i = 0; i < capacity; ++i)
+            {
+                mFree.push_back(i);
+            }
+        }
+
+        void send(const char data[], ikcp::SizeType size, IUINT32 now)
+        {
+            if(mFree.empty() || size > sizeof(Slot::data) || std::uniform_real_distribution<double>(0, 1)(mRandom) < mLoss)
+            {
+                return;
+            }
+            ikcp::SizeType index = mFree.back();
+            mFree.pop_back();
+            Slot &slot = mSlots[index];
+            IUINT32 jitter = mJitter != 0 ? std::uniform_int_distribution<IUINT32>(0, mJitter)(mRandom) : 0;
+            slot.deliverAt = now + mDelay + jitter;
+            slot.sequence = mSequence++;
+            slot.size = size;
+            std::memcpy(slot.data, data, size);
+            mPending.push(index);
+        }
+
+        template<class Receiver>
+        void deliver(IUINT32 now, Receiver &receiver)
+        {
+            while(!mPending.empty() && static_cast<IINT32>(mSlots[mPending.top()].deliverAt - now) <= 0)
+            {
+                ikcp::SizeType index = mPending.top();
+                mPending.pop();
+                receiver.input(mSlots[index].data, mSlots[index].size);
+                mFree.push_back(index);
+            }
+        }
+    private:
+        struct Slot
+        {
+            IUINT32 deliverAt;
+            unsigned long long sequence;
+            ikcp::SizeType size;
+            char data[2048];
+        };
+
+        struct Later
+        {
+            explicit Later(const std::vector<Slot> &slots)
+                :slots(&slots)
+            {
+            }
+
+            bool operator()(ikcp::SizeType a, ikcp::SizeType b) const
+            {
+                const Slot &x = (*slots)[a];
+                const Slot &y = (*slots)[b];
+                IINT32 difference = static_cast<IINT32>(x.deliverAt - y.deliverAt);
+                return difference != 0 ? difference > 0 : x.sequence > y.sequence;
+            }
+
+            const std::vector<Slot> *slots;
+        };
+
+        static std::vector<ikcp::SizeType> reserved(ikcp::SizeType capacity)
+        {
+            std::vector<ikcp::SizeType> container;
+            container.reserve(capacity);
+            return container;
+        }
+
+        double mLoss;
+        IUINT32 mDelay;
+        IUINT32 mJitter;
+        std::mt19937 mRandom;
+        std::vector<Slot> mSlots;
+        std::vector<ikcp::SizeType> mFree;
+        std::priority_queue<ikcp::SizeType, std::vector<ikcp::SizeType>, Later> mPending;
+        unsigned long long mSequence;
+    };
+
+    struct Result
+    {
+        unsigned long delivered;
+        double wallSeconds;
+        IUINT32 simulatedMillisec;
+        IUINT32 p50;
+        IUINT32 p99;
+        IUINT32 p999;
+        double allocationsPerMessage;
+        ikcp::SessionStats senderStats;
+    };
+
+    Result run(const Options &options, const Preset &preset)
+    {
+        const int Window = 256;
+        const ikcp::SizeType LinkCapacity = 8192;
+        const IUINT32 TimeLimit = 10 * 60 * 1000;
+
+        ikcp::KCPSession sender(1);
+        ikcp::KCPSession receiver(1);
+        Link forward(options, options.seed, LinkCapacity);
+        Link backward(options, options.seed + 1, LinkCapacity);
+        IUINT32 now = 0;
+        sender.setOutputFunction([&forward, &now](const char data[], ikcp::SizeType size)
+        {
+            forward.send(data, size, now);
+        });
+        receiver.setOutputFunction([&backward, &now](const char data[], ikcp::SizeType size)
+        {
+            backward.send(data, size, now);
+        });
+        for(ikcp::KCPSession *session : {&sender, &receiver})
+        {
+            session->setProperties(preset.nodelay, preset.interval, preset.fastResend, preset.congestionControl);
+            session->setMTU(options.mtu);
+            session->setMaxSendWindowSize(Window);
+            session->setMaxReceiveWindowSize(Window);
+        }
+
+        std::vector<IUINT32> latencies;
+        latencies.reserve(options.messages);
+        std::vector<char> message(std::max<ikcp::SizeType>(options.size, sizeof(IUINT32)), 'x');
+        std::vector<char> buffer(message.size());
+        unsigned long sent = 0;
+
+        unsigned long long allocationsBefore = gAllocations.load();
+        auto start = std::chrono::steady_clock::now();
+        while(latencies.size() < options.messages && now < TimeLimit)
+        {
+            while(sent < options.messages && sender.getNumOfPendingPackets() < static_cast<ikcp::SizeType>(Window) * 2)
+            {
+                std::memcpy(message.data(), &now, sizeof(now));
+                sender.send(message.data(), message.size());
+                ++sent;
+            }
+            sender.update(now);
+            receiver.update(now);
+            forward.deliver(now, receiver);
+            backward.deliver(now, sender);
+            while(receiver.receive(buffer.data(), buffer.size()) != 0)
+            {
+                IUINT32 sentAt;
+                std::memcpy(&sentAt, buffer.data(), sizeof(sentAt));
+                latencies.push_back(now - sentAt);
+            }
+            ++now;
+        }
+        auto end = std::chrono::steady_clock::now();
+
+        Result result;
+        result.delivered = static_cast<unsigned long>(latencies.size());
+        result.wallSeconds = std::chrono::duration<double>(end - start).count();
+        result.simulatedMillisec = now;
+        result.allocationsPerMessage = result.delivered != 0 ?
+            static_cast<double>(gAllocations.load() - allocationsBefore) / result.delivered : 0;
+        result.senderStats = sender.stats();
+        std::sort(latencies.begin(), latencies.end());
+        auto percentile = [&latencies](double ratio) -> IUINT32
+        {
+            if(latencies.empty())
+            {
+                return 0;
+            }
+            return latencies[std::min(latencies.size() - 1, static_cast<std::size_t>(ratio * latencies.size()))];
+        };
+        result.p50 = percentile(0.5);
+        result.p99 = percentile(0.99);
+        result.p999 = percentile(0.999);
+        return result;
+    }
+
+    void printHeader()
+    {
+        std::printf("%-8s %5s %6s %5s %6s %6s | %11s %9s %11s | %6s %6s %6s | %9s %8s\n",
+            "preset", "mtu", "size", "loss", "delay", "jitter", "msg/s", "MB/s", "sim msg/s", "p50", "p99", "p999",
+            "allocs/msg", "rexmit%");
+    }
+
+    void printResult(const Options &options, const Preset &preset, const Result &result)
+    {
+        double wallRate = result.wallSeconds > 0 ? result.delivered / result.wallSeconds : 0;
+        double simulatedRate = result.simulatedMillisec > 0 ? result.delivered * 1000.0 / result.simulatedMillisec : 0;
+        const ikcp::SessionStats &stats = result.senderStats;
+        double retransmitRatio = stats.segmentsSent != 0 ?
+            100.0 * (stats.retransmits + stats.fastRetransmits) / stats.segmentsSent : 0;
+        std::printf("%-8s %5d %6zu %5.2f %6u %6u | %11.0f %9.2f %11.0f | %6u %6u %6u | %9.3f %8.2f%s\n",
+            preset.name, options.mtu, options.size, options.loss, options.delay, options.jitter,
+            wallRate, wallRate * options.size / (1024 * 1024), simulatedRate, result.p50, result.p99, result.p999,
+            result.allocationsPerMessage, retransmitRatio, result.delivered < options.messages ? " (timed out)" : "");
+    }
+
+    bool parse(int argc, char *argv[], Options &options, bool &matrix)
+    {
+        matrix = true;
+        for(int i = 1; i < argc; ++i)
+        {
+            std::string arg = argv[i];
+            if(i + 1 >= argc)
+            {
+                return false;
+            }
+            const char *value = argv[++i];
+            if(arg == "--messages") options.messages = std::strtoul(value, nullptr, 10);
+            else if(arg == "--size") options.size = std::strtoul(value, nullptr, 10);
+            else if(arg == "--loss") { options.loss = std::atof(value); matrix = false; }
+            else if(arg == "--delay") { options.delay = std::strtoul(value, nullptr, 10); matrix = false; }
+            else if(arg == "--jitter") { options.jitter = std::strtoul(value, nullptr, 10); matrix = false; }
+            else if(arg == "--mtu") { options.mtu = std::atoi(value); matrix = false; }
+            else if(arg == "--preset") { options.preset = value; matrix = false; }
+            else if(arg == "--seed") options.seed = static_cast<unsigned>(std::strtoul(value, nullptr, 10));
+            else return false;
+        }
+        return findPreset(options.preset) != nullptr;
+    }
+}
+
+// Counts every allocation, not only KCP's. GCC sees the library's `::operator new`/`delete` pairs inlined around
+// these replacements and flags malloc() memory released by free(), which is exactly how they are paired.
+#if defined(__GNUC__) && !defined(__clang__) && __GNUC__ >= 11
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wmismatched-new-delete"
+#endif
+
+void *operator new(std::size_t size)
+{
+    ++gAllocations;
+    if(void *memory = std::malloc(size != 0 ? size : 1))
+    {
+        return memory;
+    }
+    throw std::bad_alloc();
+}
+
+void operator delete(void *memory) noexcept
+{
+    std::free(memory);
+}
+
+void operator delete(void *memory, std::size_t) noexcept
+{
+    std::free(memory);
+}
+
+#if defined(__GNUC__) && !defined(__clang__) && __GNUC__ >= 11
+#pragma GCC diagnostic pop
+#endif
+
+int main(int argc, char *argv[])
+{
+    Options options;
+    bool matrix;
+    if(!parse(argc, argv, options, matrix))
+    {
+        std::fprintf(stderr, "usage: %s [--messages N] [--size BYTES] [--loss RATIO] [--delay MS] [--jitter MS] "
+            "[--mtu BYTES] [--preset normal|fast|fastest] [--seed N]\n", argv[0]);
+        return 1;
+    }
+    ikcp::KCPSession::setAllocator(countingMalloc, std::free);
+    printHeader();
+    if(!matrix)
+    {
+        const Preset &preset = *findPreset(options.preset);
+        printResult(options, preset, run(options, preset));
+        return 0;
+    }
+    struct LinkProfile
+    {
+        double loss;
+        IUINT32 delay;
+        IUINT32 jitter;
+    };
+    const LinkProfile Links[] = {{0, 0, 0}, {0.02, 20, 5}, {0.05, 50, 20}};
+    const int MTUs[] = {576, 1400};
+    for(const LinkProfile &link : Links)
+    {
+        for(const Preset &preset : Presets)
+        {
+            for(int mtu : MTUs)
+            {
+                Options current = options;
+                current.loss = link.loss;
+                current.delay = link.delay;
+                current.jitter = link.jitter;
+                current.mtu = mtu;
+                printResult(current, preset, run(current, preset));
+            }
+        }
+    }
+    return 0;
+}
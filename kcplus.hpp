@@ -14,57 +14,1094 @@
     limitations under the License.
 */
 
+#ifndef KCPLUS_HPP
+#define KCPLUS_HPP
+
+#include <algorithm>
+#include <atomic>
+#include <cassert>
+#include <chrono>
+#include <cstdarg>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
 #include <functional>
 #include <memory>
+#include <mutex>
 #include <stdexcept>
+#include <string>
+#include <vector>
 #include <ikcp.h>
+#include "kcplus_queue.hpp"
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <sys/uio.h>
+#define KCPLUS_HAS_IOVEC 1
+#endif
+
+// Trace points of sessions, see `kcplus_trace.hpp`. They compile to nothing unless `KCPLUS_TRACE` is defined.
+#ifdef KCPLUS_TRACE
+#include "kcplus_trace.hpp"
+#define KCPLUS_TRACE_INSTANT(event, conv, arg) ::ikcp::Trace::instant(::ikcp::Trace::event, conv, arg)
+#define KCPLUS_TRACE_SCOPE(event, conv, arg) ::ikcp::TraceScope kcplusTraceScope(::ikcp::Trace::event, conv, arg)
+#else
+#define KCPLUS_TRACE_INSTANT(event, conv, arg) ((void)sizeof((conv), (arg)))
+#define KCPLUS_TRACE_SCOPE(event, conv, arg) ((void)sizeof((conv), (arg)))
+#endif
+
+#if defined(__cpp_impl_coroutine) && defined(__has_include)
+#if __has_include(<coroutine>)
+#include <coroutine>
+#include <exception>
+#define KCPLUS_HAS_COROUTINES 1
+#endif
+#endif
+
+namespace ikcp
+{
+    using IUINT32 = IUINT32;
+    using SizeType = std::size_t;
+
+    /**
+     * @brief Size of KCP segment header (`IKCP_OVERHEAD` in ikcp.c).
+     */
+    constexpr SizeType KCPOverhead = 24;
+
+    /**
+     * @brief Cached monotonic millisecond clock for `update()`. (KCPlus feature)
+     * @details
+     * Timestamps are millisec of `std::chrono::steady_clock` truncated to 32 bits, so they wrap around every 49.7
+     * days, which KCP handles fine. Compare them with `difference()`, not with `<`.
+     * The clock is read by `tick()`, once per event loop iteration. `now()` only returns the value cached for the
+     * calling thread, so updating thousands of sessions in a row costs no clock call at all.
+     */
+    class Clock
+    {
+    public:
+        /**
+         * @brief Reads the monotonic clock, and caches it for the calling thread.
+         * @return Current timestamp in millisec.
+         */
+        static IUINT32 tick()
+        {
+            cached() = read();
+            return cached();
+        }
+
+        /**
+         * @brief Returns the timestamp of the last `tick()` of the calling thread.
+         * @details The first call on a thread ticks by itself.
+         */
+        static IUINT32 now()
+        {
+            return cached();
+        }
+
+        /**
+         * @brief Returns `later - earlier` in millisec, correct across wraparound as long as they are 24 days apart at most.
+         */
+        static IINT32 difference(IUINT32 later, IUINT32 earlier)
+        {
+            return static_cast<IINT32>(later - earlier);
+        }
+
+        /**
+         * @brief Reads the monotonic clock without caching.
+         */
+        static IUINT32 read()
+        {
+            return static_cast<IUINT32>(std::chrono::duration_cast<std::chrono::milliseconds>(
+                std::chrono::steady_clock::now().time_since_epoch()).count());
+        }
+    private:
+        static IUINT32 &cached()
+        {
+            thread_local IUINT32 timestamp = read();
+            return timestamp;
+        }
+    };
+
+    /**
+     * @brief Per-thread pool of recyclable buffers backing `Packet::data`. (KCPlus feature)
+     * @details
+     * Buffers are grouped into power-of-two size classes from `MinBlockSize` to `MaxBlockSize`. Released buffers are
+     * kept in a free list of their size class (at most `MaxCachedPerClass` of them) and reused by later allocations,
+     * so steady-state receiving does no heap allocation. Larger buffers bypass the pool.
+     * A buffer is always released into the pool of the thread that releases it, so packets can be passed between
+     * threads freely.
+     */
+    class PacketBufferPool
+    {
+    public:
+        constexpr static const SizeType MinBlockSize = 64;
+        constexpr static const SizeType MaxBlockSize = 64 * 1024;
+        constexpr static const SizeType MaxCachedPerClass = 64;
+        constexpr static const unsigned char NotPooled = 0xff;
+
+        PacketBufferPool()
+        {
+            for(SizeType i = 0; i < NumOfClasses; ++i)
+            {
+                mFreeList[i] = nullptr;
+                mNumOfCached[i] = 0;
+            }
+            alive() = true;
+        }
+
+        PacketBufferPool(const PacketBufferPool &) = delete;
+        PacketBufferPool &operator=(const PacketBufferPool &) = delete;
+
+        ~PacketBufferPool()
+        {
+            alive() = false;
+            for(SizeType i = 0; i < NumOfClasses; ++i)
+            {
+                while(mFreeList[i] != nullptr)
+                {
+                    FreeBlock *block = mFreeList[i];
+                    mFreeList[i] = block->next;
+                    delete [] reinterpret_cast<char *>(block);
+                }
+            }
+        }
+
+        /**
+         * @brief Returns the pool of the calling thread.
+         */
+        static PacketBufferPool &local()
+        {
+            thread_local PacketBufferPool pool;
+            return pool;
+        }
+
+        /**
+         * @brief Allocates a buffer of at least `size` bytes.
+         * @param size Requested size.
+         * @param sizeClass Receives the size class of the buffer, pass it back to `release()`.
+         * @return The buffer.
+         */
+        char *allocate(SizeType size, unsigned char &sizeClass)
+        {
+            if(size > MaxBlockSize)
+            {
+                sizeClass = NotPooled;
+                return new char[size];
+            }
+            sizeClass = classOf(size);
+            FreeBlock *block = mFreeList[sizeClass];
+            if(block == nullptr)
+            {
+                return new char[MinBlockSize << sizeClass];
+            }
+            mFreeList[sizeClass] = block->next;
+            --mNumOfCached[sizeClass];
+            return reinterpret_cast<char *>(block);
+        }
+
+        /**
+         * @brief Gives a buffer allocated by `allocate()` (of any thread's pool) back to this pool.
+         */
+        void release(char *buffer, unsigned char sizeClass)
+        {
+            if(sizeClass == NotPooled || mNumOfCached[sizeClass] >= MaxCachedPerClass)
+            {
+                delete [] buffer;
+                return;
+            }
+            FreeBlock *block = reinterpret_cast<FreeBlock *>(buffer);
+            block->next = mFreeList[sizeClass];
+            mFreeList[sizeClass] = block;
+            ++mNumOfCached[sizeClass];
+        }
+
+        /**
+         * @brief Releases a buffer into the pool of the calling thread, or frees it if that pool is already destroyed.
+         */
+        static void releaseLocal(char *buffer, unsigned char sizeClass)
+        {
+            if(alive())
+            {
+                local().release(buffer, sizeClass);
+            }
+            else
+            {
+                delete [] buffer;
+            }
+        }
+    private:
+        struct FreeBlock
+        {
+            FreeBlock *next;
+        };
+
+        constexpr static const SizeType NumOfClasses = 11; // 64B ... 64KB
+
+        FreeBlock *mFreeList[NumOfClasses];
+        SizeType mNumOfCached[NumOfClasses];
+
+        static unsigned char classOf(SizeType size)
+        {
+            unsigned char sizeClass = 0;
+            while((MinBlockSize << sizeClass) < size)
+            {
+                ++sizeClass;
+            }
+            return sizeClass;
+        }
+
+        static bool &alive()
+        {
+            // Trivially destructible, so it stays valid while other thread-local objects are being destroyed.
+            thread_local bool isAlive = false;
+            return isAlive;
+        }
+    };
+
+    /**
+     * @brief Deleter of `Packet::data`, gives pooled buffers back to `PacketBufferPool`.
+     */
+    struct PacketDeleter
+    {
+        unsigned char sizeClass = PacketBufferPool::NotPooled;
+
+        void operator()(char *buffer) const
+        {
+            PacketBufferPool::releaseLocal(buffer, sizeClass);
+        }
+    };
+
+    /**
+     * @brief Deallocator set by `KCPSession::setAllocator()`, shared by every session type. (KCPlus feature)
+     * @details ikcp.h has no way to ask for it, but `KCPSession::reset()` needs it to free segments.
+     */
+    struct InstalledAllocator
+    {
+        using Deallocator = void (*)(void *);
+
+        static Deallocator &deallocator()
+        {
+            static Deallocator installed = nullptr; // nullptr means ikcp.c uses free().
+            return installed;
+        }
+    };
+
+    /**
+     * @brief Accounts memory allocated by KCP to the sessions it belongs to, against per-session and process-wide
+     * limits. (KCPlus feature)
+     * @details
+     * Installed as the KCP allocator, it puts a small header in front of every block, holding its size and the
+     * account of the session which was running when it was allocated. Sessions account their segments, ACK lists
+     * and flush buffers this way, see `KCPSession::setMemoryLimit()` and `SessionStats::memoryUsage`.
+     * Above a limit, sessions shed load: `send()` rejects packets, windows shrink so peers slow down, and
+     * `KCPServer` evicts the sessions using the most memory once the global limit is exceeded.
+     * Install it once at startup, before any session is created, as blocks allocated before can't be freed by it:
+     * @code
+     * ikcp::MemoryAccounting::install(ikcp::SegmentPool::allocate, ikcp::SegmentPool::deallocate);
+     * ikcp::MemoryAccounting::setGlobalLimit(512 * 1024 * 1024);
+     * @endcode
+     */
+    class MemoryAccounting
+    {
+    public:
+        /**
+         * @brief Bytes in front of every block, taken into account by `SegmentPool` size classes.
+         */
+        constexpr static const SizeType HeaderSize = sizeof(std::max_align_t);
+
+        /**
+         * @brief Memory used by one session. It must outlive the blocks allocated on it.
+         */
+        struct Account
+        {
+            SizeType used = 0;
+            SizeType limit = 0;     ///< 0 for none.
+        };
+
+        /**
+         * @brief Accounts allocations of the calling thread to `account` while it lives.
+         */
+        class Scope
+        {
+        public:
+            explicit Scope(Account &account)
+                :mPrevious(current())
+            {
+                current() = &account;
+            }
+
+            ~Scope()
+            {
+                current() = mPrevious;
+            }
+
+            Scope(const Scope &) = delete;
+            Scope &operator=(const Scope &) = delete;
+        private:
+            Account *mPrevious;
+        };
+
+        /**
+         * @brief Installs accounting as the KCP allocator, on top of `allocator`/`deallocator`.
+         * @param allocator Allocator the blocks come from, `nullptr` for `malloc()`.
+         * @param deallocator Its deallocator, `nullptr` for `free()`.
+         */
+        static void install(void *(*allocator)(size_t) = nullptr, void (*deallocator)(void *) = nullptr)
+        {
+            state().allocator = allocator;
+            state().deallocator = deallocator;
+            state().installed = true;
+            ikcp_allocator(allocate, deallocate);
+            InstalledAllocator::deallocator() = deallocate;
+        }
+
+        static bool isInstalled()
+        {
+            return state().installed;
+        }
+
+        /**
+         * @brief Sets the process-wide limit in bytes, 0 for none.
+         */
+        static void setGlobalLimit(SizeType limit)
+        {
+            state().limit.store(limit, std::memory_order_relaxed);
+        }
+
+        static SizeType globalLimit()
+        {
+            return state().limit.load(std::memory_order_relaxed);
+        }
+
+        /**
+         * @brief Returns bytes allocated by KCP in the whole process, headers excluded.
+         */
+        static SizeType globalUsage()
+        {
+            return state().used.load(std::memory_order_relaxed);
+        }
+
+        /**
+         * @brief Returns whether usage reached `limit`, or for `relief`, whether it came back down to 3/4 of it.
+         */
+        static bool isOver(SizeType used, SizeType limit, bool relief = false)
+        {
+            if(limit == 0)
+            {
+                return false;
+            }
+            return relief ? used > limit / 4 * 3 : used >= limit;
+        }
+
+        /**
+         * @brief Returns whether the process-wide limit is reached. See `isOver()`.
+         */
+        static bool isGloballyOver(bool relief = false)
+        {
+            return isOver(globalUsage(), globalLimit(), relief);
+        }
+    private:
+        struct Block
+        {
+            Account *owner;
+            SizeType size;
+        };
+
+        union Header
+        {
+            std::max_align_t alignment; // Keeps the memory after the header aligned as malloc() does.
+            Block block;
+        };
+
+        struct State
+        {
+            void *(*allocator)(size_t) = nullptr;
+            void (*deallocator)(void *) = nullptr;
+            bool installed = false;
+            std::atomic<SizeType> used{0};
+            std::atomic<SizeType> limit{0};
+        };
+
+        static State &state()
+        {
+            static State instance;
+            return instance;
+        }
+
+        static Account *&current()
+        {
+            thread_local Account *account = nullptr;
+            return account;
+        }
+
+        static void *allocate(size_t size)
+        {
+            State &global = state();
+            void *memory = global.allocator != nullptr ? global.allocator(sizeof(Header) + size) :
+                std::malloc(sizeof(Header) + size);
+            if(memory == nullptr)
+            {
+                return nullptr;
+            }
+            Header *header = static_cast<Header *>(memory);
+            header->block.owner = current();
+            header->block.size = size;
+            if(header->block.owner != nullptr)
+            {
+                header->block.owner->used += size;
+            }
+            global.used.fetch_add(size, std::memory_order_relaxed);
+            return header + 1;
+        }
+
+        static void deallocate(void *memory)
+        {
+            if(memory == nullptr)
+            {
+                return;
+            }
+            State &global = state();
+            Header *header = static_cast<Header *>(memory) - 1;
+            if(header->block.owner != nullptr)
+            {
+                header->block.owner->used -= header->block.size;
+            }
+            global.used.fetch_sub(header->block.size, std::memory_order_relaxed);
+            if(global.deallocator != nullptr)
+            {
+                global.deallocator(header);
+            }
+            else
+            {
+                std::free(header);
+            }
+        }
+    };
+
+    /**
+     * @brief Per-thread pool of KCP segments, to be installed by `KCPSession::setAllocator()`. (KCPlus feature)
+     * @details
+     * ikcp.c allocates a segment for every packet sent or received, all through one process-wide allocator. This
+     * pool keeps freed blocks in free lists of the calling thread instead, so sessions on different threads never
+     * contend. Blocks come in a few small classes for ACK-sized segments, and one class of exactly a full segment
+     * (`sizeof(IKCPSEG)` plus MSS), so full segments waste no space. Larger allocations, like the flush buffer of
+     * ikcpcb, go straight to `malloc()`.
+     * Every block starts with a small header holding its class, so it can be freed by any thread.
+     * @code
+     * ikcp::SegmentPool::configure(1400);
+     * ikcp::KCPSession::setAllocator(ikcp::SegmentPool::allocate, ikcp::SegmentPool::deallocate);
+     * @endcode
+     */
+    class SegmentPool
+    {
+    public:
+        constexpr static const SizeType DefaultMaxCachedPerClass = 1024;
+
+        /**
+         * @brief Usage counters of one thread's pool.
+         */
+        struct Stats
+        {
+            std::uint64_t allocations;      ///< Blocks allocated.
+            std::uint64_t hits;             ///< Allocations served by the free lists.
+            std::uint64_t deallocations;    ///< Blocks freed.
+            std::uint64_t blocksCached;     ///< Blocks in the free lists now.
+            std::uint64_t bytesCached;      ///< Bytes in the free lists now.
+        };
+
+        /**
+         * @brief Sets the MTU the full segment class is sized for, and how many blocks each thread keeps per class.
+         * @details Call it once at startup, before installing the pool. By default it's 1400 and 1024 blocks.
+         */
+        static void configure(int mtu, SizeType maxCachedPerClass = DefaultMaxCachedPerClass)
+        {
+            settings().fullSegmentSize = sizeof(IKCPSEG) + static_cast<SizeType>(mtu) - KCPOverhead;
+            settings().maxCachedPerClass = maxCachedPerClass;
+        }
+
+        /**
+         * @brief Allocates `size` bytes. Matches `malloc()`, so that it can be passed to `KCPSession::setAllocator()`.
+         */
+        static void *allocate(size_t size)
+        {
+            if(destroyed())
+            {
+                return allocateUnpooled(size);
+            }
+            return local().allocateBlock(size);
+        }
+
+        /**
+         * @brief Frees memory returned by `allocate()` on any thread into the pool of the calling thread.
+         */
+        static void deallocate(void *memory)
+        {
+            if(memory == nullptr)
+            {
+                return;
+            }
+            Header *header = static_cast<Header *>(memory) - 1;
+            if(destroyed())
+            {
+                std::free(header);
+            }
+            else
+            {
+                local().deallocateBlock(header);
+            }
+        }
+
+        /**
+         * @brief Returns usage counters of the calling thread's pool.
+         */
+        static Stats stats()
+        {
+            return local().mStats;
+        }
+    private:
+        union Header
+        {
+            std::max_align_t alignment; // Keeps the memory after the header aligned as malloc() does.
+            unsigned char sizeClass;
+        };
+
+        struct FreeBlock
+        {
+            FreeBlock *next;
+        };
+
+        struct Settings
+        {
+            SizeType fullSegmentSize = sizeof(IKCPSEG) + 1400 - KCPOverhead;
+            SizeType maxCachedPerClass = DefaultMaxCachedPerClass;
+        };
+
+        constexpr static const SizeType NumOfClasses = 5; // 64B, 128B, 256B, 512B and a full segment.
+        constexpr static const unsigned char NotPooled = 0xff;
+
+        SizeType mClassSize[NumOfClasses];
+        SizeType mMaxCachedPerClass;
+        FreeBlock *mFreeList[NumOfClasses];
+        SizeType mNumOfCached[NumOfClasses];
+        Stats mStats;
+
+        SegmentPool()
+            :mMaxCachedPerClass(settings().maxCachedPerClass),mStats()
+        {
+            for(SizeType i = 0; i < NumOfClasses; ++i)
+            {
+                mClassSize[i] = static_cast<SizeType>(64) << i;
+                mFreeList[i] = nullptr;
+                mNumOfCached[i] = 0;
+            }
+            // Room for the header of `MemoryAccounting`, in case the pool is installed under it.
+            mClassSize[NumOfClasses - 1] = std::max(settings().fullSegmentSize + MemoryAccounting::HeaderSize,
+                mClassSize[NumOfClasses - 2] * 2);
+        }
+
+        ~SegmentPool()
+        {
+            destroyed() = true;
+            for(SizeType i = 0; i < NumOfClasses; ++i)
+            {
+                while(mFreeList[i] != nullptr)
+                {
+                    FreeBlock *block = mFreeList[i];
+                    mFreeList[i] = block->next;
+                    std::free(reinterpret_cast<Header *>(block) - 1);
+                }
+            }
+        }
+
+        SegmentPool(const SegmentPool &) = delete;
+        SegmentPool &operator=(const SegmentPool &) = delete;
+
+        static SegmentPool &local()
+        {
+            thread_local SegmentPool pool;
+            return pool;
+        }
+
+        static bool &destroyed()
+        {
+            // Trivially destructible, so it stays valid while other thread-local objects are being destroyed.
+            thread_local bool isDestroyed = false;
+            return isDestroyed;
+        }
+
+        static Settings &settings()
+        {
+            static Settings instance;
+            return instance;
+        }
+
+        static void *allocateUnpooled(SizeType size)
+        {
+            Header *header = static_cast<Header *>(std::malloc(sizeof(Header) + size));
+            if(header == nullptr)
+            {
+                return nullptr;
+            }
+            header->sizeClass = NotPooled;
+            return header + 1;
+        }
+
+        void *allocateBlock(SizeType size)
+        {
+            ++mStats.allocations;
+            unsigned char sizeClass = 0;
+            while(sizeClass < NumOfClasses && mClassSize[sizeClass] < size)
+            {
+                ++sizeClass;
+            }
+            if(sizeClass == NumOfClasses)
+            {
+                return allocateUnpooled(size);
+            }
+            Header *header;
+            if(mFreeList[sizeClass] != nullptr)
+            {
+                FreeBlock *block = mFreeList[sizeClass];
+                mFreeList[sizeClass] = block->next;
+                --mNumOfCached[sizeClass];
+                --mStats.blocksCached;
+                mStats.bytesCached -= mClassSize[sizeClass];
+                ++mStats.hits;
+                header = reinterpret_cast<Header *>(block) - 1;
+            }
+            else
+            {
+                header = static_cast<Header *>(std::malloc(sizeof(Header) + mClassSize[sizeClass]));
+                if(header == nullptr)
+                {
+                    return nullptr;
+                }
+            }
+            header->sizeClass = sizeClass;
+            return header + 1;
+        }
+
+        void deallocateBlock(Header *header)
+        {
+            ++mStats.deallocations;
+            unsigned char sizeClass = header->sizeClass;
+            if(sizeClass == NotPooled || mNumOfCached[sizeClass] >= mMaxCachedPerClass)
+            {
+                std::free(header);
+                return;
+            }
+            FreeBlock *block = reinterpret_cast<FreeBlock *>(header + 1);
+            block->next = mFreeList[sizeClass];
+            mFreeList[sizeClass] = block;
+            ++mNumOfCached[sizeClass];
+            ++mStats.blocksCached;
+            mStats.bytesCached += mClassSize[sizeClass];
+        }
+    };
+
+    /**
+     * @brief High-level packet returned by `KCPSession::receive()`.
+     * @details
+     * `data` field is `nullptr` and `size` field is `0` if there is no high-level packet available.
+     * `data` is backed by `PacketBufferPool`, and goes back to the pool when the packet is destroyed.
+     * @see KCPSession::receive()
+     */
+    struct Packet
+    {
+        std::unique_ptr<char [], PacketDeleter> data;
+        SizeType size;
+    };
+
+    /**
+     * @brief A fragment of a high-level packet, for scatter-gather `KCPSession::send()`. (KCPlus feature)
+     */
+    struct ConstBuffer
+    {
+        const void *data;
+        SizeType size;
+    };
+
+    /**
+     * @brief Encodings shared by the wire formats of KCPlus headers. (KCPlus feature)
+     * @details Integers are little-endian like KCP headers, sizes are base-128 varints.
+     */
+    struct WireFormat
+    {
+        constexpr static const SizeType MaxVarintSize = 5;
+
+        /**
+         * @brief Writes `value` as a varint of at most `MaxVarintSize` bytes for sizes below 2^35.
+         * @return Number of bytes written.
+         */
+        static SizeType encodeVarint(SizeType value, char data[])
+        {
+            SizeType length = 0;
+            do
+            {
+                unsigned char byte = static_cast<unsigned char>(value & 0x7f);
+                value >>= 7;
+                data[length++] = static_cast<char>(value != 0 ? byte | 0x80 : byte);
+            } while(value != 0);
+            return length;
+        }
+
+        /**
+         * @brief Reads a varint at `offset` of `data`, and moves `offset` past it.
+         * @return `false` if it's truncated or longer than `MaxVarintSize` bytes.
+         */
+        static bool decodeVarint(const char data[], SizeType size, SizeType &offset, SizeType &value)
+        {
+            value = 0;
+            for(SizeType shift = 0; offset < size && shift < 7 * MaxVarintSize; shift += 7)
+            {
+                unsigned char byte = static_cast<unsigned char>(data[offset++]);
+                value |= static_cast<SizeType>(byte & 0x7f) << shift;
+                if((byte & 0x80) == 0)
+                {
+                    return true;
+                }
+            }
+            return false;
+        }
+
+        static IUINT32 decode32(const char data[])
+        {
+            const unsigned char *bytes = reinterpret_cast<const unsigned char *>(data);
+            return static_cast<IUINT32>(bytes[0]) | (static_cast<IUINT32>(bytes[1]) << 8) |
+                (static_cast<IUINT32>(bytes[2]) << 16) | (static_cast<IUINT32>(bytes[3]) << 24);
+        }
+
+        static void encode64(std::uint64_t value, char data[])
+        {
+            for(SizeType i = 0; i < 8; ++i)
+            {
+                data[i] = static_cast<char>(value >> (8 * i));
+            }
+        }
+
+        static std::uint64_t decode64(const char data[])
+        {
+            return static_cast<std::uint64_t>(decode32(data)) | static_cast<std::uint64_t>(decode32(data + 4)) << 32;
+        }
+    };
+
+    /**
+     * @brief Snapshot of a session's state and counters, returned by `KCPSession::stats()`. (KCPlus feature)
+     */
+    struct SessionStats
+    {
+        IINT32 rtt;                     ///< Smoothed RTT in millisec.
+        IINT32 rttVariance;             ///< RTT variance in millisec.
+        IINT32 rto;                     ///< Retransmission timeout in millisec.
+        IUINT32 mtu;                    ///< MTU in bytes.
+        IUINT32 congestionWindow;       ///< Congestion window in segments.
+        IUINT32 slowStartThreshold;     ///< Slow start threshold in segments.
+        IUINT32 sendWindow;             ///< Maximum send window in segments.
+        IUINT32 receiveWindow;          ///< Maximum receive window in segments.
+        IUINT32 remoteWindow;           ///< Receive window advertised by the remote, in segments.
+        IUINT32 sendQueue;              ///< Segments waiting to enter the send window.
+        IUINT32 sendBuffer;             ///< Segments sent but not acknowledged yet.
+        IUINT32 receiveQueue;           ///< Segments ready to be received.
+        IUINT32 receiveBuffer;          ///< Segments received out of order.
+        std::uint64_t retransmits;      ///< Segments resent because of RTO.
+        std::uint64_t fastRetransmits;  ///< Segments resent early, because of fast resend or window probing.
+        std::uint64_t bytesSent;        ///< Bytes of low-level packets sent.
+        std::uint64_t datagramsSent;    ///< Low-level packets sent.
+        std::uint64_t segmentsSent;     ///< Data segments sent, including retransmits.
+        std::uint64_t bytesReceived;    ///< Bytes of low-level packets received.
+        std::uint64_t datagramsReceived;///< Low-level packets received.
+        std::uint64_t inputErrors;      ///< Low-level packets rejected by KCP.
+        std::uint64_t packetsSent;      ///< High-level packets sent.
+        std::uint64_t packetsReceived;  ///< High-level packets received.
+        std::uint64_t memoryUsage;      ///< Bytes allocated by KCP for the session, see `MemoryAccounting`.
+        std::uint64_t memoryRejects;    ///< Packets `send()` rejected because a memory limit was reached.
+        bool memoryShedding;            ///< Whether windows are shrunk because a memory limit was reached.
+    };
+
+    /**
+     * @brief Process-wide counters aggregated over every session. (KCPlus feature)
+     * @details
+     * Every thread bumps its own block of counters without atomic read-modify-write or sharing cache lines, and
+     * readers sum up all blocks. So they are cheap enough to stay on in production.
+     */
+    class GlobalStats
+    {
+    public:
+        enum Counter
+        {
+            Sessions,
+            BytesSent,
+            DatagramsSent,
+            SegmentsSent,
+            Retransmits,
+            BytesReceived,
+            DatagramsReceived,
+            InputErrors,
+            PacketsSent,
+            PacketsReceived,
+            MemoryRejects,
+            MemoryEvictions,
+            NumOfCounters
+        };
+
+        /**
+         * @brief Adds `value` to `counter` of the calling thread.
+         */
+        static void add(Counter counter, std::uint64_t value)
+        {
+            std::atomic<std::uint64_t> &slot = local().values[counter];
+            slot.store(slot.load(std::memory_order_relaxed) + value, std::memory_order_relaxed);
+        }
+
+        /**
+         * @brief Returns the sum of `counter` over all threads.
+         */
+        static std::uint64_t get(Counter counter)
+        {
+            std::lock_guard<std::mutex> lock(registry().mutex);
+            std::uint64_t sum = registry().retired[counter];
+            for(const Block *block : registry().blocks)
+            {
+                sum += block->values[counter].load(std::memory_order_relaxed);
+            }
+            return sum;
+        }
+
+        /**
+         * @brief Returns the name of `counter`, as used by `toPrometheus()`.
+         */
+        static const char *name(Counter counter)
+        {
+            static const char *const names[NumOfCounters] = {
+                "sessions", "bytes_sent_total", "datagrams_sent_total", "segments_sent_total", "retransmits_total",
+                "bytes_received_total", "datagrams_received_total", "input_errors_total", "packets_sent_total",
+                "packets_received_total", "memory_rejects_total", "memory_evictions_total"
+            };
+            return names[counter];
+        }
+
+        /**
+         * @brief Formats all counters in Prometheus text exposition format.
+         * @param prefix Prefix of metric names.
+         */
+        static std::string toPrometheus(const std::string &prefix = "kcplus_")
+        {
+            std::string text;
+            for(int i = 0; i < NumOfCounters; ++i)
+            {
+                Counter counter = static_cast<Counter>(i);
+                std::string metric = prefix + name(counter);
+                text += "# TYPE " + metric + (counter == Sessions ? " gauge\n" : " counter\n");
+                text += metric + " " + std::to_string(get(counter)) + "\n";
+            }
+            return text;
+        }
+    private:
+        struct Block;
+
+        struct Registry
+        {
+            std::mutex mutex;
+            std::vector<Block *> blocks;
+            std::uint64_t retired[NumOfCounters] = {};
+        };
+
+        struct Block
+        {
+            std::atomic<std::uint64_t> values[NumOfCounters];
+
+            Block()
+            {
+                for(auto &value : values)
+                {
+                    value.store(0, std::memory_order_relaxed);
+                }
+                std::lock_guard<std::mutex> lock(registry().mutex);
+                registry().blocks.push_back(this);
+            }
 
-namespace ikcp
-{
-    using IUINT32 = IUINT32;
-    using SizeType = std::size_t;
+            ~Block()
+            {
+                // Keeps counts of exited threads.
+                std::lock_guard<std::mutex> lock(registry().mutex);
+                for(int i = 0; i < NumOfCounters; ++i)
+                {
+                    registry().retired[i] += values[i].load(std::memory_order_relaxed);
+                }
+                std::vector<Block *> &blocks = registry().blocks;
+                blocks.erase(std::find(blocks.begin(), blocks.end(), this));
+            }
+        };
+
+        static Registry &registry()
+        {
+            static Registry instance;
+            return instance;
+        }
+
+        static Block &local()
+        {
+            thread_local Block block;
+            return block;
+        }
+    };
 
+#ifdef KCPLUS_HAS_COROUTINES
     /**
-     * @brief High-level packet returned by `KCPSession::receive()`.
+     * @brief Return type of fire-and-forget coroutines awaiting sessions. (KCPlus feature)
      * @details
-     * `data` field is `nullptr` and `size` field is `0` if there is no high-level packet available.
-     * @see KCPSession::receive()
+     * The coroutine starts running right away and its frame is freed when it returns, so a protocol handler costs
+     * one allocation for its whole life, not one per packet. Exceptions escaping it call `std::terminate()`.
+     * Only if `KCPLUS_HAS_COROUTINES` is defined (C++20).
+     * @see KCPSession::recv()
      */
-    struct Packet
+    struct DetachedTask
     {
-        std::unique_ptr<char [], std::default_delete<char []>> data;
-        SizeType size;
+        struct promise_type
+        {
+            DetachedTask get_return_object() noexcept
+            {
+                return DetachedTask();
+            }
+
+            std::suspend_never initial_suspend() noexcept
+            {
+                return std::suspend_never();
+            }
+
+            std::suspend_never final_suspend() noexcept
+            {
+                return std::suspend_never();
+            }
+
+            void return_void() noexcept
+            {
+            }
+
+            void unhandled_exception() noexcept
+            {
+                std::terminate();
+            }
+        };
     };
+#endif
 
     /**
-     * @brief A KCP session for sending/receiving packets.
+     * @brief Result of sending through `KCPSession::send()` or `KCPSession::enqueueSend()`.
+     */
+    enum class SendStatus
+    {
+        Ok,             ///< Accepted.
+        Backpressure,   ///< Accepted, but over the backpressure threshold. Slow down.
+        WouldBlock      ///< Rejected, the queue is full. Try again later.
+    };
+
+    /**
+     * @brief A KCP session for sending/receiving packets, with compile-time output and receive sinks.
+     * @details
+     * Sinks are called directly, so stateless function objects get inlined into the output trampoline and async
+     * delivery, without the indirect call (and possible allocation) of `std::function`.
+     * Most of the time you want `KCPSession`, which uses `std::function` sinks.
+     * @tparam OutputSink Callable as `void(const char buf[], SizeType len)`, sends a low-level packet.
+     * @tparam ReceiveSink Callable as `void(Packet packet)`, receives a high-level packet under async mode.
+     * @see KCPSession
      */
-    class KCPSession
+    template<class OutputSink, class ReceiveSink>
+    class BasicKCPSession
     {
     public:
         using Timestamp = IUINT32;
-        using OutputFunction = std::function<void(const char buf[], SizeType len)>;
-        using receiveCallback = std::function<void(Packet packet)>;
+        using OutputFunction = OutputSink;
+        using receiveCallback = ReceiveSink;
+        using batchReceiveCallback = std::function<void(std::vector<Packet> &packets)>;
+        using writableCallback = std::function<void()>;
         /**
          * @param conv
          * The connection identifier.
          * Must be equal between two endpoint KCPSession.
+         * @param outputSink See `setOutputFunction()`.
+         * @param receiveSink See `setReceiveCallback()`.
          */
-        KCPSession(IUINT32 conv = 0)
-            :mKcp(ikcp_create(conv,this)),mOutputFunc(nullptr)
+        BasicKCPSession(IUINT32 conv = 0, OutputSink outputSink = OutputSink(), ReceiveSink receiveSink = ReceiveSink())
+            :mKcp(create(conv)),mOutputFunc(std::move(outputSink)),mAsyncMode(false),
+            mReceiveFunc(std::move(receiveSink)),mMaxDeliveriesPerCall(0),mBackpressureThreshold(0),mPendingPackets(0)
         {
             mKcp->output = mOutputFuncRaw;
+            GlobalStats::add(GlobalStats::Sessions, 1);
         };
 
-        ~KCPSession()
+        ~BasicKCPSession()
         {
             ikcp_release(mKcp);
+            GlobalStats::add(GlobalStats::Sessions, static_cast<std::uint64_t>(-1));
+        }
+
+        BasicKCPSession(const BasicKCPSession &) = delete;
+        BasicKCPSession &operator=(const BasicKCPSession &) = delete;
+
+        /**
+         * @brief Returns the session to its state right after construction, with a new conv. (KCPlus feature)
+         * @details
+         * Queued segments are freed, but the control block, its flush buffer and ACK list are kept, so a recycled
+         * session costs no allocation of its own. Configuration stays as it is: MTU, windows, `setProperties()`,
+         * stream mode, coalescing, watermarks and callbacks. Counters start over.
+         * Segments are freed with the deallocator set by `setAllocator()`, so don't call `ikcp_allocator()` directly.
+         * No coroutine may be awaiting the session.
+         * @param conv The new connection identifier.
+         * @see KCPServer::setSessionPool()
+         */
+        void reset(IUINT32 conv)
+        {
+#ifdef KCPLUS_HAS_COROUTINES
+            assert(!mReceiveWaiter && !mDrainWaiter);
+#endif
+            freeSegments(mKcp->snd_queue);
+            freeSegments(mKcp->rcv_queue);
+            freeSegments(mKcp->snd_buf);
+            freeSegments(mKcp->rcv_buf);
+            mKcp->nsnd_que = mKcp->nrcv_que = mKcp->nsnd_buf = mKcp->nrcv_buf = 0;
+            // Same values as ikcp_create().
+            mKcp->conv = conv;
+            mKcp->state = 0;
+            mKcp->snd_una = mKcp->snd_nxt = mKcp->rcv_nxt = 0;
+            mKcp->ts_recent = mKcp->ts_lastack = 0;
+            mKcp->ts_probe = mKcp->probe_wait = mKcp->probe = 0;
+            mKcp->ssthresh = InitialSlowStartThreshold;
+            mKcp->rx_srtt = mKcp->rx_rttval = 0;
+            mKcp->rx_rto = InitialRTO;
+            mKcp->rmt_wnd = InitialRemoteWindow;
+            mKcp->cwnd = mKcp->incr = 0;
+            mKcp->current = 0;
+            mKcp->ts_flush = mKcp->interval;
+            mKcp->xmit = 0;
+            mKcp->updated = 0;
+            mKcp->ackcount = 0;
+            stopShedding();
+
+            if(mSendQueue != nullptr)
+            {
+                Packet packet;
+                while(mSendQueue->tryPop(packet))
+                {
+                }
+            }
+            mPendingPackets.store(0, std::memory_order_relaxed);
+            mBatchPackets.clear();
+            mBlocked = false;
+            mCounters = Counters();
+            mNextSegmentNumber = 0;
+            mCoalesced.clear();
+            mBatch = Packet{nullptr, 0};
+            mBatchOffset = 0;
+            mStreamReadPos = mStreamWritePos = mStreamWrapPos = 0;
+            mStreamWrapped = false;
         }
 
         /**
          * @brief Turns on/off async mode. (KCPlus feature)
          * @details
          * Async mode: When a new packet arrived, callback set by `setReceiveCallback()` will be called.
+         * Every complete packet is delivered by a single `input()` call, unless limited by `setMaxDeliveriesPerCall()`.
          * You don't need to call `receive()` to receive packets.
          * You still need to call `update()` to provide timestamps and update state.
          * @param AsyncMode Async mode on/off
@@ -83,6 +1120,66 @@ namespace ikcp
             mReceiveFunc = receiveCallback;
         }
 
+        /**
+         * @brief Set batch packet receiving function under async mode. (KCPlus feature)
+         * @details
+         * If set, it takes precedence over the callback set by `setReceiveCallback()`: all packets delivered by one
+         * `input()`/`update()` call are handed over at once. Packets can be moved out of the vector, it will be
+         * cleared (but keeps its capacity) after the callback returns.
+         * @param batchReceiveCallback The callback function called with every newly arrived packet under async mode.
+         */
+        void setBatchReceiveCallback(batchReceiveCallback batchReceiveCallback)
+        {
+            mBatchReceiveFunc = batchReceiveCallback;
+        }
+
+        /**
+         * @brief Sets the maximum number of packets delivered per call under async mode. (KCPlus feature)
+         * @details
+         * By default it's 0, which means unlimited: every complete packet is delivered.
+         * Packets exceeding the limit stay queued, and will be delivered by next `input()`/`update()` call or by
+         * `deliverPendingPackets()`. Keeps one busy session from hogging the event loop.
+         * @param maxDeliveries Maximum number of packets delivered per call, 0 for unlimited.
+         */
+        void setMaxDeliveriesPerCall(SizeType maxDeliveries)
+        {
+            mMaxDeliveriesPerCall = maxDeliveries;
+        }
+
+        /**
+         * @brief Delivers queued packets to the receive callback under async mode. (KCPlus feature)
+         * @details
+         * Called by `input()` and `update()` already, you only need it if you want to deliver packets left by
+         * `setMaxDeliveriesPerCall()` limit earlier.
+         * @return Number of packets delivered.
+         */
+        SizeType deliverPendingPackets()
+        {
+            SizeType delivered = 0;
+            if(!mAsyncMode)
+            {
+                return delivered;
+            }
+            while(hasReceivablePacket() && (mMaxDeliveriesPerCall == 0 || delivered < mMaxDeliveriesPerCall))
+            {
+                if(mBatchReceiveFunc)
+                {
+                    mBatchPackets.push_back(receive());
+                }
+                else
+                {
+                    mReceiveFunc(receive());
+                }
+                ++delivered;
+            }
+            if(!mBatchPackets.empty())
+            {
+                mBatchReceiveFunc(mBatchPackets);
+                mBatchPackets.clear();
+            }
+            return delivered;
+        }
+
         /**
          * @brief Sets the callback function for sending a low-level packet to the remote.
          * @param outputFunction The callback function for sending a low-level packet to the remote.
@@ -99,12 +1196,33 @@ namespace ikcp
          */
         void input(const char data[], SizeType size)
         {
-            ikcp_input(mKcp, data, size);
-            if(mAsyncMode && hasReceivablePacket())
-            {
-                mReceiveFunc(std::move(receive()));
-            }
+            ConstBuffer datagram{data, size};
+            inputBuffers(&datagram, 1);
+        }
+
+        /**
+         * @brief Same as `input(const char data[], SizeType size)` for several low-level packets at once. (KCPlus feature)
+         * @details
+         * All packets are fed to KCP first, then received messages are delivered (and waiters resumed) once, instead
+         * of after every packet. ACKs of all of them go out together on next `flush()`/`update()`. Use it when a
+         * batch of datagrams from `recvmmsg()` holds several for this session.
+         * @param datagrams Low-level packets, in the order they were received.
+         * @param count Number of packets.
+         */
+        void input(const ConstBuffer datagrams[], SizeType count)
+        {
+            inputBuffers(datagrams, count);
+        }
+
+#ifdef KCPLUS_HAS_IOVEC
+        /**
+         * @brief Same as `input(const ConstBuffer datagrams[], SizeType count)`, for `iovec` arrays. (KCPlus feature)
+         */
+        void input(const iovec datagrams[], SizeType count)
+        {
+            inputBuffers(datagrams, count);
         }
+#endif
 
         /**
          * @brief Returns whether there is a new packet to receive(`receive()`) or not.
@@ -113,6 +1231,14 @@ namespace ikcp
          */
         bool hasReceivablePacket() const
         {
+            if(mStreamBuffer != nullptr)
+            {
+                return false;
+            }
+            if(mCoalesceThreshold != 0)
+            {
+                return mBatchOffset < mBatch.size;
+            }
             return ikcp_peeksize(mKcp) >= 0;
         }
 
@@ -125,6 +1251,13 @@ namespace ikcp
          */
         SizeType nextPacketSize() const
         {
+            if(mCoalesceThreshold != 0)
+            {
+                SizeType offset = mBatchOffset;
+                SizeType size = 0;
+                decodeFrame(offset, size);
+                return size;
+            }
             int size = ikcp_peeksize(mKcp);
             return size >= 0 ? static_cast<SizeType>(size) : 0;
         }
@@ -140,26 +1273,73 @@ namespace ikcp
         Packet receive()
         {
             Packet packet{nullptr, 0};
+            if(mCoalesceThreshold != 0)
+            {
+                if(hasReceivablePacket())
+                {
+                    SizeType size;
+                    decodeFrame(mBatchOffset, size);
+                    PacketDeleter deleter;
+                    packet.data = std::unique_ptr<char [], PacketDeleter>(
+                        PacketBufferPool::local().allocate(size, deleter.sizeClass), deleter);
+                    packet.size = size;
+                    std::memcpy(packet.data.get(), mBatch.data.get() + mBatchOffset, size);
+                    consumeFrame(size);
+                }
+                return packet;
+            }
             if(hasReceivablePacket())
             {
                 SizeType packetSize = nextPacketSize();
-#if __cplusplus == 201402L
-                packet.data = std::make_unique<char []>(packetSize);
-#else
-                packet.data = std::unique_ptr<char []>(new char[packetSize]);
-#endif
+                PacketDeleter deleter;
+                char *buffer = PacketBufferPool::local().allocate(packetSize, deleter.sizeClass);
+                packet.data = std::unique_ptr<char [], PacketDeleter>(buffer, deleter);
                 packet.size = packetSize;
-                if(ikcp_recv(mKcp, packet.data.get(), static_cast<int>(packetSize)) != packetSize)
+                if(ikcp_recv(mKcp, packet.data.get(), static_cast<int>(packetSize)) != static_cast<int>(packetSize))
                 {
                     throw std::runtime_error("receive: Internal inconsistency error!");
                     // Internal inconsistency error! `ikcp_recv()` should equal `ikcp_peeksize()` because they return
                     // size of the same packet.
                     // You DON'T need to catch this exception because it is generally a bug. Eg. multi-thread bug.
                 }
+                countReceivedPacket(packetSize);
             }
             return std::move(packet);
         }
 
+        /**
+         * @brief Receives a high-level packet into a caller-provided buffer.
+         * @details No allocation is done.
+         * @param buffer Buffer receiving packet data.
+         * @param capacity Size of buffer.
+         * @return Size of the received packet. Returns 0 if there is no packet available or `capacity` is smaller than
+         * `nextPacketSize()`, in which case the packet stays queued.
+         * @see hasReceivablePacket()
+         * @see nextPacketSize()
+         */
+        SizeType receive(char buffer[], SizeType capacity)
+        {
+            if(!hasReceivablePacket() || nextPacketSize() > capacity)
+            {
+                return 0;
+            }
+            if(mCoalesceThreshold != 0)
+            {
+                SizeType frameSize;
+                decodeFrame(mBatchOffset, frameSize);
+                std::memcpy(buffer, mBatch.data.get() + mBatchOffset, frameSize);
+                consumeFrame(frameSize);
+                return frameSize;
+            }
+            int size = ikcp_recv(mKcp, buffer, static_cast<int>(capacity));
+            if(size < 0)
+            {
+                return 0;
+            }
+            countReceivedPacket(static_cast<SizeType>(size));
+            return static_cast<SizeType>(size);
+        }
+
         /**
          * @brief Sends a high-level packet to the remote.
          * @details
@@ -167,20 +1347,48 @@ namespace ikcp
          * Call `flush()` to send them immediately, or wait for next `update()` call.
          * @param data Data to be sent.
          * @param size Size of data.
+         * @return `SendStatus::WouldBlock` if the packet was rejected by the high watermark (see `setWatermarks()`),
+         * otherwise `SendStatus::Ok`.
          *
          * @see update()
          * @see flush()
          */
-        void send(char data[], SizeType size)
+        SendStatus send(const void *data, SizeType size)
+        {
+            ConstBuffer buffer{data, size};
+            return sendIfWritable(&buffer, 1);
+        }
+
+        /**
+         * @brief Sends one high-level packet made of several fragments, eg. a header and a payload. (KCPlus feature)
+         * @details
+         * Fragments are copied straight into KCP segments, without concatenating them first.
+         * @param buffers Fragments of the packet, in order.
+         * @param count Number of fragments.
+         * @return See `send(const void *data, SizeType size)`.
+         * @see send(const void *data, SizeType size)
+         */
+        SendStatus send(const ConstBuffer buffers[], SizeType count)
+        {
+            return sendIfWritable(buffers, count);
+        }
+
+#ifdef KCPLUS_HAS_IOVEC
+        /**
+         * @brief Same as `send(const ConstBuffer buffers[], SizeType count)`, for `iovec` arrays. (KCPlus feature)
+         */
+        SendStatus send(const iovec buffers[], SizeType count)
         {
-            ikcp_send(mKcp, data, static_cast<int>(size));
+            return sendIfWritable(buffers, count);
         }
+#endif
 
         /**
          * @brief Updates session state.
          * @details
          * Call it repeatedly, every 10ms-100ms. You can also ask `whenToUpdate()` for when to call it again.
          * Low-level packets will be sent in this function(by calling `flush()`). Timestamp will be updated as well.
+         * Under async mode, packets left by `setMaxDeliveriesPerCall()` limit are delivered here too.
          * @param currentTimestamp Current Timestamp.
          *
          * @see whenToUpdate()
@@ -189,7 +1397,28 @@ namespace ikcp
          */
         void update(IUINT32 currentTimestamp)
         {
+            KCPLUS_TRACE_SCOPE(Update, mKcp->conv, currentTimestamp);
+            drainSendQueue();
+            if(!mCoalesced.empty() && static_cast<IINT32>(currentTimestamp - mCoalesceDeadline) >= 0)
+            {
+                flushCoalesced();
+            }
+            shedMemory();
             ikcp_update(mKcp, currentTimestamp);
+            publishPendingPackets();
+            fillStreamBuffer();
+            deliverPendingPackets();
+            notifyWritable();
+            resumeWaiters();
+        }
+
+        /**
+         * @brief Same as `update(IUINT32 currentTimestamp)`, with the timestamp of `Clock::now()`. (KCPlus feature)
+         * @details Call `Clock::tick()` once per event loop iteration before updating sessions.
+         */
+        void update()
+        {
+            update(Clock::now());
         }
 
         /**
@@ -197,45 +1426,287 @@ namespace ikcp
          * @see send()
          * @see update()
          */
-        void flush()
+        void flush()
+        {
+            drainSendQueue();
+            flushCoalesced();
+            ikcp_flush(mKcp);
+            publishPendingPackets();
+        }
+
+        /**
+         * @brief Sets up the thread-safe send queue used by `enqueueSend()`. (KCPlus feature)
+         * @details
+         * Call it before the session is shared between threads.
+         * @param capacity Maximum number of queued packets.
+         * @param backpressureThreshold `enqueueSend()` reports `SendStatus::Backpressure` when queued packets plus
+         * `getNumOfPendingPackets()` reach it. 0 disables it.
+         */
+        void setSendQueue(SizeType capacity, SizeType backpressureThreshold = 0)
+        {
+            mSendQueue.reset(new MPSCQueue<Packet>(capacity));
+            mBackpressureThreshold = backpressureThreshold;
+            publishPendingPackets();
+        }
+
+        /**
+         * @brief Sends a high-level packet from any thread. (KCPlus feature)
+         * @details
+         * Data is copied into a lock-free queue (see `setSendQueue()`), which the thread owning the session drains
+         * into KCP in `flush()`/`update()`, or explicitly by `drainSendQueue()`. Make sure the owning thread gets to
+         * it soon, eg. by waking it up with `KCPShard::post()`.
+         * @param data Data to be sent.
+         * @param size Size of data.
+         * @return Whether the packet was accepted, and whether the sender should slow down.
+         */
+        SendStatus enqueueSend(const char data[], SizeType size)
+        {
+            assert(mSendQueue != nullptr);
+            PacketDeleter deleter;
+            char *buffer = PacketBufferPool::local().allocate(size, deleter.sizeClass);
+            std::memcpy(buffer, data, size);
+            Packet packet{std::unique_ptr<char [], PacketDeleter>(buffer, deleter), size};
+            if(!mSendQueue->tryPush(std::move(packet)))
+            {
+                return SendStatus::WouldBlock;
+            }
+            if(mBackpressureThreshold != 0
+                && mSendQueue->size() + mPendingPackets.load(std::memory_order_relaxed) >= mBackpressureThreshold)
+            {
+                return SendStatus::Backpressure;
+            }
+            return SendStatus::Ok;
+        }
+
+        /**
+         * @brief Moves packets queued by `enqueueSend()` into KCP. Owning thread only.
+         * @return Number of packets moved.
+         */
+        SizeType drainSendQueue()
+        {
+            SizeType drained = 0;
+            if(mSendQueue == nullptr)
+            {
+                return drained;
+            }
+            Packet packet;
+            while(mSendQueue->tryPop(packet))
+            {
+                // Bounded by the capacity of the queue already, so watermarks don't apply.
+                ConstBuffer buffer{packet.data.get(), packet.size};
+                sendBuffers(&buffer, 1);
+                packet.data.reset();
+                ++drained;
+            }
+            return drained;
+        }
+
+        /**
+         * @brief Determines when you should invoke `update()` for the next time.
+         * After that time you should invoke `update()` to update session state and flush data.
+         * This was designed for optimizing.
+         * @param currentTimestamp Current unix timestamp.
+         * @return Timestamp of the time you should invoke `update()`.
+         * @see update()
+         */
+        IUINT32 whenToUpdate(IUINT32 currentTimestamp) const
+        {
+            IUINT32 when = ikcp_check(mKcp, currentTimestamp);
+            if(!mCoalesced.empty() && static_cast<IINT32>(mCoalesceDeadline - when) < 0)
+            {
+                when = mCoalesceDeadline;
+            }
+            return when;
+        }
+
+        /**
+         * @brief Same as `whenToUpdate(IUINT32 currentTimestamp)`, based on `Clock::now()`. (KCPlus feature)
+         */
+        IUINT32 whenToUpdate() const
+        {
+            return whenToUpdate(Clock::now());
+        }
+
+        /**
+         * @brief Turns on/off coalescing of small packets. (KCPlus feature)
+         * @details
+         * Small packets are packed into one KCP message, each prefixed with its length, until `threshold` bytes are
+         * queued or `delay` millisec passed since the first of them, then the message is handed over to KCP. It's
+         * unpacked transparently by `receive()` and async delivery at the remote. This saves a segment header and
+         * usually a datagram per packet when sending lots of tiny packets, at the cost of up to `delay` latency.
+         * Packets of `threshold` bytes or larger are sent in their own message, still framed. `flush()` sends the
+         * coalesced packets immediately.
+         * @note It changes what's on the wire, so turn it on at both endpoints, before any packet is sent or received.
+         * @param threshold Size of the coalesced message in bytes, 0 turns coalescing off. Keep it within a few MSS,
+         * eg. `MTU - 24` to fill exactly one segment.
+         * @param delay Maximum time in millisec a packet waits for others, by default it's 10ms. 0 means packets wait
+         * for the next `update()` call.
+         */
+        void setCoalescing(SizeType threshold, IUINT32 delay = 10)
+        {
+            flushCoalesced();
+            mCoalesceThreshold = threshold;
+            mCoalesceDelay = delay;
+            mCoalesced.reserve(threshold);
+            loadCoalescedBatch();
+        }
+
+        /**
+         * @brief Turns on/off stream mode. (KCPlus feature)
+         * @details
+         * Stream mode: packet boundaries are not kept, KCP fills every segment up to MSS. Received bytes are moved
+         * into an internal ring buffer as they arrive, and read in place with `readStream()`/`consumeStream()`,
+         * so bulk transfers don't need a buffer per packet. `receive()` and async delivery are not used then.
+         * When the ring buffer is full, data is left in KCP and the receive window shrinks, which slows the remote
+         * down until it's consumed.
+         * @note Stream mode must be the same at both endpoints, set it before any packet is sent or received.
+         * Don't combine it with `setCoalescing()`.
+         * @param streamMode Stream mode on/off.
+         * @param bufferSize Size of the receive ring buffer, by default it's 256KB. It should be several MSS at least.
+         */
+        void setStreamMode(bool streamMode, SizeType bufferSize = 256 * 1024)
+        {
+            mKcp->stream = streamMode ? 1 : 0;
+            mStreamBuffer.reset(streamMode ? new char[bufferSize] : nullptr);
+            mStreamBufferSize = streamMode ? bufferSize : 0;
+            mStreamReadPos = 0;
+            mStreamWritePos = 0;
+            mStreamWrapPos = 0;
+            mStreamWrapped = false;
+            fillStreamBuffer();
+        }
+
+        /**
+         * @brief Returns received bytes of stream mode, in place. (KCPlus feature)
+         * @details
+         * The view is contiguous and stays valid until `consumeStream()`, `input()`, `update()` or `setStreamMode()`
+         * is called. It may not cover every received byte when the ring buffer wraps around, what's left is returned
+         * after consuming this part.
+         * @return View of received bytes, `size` field is 0 if there is none.
+         * @see consumeStream()
+         */
+        ConstBuffer readStream() const
+        {
+            SizeType end = mStreamWrapped ? mStreamWrapPos : mStreamWritePos;
+            return ConstBuffer{mStreamBuffer.get() + mStreamReadPos, end - mStreamReadPos};
+        }
+
+        /**
+         * @brief Releases the first `size` bytes returned by `readStream()`, and makes room for more. (KCPlus feature)
+         * @param size Number of bytes consumed, no more than the size returned by `readStream()`.
+         */
+        void consumeStream(SizeType size)
+        {
+            assert(size <= readStream().size);
+            mStreamReadPos += size;
+            if(mStreamWrapped && mStreamReadPos == mStreamWrapPos)
+            {
+                mStreamReadPos = 0;
+                mStreamWrapped = false;
+            }
+            if(!mStreamWrapped && mStreamReadPos == mStreamWritePos)
+            {
+                // Empty, start over to keep views as long as possible.
+                mStreamReadPos = 0;
+                mStreamWritePos = 0;
+            }
+            fillStreamBuffer();
+        }
+
+        /**
+         * @brief Returns number of received bytes of stream mode waiting to be consumed. (KCPlus feature)
+         */
+        SizeType getNumOfStreamBytes() const
+        {
+            if(mStreamWrapped)
+            {
+                return mStreamWrapPos - mStreamReadPos + mStreamWritePos;
+            }
+            return mStreamWritePos - mStreamReadPos;
+        }
+
+        /**
+         * @brief Sets the MTU (Maximum Transmission Unit).
+         * @details
+         * By default it's 1400.
+         * Packets larger than MTU will be sliced into several packets by KCP.
+         * Better be equal or smaller than the ethernet MTU.
+         * @param mtu New MTU value.
+         */
+        void setMTU(int mtu)
+        {
+            MemoryAccounting::Scope scope(mMemory);
+            ikcp_setmtu(mKcp, mtu);
+        }
+
+        /**
+         * @brief Sets maximum send window size.
+         * @note Too low send window size can easily increase blocking probability.
+         * @param sendWindow New maximum send window size.
+         */
+        void setMaxSendWindowSize(int sendWindow)
+        {
+            ikcp_wndsize(mKcp, sendWindow, 0);
+        }
+
+        /**
+         * @brief Sets watermarks on pending packets, bounding memory when the peer stalls. (KCPlus feature)
+         * @details
+         * While `getNumOfPendingPackets()` is at or above `highWatermark`, `send()` rejects packets with
+         * `SendStatus::WouldBlock`. Once acknowledgements bring it down to `lowWatermark` or below, the callback set
+         * by `setWritableCallback()` is called once, from `input()` or `update()`.
+         * A high watermark about 2-4 times `setMaxSendWindowSize()` keeps the window full without queueing far ahead.
+         * @param highWatermark Pending packets rejecting `send()`, 0 (default) disables watermarks.
+         * @param lowWatermark Pending packets making the session writable again, clamped below `highWatermark`.
+         */
+        void setWatermarks(SizeType highWatermark, SizeType lowWatermark)
+        {
+            mHighWatermark = highWatermark;
+            mLowWatermark = highWatermark != 0 ? std::min(lowWatermark, highWatermark - 1) : 0;
+        }
+
+        /**
+         * @brief Sets the function called when the session became writable again after `send()` was rejected.
+         * (KCPlus feature)
+         * @see setWatermarks()
+         */
+        void setWritableCallback(writableCallback writableCallback)
         {
-            ikcp_flush(mKcp);
+            mWritableFunc = writableCallback;
         }
 
         /**
-         * @brief Determines when you should invoke `update()` for the next time.
-         * After that time you should invoke `update()` to update session state and flush data.
-         * This was designed for optimizing.
-         * @param currentTimestamp Current unix timestamp.
-         * @return Timestamp of the time you should invoke `update()`.
-         * @see update()
+         * @brief Returns whether `send()` accepts packets now. (KCPlus feature)
+         * @see setWatermarks()
+         * @see setMemoryLimit()
          */
-        IUINT32 whenToUpdate(IUINT32 currentTimestamp)
+        bool isWritable() const
         {
-            return ikcp_check(mKcp, currentTimestamp);
+            return (mHighWatermark == 0 || getNumOfPendingPackets() < mHighWatermark) && !isOverMemoryLimit(false);
         }
 
         /**
-         * @brief Sets the MTU (Maximum Transmission Unit).
+         * @brief Limits memory KCP allocates for this session. Needs `MemoryAccounting`. (KCPlus feature)
          * @details
-         * By default it's 1400.
-         * Packets larger than MTU will be sliced into several packets by KCP.
-         * Better be equal or smaller than the ethernet MTU.
-         * @param mtu New MTU value.
+         * While the session (or the process, see `MemoryAccounting::setGlobalLimit()`) is at its limit, `send()`
+         * rejects packets with `SendStatus::WouldBlock`, and every `update()` halves both windows down to
+         * `MinSheddingWindow`, so the peer sends less and fewer segments wait for acknowledgement. Once usage is back
+         * to 3/4 of the limit, windows are restored and the writable callback is called.
+         * Window changes made while shedding are undone by the restore.
+         * @param limit Bytes, 0 (default) for no limit.
+         * @see SessionStats::memoryUsage
          */
-        void setMTU(int mtu)
+        void setMemoryLimit(SizeType limit)
         {
-            ikcp_setmtu(mKcp, mtu);
+            mMemory.limit = limit;
         }
 
         /**
-         * @brief Sets maximum send window size.
-         * @note Too low send window size can easily increase blocking probability.
-         * @param sendWindow New maximum send window size.
+         * @brief Returns bytes allocated by KCP for this session, 0 without `MemoryAccounting`. (KCPlus feature)
          */
-        void setMaxSendWindowSize(int sendWindow)
+        SizeType memoryUsage() const
         {
-            ikcp_wndsize(mKcp, sendWindow, 0);
+            return mMemory.used;
         }
 
         /**
@@ -254,7 +1725,137 @@ namespace ikcp
          */
         SizeType getNumOfPendingPackets() const
         {
-            return static_cast<SizeType>(ikcp_waitsnd(mKcp));
+            return static_cast<SizeType>(ikcp_waitsnd(mKcp)) + (mCoalesced.empty() ? 0 : 1);
+        }
+
+#ifdef KCPLUS_HAS_COROUTINES
+        /**
+         * @brief Awaitable returned by `recv()`. (KCPlus feature)
+         */
+        class ReceiveAwaitable
+        {
+        public:
+            explicit ReceiveAwaitable(BasicKCPSession &session) noexcept
+                :mSession(session)
+            {
+            }
+
+            bool await_ready() const
+            {
+                return mSession.hasReceivablePacket();
+            }
+
+            void await_suspend(std::coroutine_handle<> handle) noexcept
+            {
+                assert(!mSession.mReceiveWaiter);
+                mSession.mReceiveWaiter = handle;
+            }
+
+            Packet await_resume()
+            {
+                return mSession.receive();
+            }
+        private:
+            BasicKCPSession &mSession;
+        };
+
+        /**
+         * @brief Awaitable returned by `drain()`. (KCPlus feature)
+         */
+        class DrainAwaitable
+        {
+        public:
+            DrainAwaitable(BasicKCPSession &session, SizeType watermark) noexcept
+                :mSession(session),mWatermark(watermark)
+            {
+            }
+
+            bool await_ready() const
+            {
+                return mSession.getNumOfPendingPackets() < mWatermark;
+            }
+
+            void await_suspend(std::coroutine_handle<> handle) noexcept
+            {
+                assert(!mSession.mDrainWaiter);
+                mSession.mDrainWaiter = handle;
+                mSession.mDrainWatermark = mWatermark;
+            }
+
+            void await_resume() const noexcept
+            {
+            }
+        private:
+            BasicKCPSession &mSession;
+            SizeType mWatermark;
+        };
+
+        /**
+         * @brief Receives a high-level packet with `co_await session.recv()`. (KCPlus feature)
+         * @details
+         * Completes at once if a packet is receivable, otherwise the coroutine is resumed by the `input()` or
+         * `update()` call which made one receivable, on the thread owning the session. No callback is allocated.
+         * One coroutine can await it at a time. Don't use it together with async mode or stream mode, which consume
+         * packets in other ways.
+         * Only if `KCPLUS_HAS_COROUTINES` is defined (C++20).
+         * @see DetachedTask
+         */
+        ReceiveAwaitable recv() noexcept
+        {
+            return ReceiveAwaitable(*this);
+        }
+
+        /**
+         * @brief Waits with `co_await session.drain()` until `getNumOfPendingPackets()` drops below `watermark`.
+         * (KCPlus feature)
+         * @details
+         * The coroutine is resumed by the `input()` or `update()` call which got pending packets acknowledged.
+         * With the default watermark of 1, it waits until everything sent was acknowledged.
+         * One coroutine can await it at a time.
+         * Only if `KCPLUS_HAS_COROUTINES` is defined (C++20).
+         */
+        DrainAwaitable drain(SizeType watermark = 1) noexcept
+        {
+            return DrainAwaitable(*this, watermark);
+        }
+#endif
+
+        /**
+         * @brief Returns a snapshot of session state and counters. (KCPlus feature)
+         * @see SessionStats
+         * @see GlobalStats
+         */
+        SessionStats stats() const
+        {
+            SessionStats stats;
+            stats.rtt = mKcp->rx_srtt;
+            stats.rttVariance = mKcp->rx_rttval;
+            stats.rto = mKcp->rx_rto;
+            stats.mtu = mKcp->mtu;
+            stats.congestionWindow = mKcp->cwnd;
+            stats.slowStartThreshold = mKcp->ssthresh;
+            stats.sendWindow = mKcp->snd_wnd;
+            stats.receiveWindow = mKcp->rcv_wnd;
+            stats.remoteWindow = mKcp->rmt_wnd;
+            stats.sendQueue = mKcp->nsnd_que;
+            stats.sendBuffer = mKcp->nsnd_buf;
+            stats.receiveQueue = mKcp->nrcv_que;
+            stats.receiveBuffer = mKcp->nrcv_buf;
+            stats.retransmits = mKcp->xmit;
+            stats.fastRetransmits = mCounters.retransmittedSegments > mKcp->xmit ?
+                mCounters.retransmittedSegments - mKcp->xmit : 0;
+            stats.bytesSent = mCounters.bytesSent;
+            stats.datagramsSent = mCounters.datagramsSent;
+            stats.segmentsSent = mCounters.segmentsSent;
+            stats.bytesReceived = mCounters.bytesReceived;
+            stats.datagramsReceived = mCounters.datagramsReceived;
+            stats.inputErrors = mCounters.inputErrors;
+            stats.packetsSent = mCounters.packetsSent;
+            stats.packetsReceived = mCounters.packetsReceived;
+            stats.memoryUsage = mMemory.used;
+            stats.memoryRejects = mCounters.memoryRejects;
+            stats.memoryShedding = mShedding;
+            return stats;
         }
 
         /**
@@ -321,28 +1922,517 @@ namespace ikcp
 
         /**
          * @brief Sets allocator and deallocator for internal buffer allocating.
+         * @details It's process-wide, for every session. See `SegmentPool` for a per-thread, lock-free one.
+         * Replaces `MemoryAccounting`, pass them to `MemoryAccounting::install()` instead to keep accounting.
          * @param allocator Allocator function.
          * @param deallocator Deallocator function.
          */
         static void setAllocator(void* (*allocator)(size_t), void (*deallocator)(void*))
         {
             ikcp_allocator(allocator,deallocator);
+            InstalledAllocator::deallocator() = deallocator;
         }
+
+        /**
+         * @brief Smallest window `setMemoryLimit()` shrinks windows to, in segments.
+         */
+        constexpr static const IUINT32 MinSheddingWindow = 8;
     private:
+        MemoryAccounting::Account mMemory;  // Constructed first, as ikcp_create() already allocates on it.
         ikcpcb *mKcp;
         OutputFunction mOutputFunc;
         bool mAsyncMode;
         receiveCallback mReceiveFunc;
+        batchReceiveCallback mBatchReceiveFunc;
+        SizeType mMaxDeliveriesPerCall;
+        std::vector<Packet> mBatchPackets;
+        writableCallback mWritableFunc;
+        SizeType mHighWatermark = 0;
+        SizeType mLowWatermark = 0;
+        bool mBlocked = false;          // `send()` rejected a packet, waiting for the low watermark.
+        bool mShedding = false;         // Windows are shrunk for a memory limit.
+        IUINT32 mSheddingSendWindow = 0;    // Windows to restore.
+        IUINT32 mSheddingReceiveWindow = 0;
+        std::unique_ptr<MPSCQueue<Packet>> mSendQueue;
+        SizeType mBackpressureThreshold;
+        std::atomic<SizeType> mPendingPackets; // Snapshot of `getNumOfPendingPackets()` for other threads.
+
+        struct Counters
+        {
+            std::uint64_t bytesSent = 0;
+            std::uint64_t datagramsSent = 0;
+            std::uint64_t segmentsSent = 0;
+            std::uint64_t retransmittedSegments = 0;
+            std::uint64_t bytesReceived = 0;
+            std::uint64_t datagramsReceived = 0;
+            std::uint64_t inputErrors = 0;
+            std::uint64_t packetsSent = 0;
+            std::uint64_t packetsReceived = 0;
+            std::uint64_t memoryRejects = 0;
+        } mCounters;
+        IUINT32 mNextSegmentNumber = 0; // Data segments numbered below it were sent before.
+        SizeType mCoalesceThreshold = 0;
+        IUINT32 mCoalesceDelay = 0;
+        IUINT32 mCoalesceDeadline = 0;
+        std::vector<char> mCoalesced;   // Framed packets waiting to be sent as one message.
+        Packet mBatch{nullptr, 0};      // Received message being unpacked.
+        SizeType mBatchOffset = 0;      // Offset of the next frame in `mBatch`.
+
+        constexpr static const SizeType MaxFramePrefixSize = WireFormat::MaxVarintSize; // Length prefix is a varint.
+
+        // Initial values of ikcpcb fields, not exported by ikcp.h (IKCP_THRESH_INIT, IKCP_RTO_DEF and IKCP_WND_RCV).
+        constexpr static const IUINT32 InitialSlowStartThreshold = 2;
+        constexpr static const IINT32 InitialRTO = 200;
+        constexpr static const IUINT32 InitialRemoteWindow = 128;
+
+        // Receive ring buffer of stream mode. Once the tail has no room for a segment, writing wraps around to the
+        // front and bytes end at `mStreamWrapPos`, so readable bytes are always contiguous from `mStreamReadPos`.
+        std::unique_ptr<char []> mStreamBuffer;
+        SizeType mStreamBufferSize = 0;
+        SizeType mStreamReadPos = 0;
+        SizeType mStreamWritePos = 0;
+        SizeType mStreamWrapPos = 0;
+        bool mStreamWrapped = false;
+#ifdef KCPLUS_HAS_COROUTINES
+        std::coroutine_handle<> mReceiveWaiter;     // Coroutine awaiting `recv()`.
+        std::coroutine_handle<> mDrainWaiter;       // Coroutine awaiting `drain()`.
+        SizeType mDrainWatermark = 0;
+#endif
+
+        ikcpcb *create(IUINT32 conv)
+        {
+            MemoryAccounting::Scope scope(mMemory);
+            return ikcp_create(conv, this);
+        }
+
+        bool isOverMemoryLimit(bool relief) const
+        {
+            return MemoryAccounting::isOver(mMemory.used, mMemory.limit, relief) ||
+                MemoryAccounting::isGloballyOver(relief);
+        }
+
+        void shedMemory()
+        {
+            if(isOverMemoryLimit(false))
+            {
+                if(!mShedding)
+                {
+                    mShedding = true;
+                    mSheddingSendWindow = mKcp->snd_wnd;
+                    mSheddingReceiveWindow = mKcp->rcv_wnd;
+                }
+                mKcp->snd_wnd = std::max(mKcp->snd_wnd / 2, std::min(mSheddingSendWindow, MinSheddingWindow + 0));
+                mKcp->rcv_wnd = std::max(mKcp->rcv_wnd / 2, std::min(mSheddingReceiveWindow, MinSheddingWindow + 0));
+            }
+            else if(mShedding && !isOverMemoryLimit(true))
+            {
+                stopShedding();
+            }
+        }
+
+        void stopShedding()
+        {
+            if(mShedding)
+            {
+                mKcp->snd_wnd = mSheddingSendWindow;
+                mKcp->rcv_wnd = mSheddingReceiveWindow;
+                mShedding = false;
+            }
+        }
+
+        template<class Buffer>
+        void inputBuffers(const Buffer datagrams[], SizeType count)
+        {
+            MemoryAccounting::Scope scope(mMemory);
+            KCPLUS_TRACE_SCOPE(Input, mKcp->conv, count);
+            SizeType bytes = 0;
+            SizeType errors = 0;
+            for(SizeType i = 0; i < count; ++i)
+            {
+                bytes += bufferSize(datagrams[i]);
+                if(ikcp_input(mKcp, bufferData(datagrams[i]), static_cast<long>(bufferSize(datagrams[i]))) < 0)
+                {
+                    ++errors;
+                }
+            }
+            mCounters.datagramsReceived += count;
+            mCounters.bytesReceived += bytes;
+            GlobalStats::add(GlobalStats::DatagramsReceived, count);
+            GlobalStats::add(GlobalStats::BytesReceived, bytes);
+            if(errors != 0)
+            {
+                mCounters.inputErrors += errors;
+                GlobalStats::add(GlobalStats::InputErrors, errors);
+            }
+            loadCoalescedBatch();
+            fillStreamBuffer();
+            deliverPendingPackets();
+            notifyWritable();
+            resumeWaiters();
+        }
+
+        static const char *bufferData(const ConstBuffer &buffer)
+        {
+            return static_cast<const char *>(buffer.data);
+        }
+
+        static SizeType bufferSize(const ConstBuffer &buffer)
+        {
+            return buffer.size;
+        }
+
+#ifdef KCPLUS_HAS_IOVEC
+        static const char *bufferData(const iovec &buffer)
+        {
+            return static_cast<const char *>(buffer.iov_base);
+        }
+
+        static SizeType bufferSize(const iovec &buffer)
+        {
+            return buffer.iov_len;
+        }
+#endif
+
+        template<class Buffer>
+        SendStatus sendIfWritable(const Buffer buffers[], SizeType count)
+        {
+            if(!isWritable())
+            {
+                if(isOverMemoryLimit(false))
+                {
+                    ++mCounters.memoryRejects;
+                    GlobalStats::add(GlobalStats::MemoryRejects, 1);
+                }
+                mBlocked = true;
+                return SendStatus::WouldBlock;
+            }
+            sendBuffers(buffers, count);
+            return SendStatus::Ok;
+        }
+
+        template<class Buffer>
+        void sendBuffers(const Buffer buffers[], SizeType count)
+        {
+            MemoryAccounting::Scope scope(mMemory);
+            SizeType total = 0;
+            for(SizeType i = 0; i < count; ++i)
+            {
+                total += bufferSize(buffers[i]);
+            }
+            if(mCoalesceThreshold != 0)
+            {
+                coalesce(buffers, count, total);
+            }
+            else if(sendMessage(buffers, count, total))
+            {
+                countSentPacket(total);
+            }
+        }
+
+        // Hands a message over to KCP as it is.
+        template<class Buffer>
+        bool sendMessage(const Buffer buffers[], SizeType count, SizeType total)
+        {
+            if(count == 1)
+            {
+                return ikcp_send(mKcp, bufferData(buffers[0]), static_cast<int>(total)) >= 0;
+            }
+            if(mKcp->stream != 0)
+            {
+                // Stream mode may merge the packet into a queued segment, so gather it into a pooled buffer instead.
+                PacketDeleter deleter;
+                std::unique_ptr<char [], PacketDeleter> buffer(
+                    PacketBufferPool::local().allocate(total, deleter.sizeClass), deleter);
+                SizeType offset = 0;
+                for(SizeType i = 0; i < count; ++i)
+                {
+                    std::memcpy(buffer.get() + offset, bufferData(buffers[i]), bufferSize(buffers[i]));
+                    offset += bufferSize(buffers[i]);
+                }
+                return ikcp_send(mKcp, buffer.get(), static_cast<int>(total)) >= 0;
+            }
+            // Without a buffer, ikcp_send() queues the segments but leaves their data alone. Fill them in place.
+            IUINT32 queued = mKcp->nsnd_que;
+            if(ikcp_send(mKcp, nullptr, static_cast<int>(total)) < 0)
+            {
+                return false;
+            }
+            IQUEUEHEAD *node = mKcp->snd_queue.prev;
+            for(IUINT32 i = mKcp->nsnd_que - queued; i > 1; --i)
+            {
+                node = node->prev;
+            }
+            IKCPSEG *segment = iqueue_entry(node, IKCPSEG, node);
+            SizeType offset = 0;
+            for(SizeType i = 0; i < count; ++i)
+            {
+                const char *data = bufferData(buffers[i]);
+                SizeType left = bufferSize(buffers[i]);
+                while(left > 0)
+                {
+                    if(offset == segment->len)
+                    {
+                        segment = iqueue_entry(segment->node.next, IKCPSEG, node);
+                        offset = 0;
+                    }
+                    SizeType size = std::min<SizeType>(left, segment->len - offset);
+                    std::memcpy(segment->data + offset, data, size);
+                    offset += size;
+                    data += size;
+                    left -= size;
+                }
+            }
+            return true;
+        }
+
+        template<class Buffer>
+        void coalesce(const Buffer buffers[], SizeType count, SizeType total)
+        {
+            char prefix[MaxFramePrefixSize];
+            SizeType prefixSize = WireFormat::encodeVarint(total, prefix);
+            if(mCoalesced.size() + prefixSize + total > mCoalesceThreshold)
+            {
+                flushCoalesced();
+            }
+            if(prefixSize + total >= mCoalesceThreshold && count == 1)
+            {
+                // Too large to share a message, send it in its own.
+                ConstBuffer frame[2] = {{prefix, prefixSize}, {bufferData(buffers[0]), total}};
+                if(sendMessage(frame, 2, prefixSize + total))
+                {
+                    countSentPacket(prefixSize + total);
+                }
+                return;
+            }
+            if(mCoalesced.empty())
+            {
+                mCoalesceDeadline = mKcp->current + mCoalesceDelay;
+            }
+            mCoalesced.insert(mCoalesced.end(), prefix, prefix + prefixSize);
+            for(SizeType i = 0; i < count; ++i)
+            {
+                mCoalesced.insert(mCoalesced.end(), bufferData(buffers[i]), bufferData(buffers[i]) + bufferSize(buffers[i]));
+            }
+            countSentPacket(total);
+            if(mCoalesced.size() >= mCoalesceThreshold)
+            {
+                flushCoalesced();
+            }
+        }
+
+        void flushCoalesced()
+        {
+            if(mCoalesced.empty())
+            {
+                return;
+            }
+            MemoryAccounting::Scope scope(mMemory);
+            ikcp_send(mKcp, mCoalesced.data(), static_cast<int>(mCoalesced.size()));
+            mCoalesced.clear();
+        }
+
+        // Parses the frame prefix at `offset` of `mBatch`, moves `offset` to the frame data.
+        bool decodeFrame(SizeType &offset, SizeType &size) const
+        {
+            return WireFormat::decodeVarint(mBatch.data.get(), mBatch.size, offset, size) && size <= mBatch.size - offset;
+        }
+
+        void consumeFrame(SizeType size)
+        {
+            mBatchOffset += size;
+            countReceivedPacket(size);
+            loadCoalescedBatch();
+        }
+
+        // Moves received segments from KCP into the ring buffer while they fit.
+        void fillStreamBuffer()
+        {
+            if(mStreamBuffer == nullptr)
+            {
+                return;
+            }
+            for(int size = ikcp_peeksize(mKcp); size >= 0; size = ikcp_peeksize(mKcp))
+            {
+                SizeType segmentSize = static_cast<SizeType>(size);
+                if(!mStreamWrapped && mStreamBufferSize - mStreamWritePos < segmentSize)
+                {
+                    if(mStreamReadPos < segmentSize)
+                    {
+                        return;
+                    }
+                    mStreamWrapPos = mStreamWritePos;
+                    mStreamWritePos = 0;
+                    mStreamWrapped = true;
+                }
+                SizeType end = mStreamWrapped ? mStreamReadPos : mStreamBufferSize;
+                if(end - mStreamWritePos < segmentSize)
+                {
+                    return;
+                }
+                ikcp_recv(mKcp, mStreamBuffer.get() + mStreamWritePos, size);
+                mStreamWritePos += segmentSize;
+                countReceivedPacket(segmentSize);
+            }
+        }
 
+        // Takes the next KCP message for unpacking once the current one is used up, dropping malformed ones.
+        void loadCoalescedBatch()
+        {
+            while(mCoalesceThreshold != 0 && mBatchOffset >= mBatch.size && ikcp_peeksize(mKcp) >= 0)
+            {
+                SizeType size = static_cast<SizeType>(ikcp_peeksize(mKcp));
+                PacketDeleter deleter;
+                mBatch.data = std::unique_ptr<char [], PacketDeleter>(
+                    PacketBufferPool::local().allocate(size, deleter.sizeClass), deleter);
+                mBatch.size = static_cast<SizeType>(ikcp_recv(mKcp, mBatch.data.get(), static_cast<int>(size)));
+                mBatchOffset = 0;
+                for(SizeType offset = 0, frameSize; offset < mBatch.size; offset += frameSize)
+                {
+                    if(!decodeFrame(offset, frameSize))
+                    {
+                        ++mCounters.inputErrors;
+                        GlobalStats::add(GlobalStats::InputErrors, 1);
+                        mBatch.size = 0;
+                        break;
+                    }
+                }
+            }
+        }
 
         static int mOutputFuncRaw(const char buf[], int len, ikcpcb *kcp, void *user)
         {
-            auto thisptr = reinterpret_cast<KCPSession *>(user);
-            assert(thisptr->mOutputFunc != nullptr);
+            auto thisptr = reinterpret_cast<BasicKCPSession *>(user);
+            assert(isSet(thisptr->mOutputFunc));
+            thisptr->countOutput(buf, static_cast<SizeType>(len));
             thisptr->mOutputFunc(buf, static_cast<SizeType>(len));
             return 0;
         }
 
+        // Walks segment headers of an outgoing low-level packet to count data segments and retransmits.
+        void countOutput(const char buf[], SizeType len)
+        {
+            const unsigned char PushCommand = 81; // IKCP_CMD_PUSH
+            std::uint64_t segments = 0;
+            std::uint64_t retransmitted = 0;
+            for(SizeType offset = 0; offset + KCPOverhead <= len; )
+            {
+                IUINT32 sn = WireFormat::decode32(buf + offset + 12);
+                IUINT32 length = WireFormat::decode32(buf + offset + 20);
+                if(static_cast<unsigned char>(buf[offset + 4]) == PushCommand)
+                {
+                    ++segments;
+                    if(static_cast<IINT32>(sn - mNextSegmentNumber) < 0)
+                    {
+                        ++retransmitted;
+                    }
+                    else
+                    {
+                        mNextSegmentNumber = sn + 1;
+                    }
+                }
+                offset += KCPOverhead + length;
+            }
+            KCPLUS_TRACE_INSTANT(Output, mKcp->conv, len);
+            if(retransmitted != 0)
+            {
+                KCPLUS_TRACE_INSTANT(Retransmit, mKcp->conv, retransmitted);
+            }
+            ++mCounters.datagramsSent;
+            mCounters.bytesSent += len;
+            mCounters.segmentsSent += segments;
+            mCounters.retransmittedSegments += retransmitted;
+            GlobalStats::add(GlobalStats::DatagramsSent, 1);
+            GlobalStats::add(GlobalStats::BytesSent, len);
+            GlobalStats::add(GlobalStats::SegmentsSent, segments);
+            GlobalStats::add(GlobalStats::Retransmits, retransmitted);
+        }
+
+        void countSentPacket(SizeType size)
+        {
+            KCPLUS_TRACE_INSTANT(Send, mKcp->conv, size);
+            ++mCounters.packetsSent;
+            GlobalStats::add(GlobalStats::PacketsSent, 1);
+        }
+
+        void countReceivedPacket(SizeType size)
+        {
+            KCPLUS_TRACE_INSTANT(Receive, mKcp->conv, size);
+            ++mCounters.packetsReceived;
+            GlobalStats::add(GlobalStats::PacketsReceived, 1);
+        }
+
+        template<class Sink>
+        static bool isSet(const Sink &)
+        {
+            return true;
+        }
+
+        template<class Signature>
+        static bool isSet(const std::function<Signature> &function)
+        {
+            return static_cast<bool>(function);
+        }
+
+        void notifyWritable()
+        {
+            if(mBlocked && (mHighWatermark == 0 || getNumOfPendingPackets() <= mLowWatermark) &&
+                !isOverMemoryLimit(true))
+            {
+                mBlocked = false;
+                if(mWritableFunc)
+                {
+                    mWritableFunc();
+                }
+            }
+        }
+
+        /**
+         * @brief Resumes coroutines whose awaited condition came true. Called last, so they see a settled session.
+         */
+        void resumeWaiters()
+        {
+#ifdef KCPLUS_HAS_COROUTINES
+            if(mReceiveWaiter && hasReceivablePacket())
+            {
+                std::coroutine_handle<> handle = mReceiveWaiter;
+                mReceiveWaiter = nullptr;
+                handle.resume();
+            }
+            if(mDrainWaiter && getNumOfPendingPackets() < mDrainWatermark)
+            {
+                std::coroutine_handle<> handle = mDrainWaiter;
+                mDrainWaiter = nullptr;
+                handle.resume();
+            }
+#endif
+        }
+
+        static void freeSegments(IQUEUEHEAD &queue)
+        {
+            InstalledAllocator::Deallocator deallocator = InstalledAllocator::deallocator();
+            while(!iqueue_is_empty(&queue))
+            {
+                IKCPSEG *segment = iqueue_entry(queue.next, IKCPSEG, node);
+                iqueue_del(&segment->node);
+                if(deallocator != nullptr)
+                {
+                    deallocator(segment);
+                }
+                else
+                {
+                    std::free(segment);
+                }
+            }
+        }
+
+        void publishPendingPackets()
+        {
+            if(mSendQueue != nullptr)
+            {
+                mPendingPackets.store(getNumOfPendingPackets(), std::memory_order_relaxed);
+            }
+        }
+
         void setPropertiesPrivate(int nodelay, int interval, int resend, int nc)
         {
             ikcp_nodelay(mKcp, nodelay, interval, resend, nc);
@@ -350,4 +2440,13 @@ namespace ikcp
 
         constexpr static const int NotChanged = -1;
     };
+
+    /**
+     * @brief A KCP session for sending/receiving packets.
+     * @details Sinks are type-erased `std::function`s, set by `setOutputFunction()` and `setReceiveCallback()`.
+     * @see BasicKCPSession
+     */
+    using KCPSession = BasicKCPSession<std::function<void(const char buf[], SizeType len)>, std::function<void(Packet packet)>>;
 }
+
+#endif // KCPLUS_HPP
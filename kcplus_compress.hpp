@@ -0,0 +1,395 @@
+/*
+    Copyright 2017 Miigon
+
+    Licensed under the Apache License, Version 2.0 (the "License");
+    you may not use this file except in compliance with the License.
+    You may obtain a copy of the License at
+
+        http://www.apache.org/licenses/LICENSE-2.0
+
+    Unless required by applicable law or agreed to in writing, software
+    distributed under the License is distributed on an "AS IS" BASIS,
+    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+    See the License for the specific language governing permissions and
+    limitations under the License.
+*/
+
+#ifndef KCPLUS_COMPRESS_HPP
+#define KCPLUS_COMPRESS_HPP
+
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <stdexcept>
+#include <utility>
+#include <vector>
+#include "kcplus.hpp"
+
+#if defined(__has_include)
+#if !defined(KCPLUS_NO_ZSTD) && __has_include(<zstd.h>)
+#include <zstd.h>
+#define KCPLUS_HAS_ZSTD 1
+#endif
+#if !defined(KCPLUS_NO_LZ4) && __has_include(<lz4.h>)
+#include <lz4.h>
+#define KCPLUS_HAS_LZ4 1
+#endif
+#if !defined(KCPLUS_NO_ZLIB) && __has_include(<zlib.h>)
+#include <zlib.h>
+#define KCPLUS_HAS_ZLIB 1
+#endif
+#endif
+
+namespace ikcp
+{
+#ifdef KCPLUS_HAS_ZSTD
+    /**
+     * @brief zstd codec for `BasicCompressionStage`, with an optional dictionary. (KCPlus feature)
+     * @details
+     * Contexts and the digested dictionary are created once, so messages are compressed without allocating.
+     * Only if `KCPLUS_HAS_ZSTD` is defined. Link with `-lzstd`.
+     */
+    class ZstdCodec
+    {
+    public:
+        /**
+         * @param dictionary Dictionary shared by both sides, eg. trained by `zstd --train`. Copied.
+         * @param dictionarySize Size of the dictionary, 0 for none.
+         * @param level Compression level.
+         * @throw std::runtime_error If zstd can not set up.
+         */
+        explicit ZstdCodec(const void *dictionary = nullptr, SizeType dictionarySize = 0, int level = 3)
+            :mCompressor(ZSTD_createCCtx()),mDecompressor(ZSTD_createDCtx()),mCompressionDict(nullptr),
+            mDecompressionDict(nullptr),mLevel(level)
+        {
+            if(dictionarySize != 0)
+            {
+                mCompressionDict = ZSTD_createCDict(dictionary, dictionarySize, level);
+                mDecompressionDict = ZSTD_createDDict(dictionary, dictionarySize);
+            }
+            if(mCompressor == nullptr || mDecompressor == nullptr ||
+                (dictionarySize != 0 && (mCompressionDict == nullptr || mDecompressionDict == nullptr)))
+            {
+                release();
+                throw std::runtime_error("ZstdCodec: can not set up");
+            }
+        }
+
+        ZstdCodec(ZstdCodec &&other) noexcept
+            :mCompressor(other.mCompressor),mDecompressor(other.mDecompressor),
+            mCompressionDict(other.mCompressionDict),mDecompressionDict(other.mDecompressionDict),mLevel(other.mLevel)
+        {
+            other.mCompressor = nullptr;
+            other.mDecompressor = nullptr;
+            other.mCompressionDict = nullptr;
+            other.mDecompressionDict = nullptr;
+        }
+
+        ~ZstdCodec()
+        {
+            release();
+        }
+
+        ZstdCodec(const ZstdCodec &) = delete;
+        ZstdCodec &operator=(const ZstdCodec &) = delete;
+
+        SizeType compress(const char src[], SizeType size, char dst[], SizeType capacity)
+        {
+            size_t result = mCompressionDict != nullptr ?
+                ZSTD_compress_usingCDict(mCompressor, dst, capacity, src, size, mCompressionDict) :
+                ZSTD_compressCCtx(mCompressor, dst, capacity, src, size, mLevel);
+            return ZSTD_isError(result) ? 0 : result;
+        }
+
+        bool decompress(const char src[], SizeType size, char dst[], SizeType originalSize)
+        {
+            size_t result = mDecompressionDict != nullptr ?
+                ZSTD_decompress_usingDDict(mDecompressor, dst, originalSize, src, size, mDecompressionDict) :
+                ZSTD_decompressDCtx(mDecompressor, dst, originalSize, src, size);
+            return !ZSTD_isError(result) && result == originalSize;
+        }
+    private:
+        ZSTD_CCtx *mCompressor;
+        ZSTD_DCtx *mDecompressor;
+        ZSTD_CDict *mCompressionDict;
+        ZSTD_DDict *mDecompressionDict;
+        int mLevel;
+
+        void release()
+        {
+            ZSTD_freeCDict(mCompressionDict);
+            ZSTD_freeDDict(mDecompressionDict);
+            ZSTD_freeCCtx(mCompressor);
+            ZSTD_freeDCtx(mDecompressor);
+        }
+    };
+#endif
+
+#ifdef KCPLUS_HAS_LZ4
+    /**
+     * @brief LZ4 codec for `BasicCompressionStage`, with an optional dictionary. (KCPlus feature)
+     * @details
+     * The dictionary is hashed once into a stream, which is copied for every message instead of loading the
+     * dictionary again. Only the last 64KB of the dictionary are used.
+     * Only if `KCPLUS_HAS_LZ4` is defined. Link with `-llz4`.
+     */
+    class LZ4Codec
+    {
+    public:
+        /**
+         * @param dictionary Dictionary shared by both sides. Copied.
+         * @param dictionarySize Size of the dictionary, 0 for none.
+         * @param acceleration Higher is faster and compresses less, 1 is the default of LZ4.
+         */
+        explicit LZ4Codec(const void *dictionary = nullptr, SizeType dictionarySize = 0, int acceleration = 1)
+            :mDictionary(static_cast<const char *>(dictionary), static_cast<const char *>(dictionary) + dictionarySize),
+            mDictionaryStream(new LZ4_stream_t),mStream(new LZ4_stream_t),mAcceleration(acceleration)
+        {
+            if(mDictionary.size() > MaxDictionarySize)
+            {
+                mDictionary.erase(mDictionary.begin(), mDictionary.end() - MaxDictionarySize);
+            }
+            LZ4_initStream(mDictionaryStream.get(), sizeof(LZ4_stream_t));
+            LZ4_loadDict(mDictionaryStream.get(), mDictionary.data(), static_cast<int>(mDictionary.size()));
+        }
+
+        SizeType compress(const char src[], SizeType size, char dst[], SizeType capacity)
+        {
+            std::memcpy(mStream.get(), mDictionaryStream.get(), sizeof(LZ4_stream_t));
+            int result = LZ4_compress_fast_continue(mStream.get(), src, dst, static_cast<int>(size),
+                static_cast<int>(capacity), mAcceleration);
+            return result > 0 ? static_cast<SizeType>(result) : 0;
+        }
+
+        bool decompress(const char src[], SizeType size, char dst[], SizeType originalSize)
+        {
+            int result = LZ4_decompress_safe_usingDict(src, dst, static_cast<int>(size), static_cast<int>(originalSize),
+                mDictionary.data(), static_cast<int>(mDictionary.size()));
+            return result >= 0 && static_cast<SizeType>(result) == originalSize;
+        }
+    private:
+        std::vector<char> mDictionary;                  // Referred to by `mDictionaryStream`, never reallocated.
+        std::unique_ptr<LZ4_stream_t> mDictionaryStream;
+        std::unique_ptr<LZ4_stream_t> mStream;
+        int mAcceleration;
+
+        constexpr static const SizeType MaxDictionarySize = 64 * 1024;
+    };
+#endif
+
+#ifdef KCPLUS_HAS_ZLIB
+    /**
+     * @brief Raw deflate codec for `BasicCompressionStage`, with an optional preset dictionary. (KCPlus feature)
+     * @details
+     * Streams are reset between messages instead of being created again. Slower than zstd and LZ4, but zlib is
+     * everywhere. Only the last 32KB of the dictionary are used.
+     * Only if `KCPLUS_HAS_ZLIB` is defined. Link with `-lz`.
+     */
+    class ZlibCodec
+    {
+    public:
+        /**
+         * @param dictionary Dictionary shared by both sides. Copied.
+         * @param dictionarySize Size of the dictionary, 0 for none.
+         * @param level Compression level, 1 to 9.
+         * @throw std::runtime_error If zlib can not set up.
+         */
+        explicit ZlibCodec(const void *dictionary = nullptr, SizeType dictionarySize = 0, int level = 6)
+            :mDictionary(static_cast<const unsigned char *>(dictionary),
+                static_cast<const unsigned char *>(dictionary) + dictionarySize),
+            mDeflate(new z_stream()),mInflate(new z_stream())
+        {
+            if(deflateInit2(mDeflate.get(), level, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+            {
+                mDeflate.reset();
+                throw std::runtime_error("ZlibCodec: can not set up");
+            }
+            if(inflateInit2(mInflate.get(), -15) != Z_OK)
+            {
+                deflateEnd(mDeflate.get());
+                mDeflate.reset();
+                mInflate.reset();
+                throw std::runtime_error("ZlibCodec: can not set up");
+            }
+        }
+
+        ZlibCodec(ZlibCodec &&other) = default;
+
+        ~ZlibCodec()
+        {
+            if(mDeflate != nullptr)
+            {
+                deflateEnd(mDeflate.get());
+                inflateEnd(mInflate.get());
+            }
+        }
+
+        ZlibCodec(const ZlibCodec &) = delete;
+        ZlibCodec &operator=(const ZlibCodec &) = delete;
+
+        SizeType compress(const char src[], SizeType size, char dst[], SizeType capacity)
+        {
+            z_stream &stream = *mDeflate;
+            deflateReset(&stream);
+            if(!mDictionary.empty())
+            {
+                deflateSetDictionary(&stream, mDictionary.data(), static_cast<uInt>(mDictionary.size()));
+            }
+            stream.next_in = reinterpret_cast<Bytef *>(const_cast<char *>(src));
+            stream.avail_in = static_cast<uInt>(size);
+            stream.next_out = reinterpret_cast<Bytef *>(dst);
+            stream.avail_out = static_cast<uInt>(capacity);
+            return deflate(&stream, Z_FINISH) == Z_STREAM_END ? static_cast<SizeType>(stream.total_out) : 0;
+        }
+
+        bool decompress(const char src[], SizeType size, char dst[], SizeType originalSize)
+        {
+            z_stream &stream = *mInflate;
+            inflateReset(&stream);
+            if(!mDictionary.empty())
+            {
+                inflateSetDictionary(&stream, mDictionary.data(), static_cast<uInt>(mDictionary.size()));
+            }
+            stream.next_in = reinterpret_cast<Bytef *>(const_cast<char *>(src));
+            stream.avail_in = static_cast<uInt>(size);
+            stream.next_out = reinterpret_cast<Bytef *>(dst);
+            stream.avail_out = static_cast<uInt>(originalSize);
+            return inflate(&stream, Z_FINISH) == Z_STREAM_END && stream.total_out == originalSize;
+        }
+    private:
+        std::vector<unsigned char> mDictionary;
+        std::unique_ptr<z_stream> mDeflate;     // z_stream points to itself, keep it at one address.
+        std::unique_ptr<z_stream> mInflate;
+    };
+#endif
+
+    /**
+     * @brief Compresses high-level packets of a session, each on its own. (KCPlus feature)
+     * @details
+     * Wraps `send()` and what's received: packets below the threshold, or not getting smaller, are sent as they are,
+     * others compressed. Either way they get a one byte flag, plus the original size for compressed ones. The
+     * compressed packet and its flag are sent by scatter-gather, and buffers are kept between packets, so nothing is
+     * allocated once they reached the largest packet size.
+     * Compressing every packet on its own loses repetition between packets, a dictionary shared by both sides brings
+     * most of it back for small, similar packets like JSON or protobuf messages.
+     * @code
+     * ikcp::BasicCompressionStage<ikcp::ZstdCodec> compression(ikcp::ZstdCodec(dictionary, dictionarySize));
+     * compression.send(session, data, size);
+     * // Receiving side.
+     * ikcp::Packet packet = session.receive();
+     * compression.decode(packet.data.get(), packet.size, [](const char data[], ikcp::SizeType size)
+     * {
+     *     handleMessage(data, size);
+     * });
+     * @endcode
+     * Not thread-safe.
+     * @tparam Codec Provides `SizeType compress(src, size, dst, capacity)` returning 0 if it doesn't fit, and
+     * `bool decompress(src, size, dst, originalSize)`, like `ZstdCodec`, `LZ4Codec` or `ZlibCodec`.
+     */
+    template<class Codec>
+    class BasicCompressionStage
+    {
+    public:
+        /**
+         * @param codec Codec and dictionary, the same on both sides.
+         * @param threshold Packets smaller than it are not compressed.
+         * @param maxPacketSize Largest packet accepted by `decode()`, guards against decompression bombs.
+         */
+        explicit BasicCompressionStage(Codec codec, SizeType threshold = 64, SizeType maxPacketSize = 1024 * 1024)
+            :mCodec(std::move(codec)),mThreshold(threshold),mMaxPacketSize(maxPacketSize),mBytesIn(0),mBytesOut(0)
+        {
+        }
+
+        /**
+         * @brief Sends a high-level packet through `session`, compressed if it's worth it.
+         * @return What `session.send()` returned.
+         */
+        template<class Session>
+        SendStatus send(Session &session, const void *data, SizeType size)
+        {
+            char header[1 + MaxSizePrefix];
+            ConstBuffer buffers[2] = {{header, 1}, {data, size}};
+            header[0] = Raw;
+            if(size >= mThreshold && size <= mMaxPacketSize)
+            {
+                if(mCompressed.size() < size)
+                {
+                    mCompressed.resize(size);
+                }
+                // No room for more than the packet itself, compressing fails if it doesn't get smaller.
+                SizeType compressed = mCodec.compress(static_cast<const char *>(data), size, mCompressed.data(), size);
+                SizeType headerSize = 1 + WireFormat::encodeVarint(size, header + 1);
+                if(compressed != 0 && compressed + headerSize < size + 1)
+                {
+                    header[0] = Compressed;
+                    buffers[0].size = headerSize;
+                    buffers[1] = ConstBuffer{mCompressed.data(), compressed};
+                }
+            }
+            mBytesIn += size;
+            mBytesOut += buffers[0].size + buffers[1].size;
+            return session.send(buffers, 2);
+        }
+
+        /**
+         * @brief Decodes a received high-level packet, and passes the original one to `sink`.
+         * @param sink Called as `sink(const char data[], SizeType size)`. The view is valid until the next call.
+         * @return `false` if the packet is malformed, `sink` isn't called then.
+         */
+        template<class Sink>
+        bool decode(const char data[], SizeType size, Sink &&sink)
+        {
+            if(size == 0)
+            {
+                return false;
+            }
+            if(data[0] == Raw)
+            {
+                sink(data + 1, size - 1);
+                return true;
+            }
+            if(data[0] != Compressed)
+            {
+                return false;
+            }
+            SizeType originalSize;
+            SizeType offset = 1;
+            if(!WireFormat::decodeVarint(data, size, offset, originalSize) || originalSize > mMaxPacketSize)
+            {
+                return false;
+            }
+            if(mDecompressed.size() < originalSize)
+            {
+                mDecompressed.resize(originalSize);
+            }
+            if(!mCodec.decompress(data + offset, size - offset, mDecompressed.data(), originalSize))
+            {
+                return false;
+            }
+            sink(static_cast<const char *>(mDecompressed.data()), originalSize);
+            return true;
+        }
+
+        /**
+         * @brief Returns the total size of packets given to `send()`, before and after compression.
+         */
+        std::pair<std::uint64_t, std::uint64_t> bytesSent() const
+        {
+            return std::make_pair(mBytesIn, mBytesOut);
+        }
+    private:
+        Codec mCodec;
+        SizeType mThreshold;
+        SizeType mMaxPacketSize;
+        std::vector<char> mCompressed;
+        std::vector<char> mDecompressed;
+        std::uint64_t mBytesIn;
+        std::uint64_t mBytesOut;
+
+        constexpr static const char Raw = 0;
+        constexpr static const char Compressed = 1;
+        constexpr static const SizeType MaxSizePrefix = WireFormat::MaxVarintSize; // Original size is a varint.
+    };
+}
+
+#endif // KCPLUS_COMPRESS_HPP
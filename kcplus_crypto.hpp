@@ -0,0 +1,342 @@
+/*
+    Copyright 2017 Miigon
+
+    Licensed under the Apache License, Version 2.0 (the "License");
+    you may not use this file except in compliance with the License.
+    You may obtain a copy of the License at
+
+        http://www.apache.org/licenses/LICENSE-2.0
+
+    Unless required by applicable law or agreed to in writing, software
+    distributed under the License is distributed on an "AS IS" BASIS,
+    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+    See the License for the specific language governing permissions and
+    limitations under the License.
+*/
+
+#ifndef KCPLUS_CRYPTO_HPP
+#define KCPLUS_CRYPTO_HPP
+
+#include <cstdint>
+#include <cstring>
+#include <stdexcept>
+#include <utility>
+#include <vector>
+#include "kcplus.hpp"
+
+#if !defined(KCPLUS_NO_OPENSSL) && defined(__has_include)
+#if __has_include(<openssl/evp.h>)
+#include <openssl/evp.h>
+#define KCPLUS_HAS_OPENSSL 1
+#endif
+#endif
+
+namespace ikcp
+{
+    /**
+     * @brief Wire format of `BasicCryptoStage`. (KCPlus feature)
+     * @details
+     * Every datagram is the packet counter (64 bits, little endian), the encrypted low-level packet and the
+     * authentication tag. The counter makes up the nonce, so it's never reused under one key.
+     */
+    struct CryptoFormat
+    {
+        constexpr static const SizeType CounterSize = 8;
+        constexpr static const SizeType NonceSize = 12;
+        constexpr static const SizeType TagSize = 16;
+        /**
+         * @brief Bytes added to every low-level packet. Lower the MTU of sessions by it.
+         */
+        constexpr static const SizeType Overhead = CounterSize + TagSize;
+    };
+
+#ifdef KCPLUS_HAS_OPENSSL
+    /**
+     * @brief AEAD cipher of OpenSSL for `BasicCryptoStage`. (KCPlus feature)
+     * @details
+     * Keys are expanded once per direction, and every packet only sets a new nonce, so what's left per packet is the
+     * cipher itself: OpenSSL runs AES-GCM with AES-NI and carry-less multiply (stitched, AVX2/AVX-512 where
+     * available), and ChaCha20-Poly1305 with SIMD as well.
+     * Only if `KCPLUS_HAS_OPENSSL` is defined. Link with `-lcrypto`.
+     */
+    class OpenSSLCipher
+    {
+    public:
+        enum class Algorithm
+        {
+            AES256GCM,
+            ChaCha20Poly1305
+        };
+
+        constexpr static const SizeType KeySize = 32;
+
+        /**
+         * @param algorithm Cipher to use, the same on both sides.
+         * @param key `KeySize` bytes of key.
+         * @throw std::runtime_error If OpenSSL can not set up the cipher.
+         */
+        OpenSSLCipher(Algorithm algorithm, const unsigned char key[])
+            :mSeal(EVP_CIPHER_CTX_new()),mOpen(EVP_CIPHER_CTX_new())
+        {
+            const EVP_CIPHER *cipher = algorithm == Algorithm::AES256GCM ? EVP_aes_256_gcm() : EVP_chacha20_poly1305();
+            if(mSeal == nullptr || mOpen == nullptr ||
+                EVP_EncryptInit_ex(mSeal, cipher, nullptr, nullptr, nullptr) != 1 ||
+                EVP_DecryptInit_ex(mOpen, cipher, nullptr, nullptr, nullptr) != 1 ||
+                EVP_CIPHER_CTX_ctrl(mSeal, EVP_CTRL_AEAD_SET_IVLEN, CryptoFormat::NonceSize, nullptr) != 1 ||
+                EVP_CIPHER_CTX_ctrl(mOpen, EVP_CTRL_AEAD_SET_IVLEN, CryptoFormat::NonceSize, nullptr) != 1 ||
+                EVP_EncryptInit_ex(mSeal, nullptr, nullptr, key, nullptr) != 1 ||
+                EVP_DecryptInit_ex(mOpen, nullptr, nullptr, key, nullptr) != 1)
+            {
+                release();
+                throw std::runtime_error("OpenSSLCipher: can not set up the cipher");
+            }
+        }
+
+        OpenSSLCipher(OpenSSLCipher &&other) noexcept
+            :mSeal(other.mSeal),mOpen(other.mOpen)
+        {
+            other.mSeal = nullptr;
+            other.mOpen = nullptr;
+        }
+
+        ~OpenSSLCipher()
+        {
+            release();
+        }
+
+        OpenSSLCipher(const OpenSSLCipher &) = delete;
+        OpenSSLCipher &operator=(const OpenSSLCipher &) = delete;
+
+        /**
+         * @brief Encrypts `size` bytes of `in` to `out`, which may be the same, and writes the tag.
+         */
+        bool seal(const unsigned char nonce[], const unsigned char in[], SizeType size, unsigned char out[],
+            unsigned char tag[])
+        {
+            int length = 0;
+            return EVP_EncryptInit_ex(mSeal, nullptr, nullptr, nullptr, nonce) == 1 &&
+                EVP_EncryptUpdate(mSeal, out, &length, in, static_cast<int>(size)) == 1 &&
+                EVP_EncryptFinal_ex(mSeal, out + length, &length) == 1 &&
+                EVP_CIPHER_CTX_ctrl(mSeal, EVP_CTRL_AEAD_GET_TAG, CryptoFormat::TagSize, tag) == 1;
+        }
+
+        /**
+         * @brief Decrypts `size` bytes of `in` to `out`, which may be the same.
+         * @return `false` if the tag doesn't match, `out` must be ignored then.
+         */
+        bool open(const unsigned char nonce[], const unsigned char in[], SizeType size, unsigned char out[],
+            const unsigned char tag[])
+        {
+            int length = 0;
+            return EVP_DecryptInit_ex(mOpen, nullptr, nullptr, nullptr, nonce) == 1 &&
+                EVP_DecryptUpdate(mOpen, out, &length, in, static_cast<int>(size)) == 1 &&
+                EVP_CIPHER_CTX_ctrl(mOpen, EVP_CTRL_AEAD_SET_TAG, CryptoFormat::TagSize,
+                    const_cast<unsigned char *>(tag)) == 1 &&
+                EVP_DecryptFinal_ex(mOpen, out + length, &length) == 1;
+        }
+    private:
+        EVP_CIPHER_CTX *mSeal;
+        EVP_CIPHER_CTX *mOpen;
+
+        void release()
+        {
+            EVP_CIPHER_CTX_free(mSeal);
+            EVP_CIPHER_CTX_free(mOpen);
+            mSeal = nullptr;
+            mOpen = nullptr;
+        }
+    };
+#endif
+
+    /**
+     * @brief Encrypts and authenticates low-level packets of a session. (KCPlus feature)
+     * @details
+     * Sits between the output function of a session and the transport, and between the transport and `input()`.
+     * Outgoing packets are sealed into one reused buffer, incoming ones are opened in place, so there is neither
+     * allocation nor extra copy per packet. Replayed and forged datagrams are dropped before they reach KCP.
+     * Use a fresh key per connection and direction, eg. from a handshake: counters start at 0 for every stage.
+     * @code
+     * ikcp::CryptoStage crypto(ikcp::OpenSSLCipher(ikcp::OpenSSLCipher::Algorithm::AES256GCM, clientToServerKey),
+     *     ikcp::OpenSSLCipher(ikcp::OpenSSLCipher::Algorithm::AES256GCM, serverToClientKey));
+     * session.setMTU(1400 - ikcp::CryptoFormat::Overhead);
+     * session.setOutputFunction([&](const char data[], ikcp::SizeType size)
+     * {
+     *     crypto.output(data, size, sendDatagram);
+     * });
+     * onDatagram([&](char data[], ikcp::SizeType size)
+     * {
+     *     crypto.input(data, size, [&](const char packet[], ikcp::SizeType packetSize)
+     *     {
+     *         session.input(packet, packetSize);
+     *     });
+     * });
+     * @endcode
+     * Not thread-safe.
+     * @tparam Cipher Provides `bool seal(nonce, in, size, out, tag)` and `bool open(nonce, in, size, out, tag)` over
+     * `unsigned char` arrays, with a 12 byte nonce and a 16 byte tag, like `OpenSSLCipher`.
+     */
+    template<class Cipher>
+    class BasicCryptoStage
+    {
+    public:
+        /**
+         * @param sendCipher Keyed for this side's packets.
+         * @param receiveCipher Keyed for the peer's packets.
+         * @param maxPacketSize Largest low-level packet, ie. the MTU of the session.
+         */
+        BasicCryptoStage(Cipher sendCipher, Cipher receiveCipher, SizeType maxPacketSize = 1500)
+            :mSendCipher(std::move(sendCipher)),mReceiveCipher(std::move(receiveCipher)),
+            mBuffer(maxPacketSize + CryptoFormat::Overhead),mSendCounter(0),mHighestCounter(0),mReplayWindow(0),
+            mRejected(0)
+        {
+        }
+
+        /**
+         * @brief Seals a low-level packet and sends it through `sink`.
+         * @param sink Called as `sink(const char data[], SizeType size)` with the datagram.
+         * @return `false` if the packet is larger than `maxPacketSize` or the cipher failed, nothing is sent then.
+         */
+        template<class Output>
+        bool output(const char data[], SizeType size, Output &&sink)
+        {
+            if(size + CryptoFormat::Overhead > mBuffer.size())
+            {
+                return false;
+            }
+            unsigned char *datagram = mBuffer.data();
+            for(SizeType i = 0; i < CryptoFormat::CounterSize; ++i)
+            {
+                datagram[i] = static_cast<unsigned char>(mSendCounter >> (8 * i));
+            }
+            unsigned char nonce[CryptoFormat::NonceSize];
+            makeNonce(datagram, nonce);
+            unsigned char *payload = datagram + CryptoFormat::CounterSize;
+            if(!mSendCipher.seal(nonce, reinterpret_cast<const unsigned char *>(data), size, payload, payload + size))
+            {
+                return false;
+            }
+            ++mSendCounter;
+            sink(reinterpret_cast<const char *>(datagram), size + CryptoFormat::Overhead);
+            return true;
+        }
+
+        /**
+         * @brief Opens a datagram in place and passes the low-level packet to `sink`.
+         * @param sink Called as `sink(const char packet[], SizeType size)`, with a view into `data`.
+         * @return `false` if the datagram is malformed, forged or replayed, `sink` isn't called then.
+         */
+        template<class Input>
+        bool input(char data[], SizeType size, Input &&sink)
+        {
+            if(size < CryptoFormat::Overhead)
+            {
+                ++mRejected;
+                return false;
+            }
+            unsigned char *datagram = reinterpret_cast<unsigned char *>(data);
+            std::uint64_t counter = decodeCounter(datagram);
+            if(isReplayed(counter))
+            {
+                ++mRejected;
+                return false;
+            }
+            unsigned char nonce[CryptoFormat::NonceSize];
+            makeNonce(datagram, nonce);
+            SizeType payloadSize = size - CryptoFormat::Overhead;
+            unsigned char *payload = datagram + CryptoFormat::CounterSize;
+            if(!mReceiveCipher.open(nonce, payload, payloadSize, payload, payload + payloadSize))
+            {
+                ++mRejected;
+                return false;
+            }
+            accept(counter);
+            sink(reinterpret_cast<const char *>(payload), payloadSize);
+            return true;
+        }
+
+        /**
+         * @brief Same as `input(char data[], SizeType size, Input &&sink)`, for read-only receive buffers.
+         * @details The packet is decrypted into the buffer of the stage instead, and the view passed to `sink` stays
+         * valid until the next call.
+         */
+        template<class Input>
+        bool input(const char data[], SizeType size, Input &&sink)
+        {
+            if(size > mReceiveBuffer.size())
+            {
+                mReceiveBuffer.resize(std::max(size, mBuffer.size()));
+            }
+            std::memcpy(mReceiveBuffer.data(), data, size);
+            return input(mReceiveBuffer.data(), size, std::forward<Input>(sink));
+        }
+
+        /**
+         * @brief Returns number of datagrams dropped by `input()`.
+         */
+        std::uint64_t rejected() const
+        {
+            return mRejected;
+        }
+    private:
+        Cipher mSendCipher;
+        Cipher mReceiveCipher;
+        std::vector<unsigned char> mBuffer;
+        std::vector<char> mReceiveBuffer;
+        std::uint64_t mSendCounter;
+        std::uint64_t mHighestCounter;      // Highest counter accepted, plus one. 0 before the first one.
+        std::uint64_t mReplayWindow;        // Bit i is set if `mHighestCounter - 1 - i` was accepted.
+        std::uint64_t mRejected;
+
+        constexpr static const std::uint64_t ReplayWindowSize = 64;
+
+        static std::uint64_t decodeCounter(const unsigned char datagram[])
+        {
+            std::uint64_t counter = 0;
+            for(SizeType i = 0; i < CryptoFormat::CounterSize; ++i)
+            {
+                counter |= static_cast<std::uint64_t>(datagram[i]) << (8 * i);
+            }
+            return counter;
+        }
+
+        static void makeNonce(const unsigned char counter[], unsigned char nonce[])
+        {
+            std::memset(nonce, 0, CryptoFormat::NonceSize - CryptoFormat::CounterSize);
+            std::memcpy(nonce + CryptoFormat::NonceSize - CryptoFormat::CounterSize, counter, CryptoFormat::CounterSize);
+        }
+
+        bool isReplayed(std::uint64_t counter) const
+        {
+            if(counter >= mHighestCounter)
+            {
+                return false;
+            }
+            std::uint64_t age = mHighestCounter - 1 - counter;
+            return age >= ReplayWindowSize || (mReplayWindow & (std::uint64_t(1) << age)) != 0;
+        }
+
+        void accept(std::uint64_t counter)
+        {
+            if(counter >= mHighestCounter)
+            {
+                std::uint64_t shift = counter + 1 - mHighestCounter;
+                mReplayWindow = shift >= ReplayWindowSize ? 0 : mReplayWindow << shift;
+                mReplayWindow |= 1;
+                mHighestCounter = counter + 1;
+            }
+            else
+            {
+                mReplayWindow |= std::uint64_t(1) << (mHighestCounter - 1 - counter);
+            }
+        }
+    };
+
+#ifdef KCPLUS_HAS_OPENSSL
+    /**
+     * @brief `BasicCryptoStage` over OpenSSL. Only if `KCPLUS_HAS_OPENSSL` is defined.
+     */
+    using CryptoStage = BasicCryptoStage<OpenSSLCipher>;
+#endif
+}
+
+#endif // KCPLUS_CRYPTO_HPP
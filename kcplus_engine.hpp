@@ -0,0 +1,438 @@
+/*
+    Copyright 2017 Miigon
+
+    Licensed under the Apache License, Version 2.0 (the "License");
+    you may not use this file except in compliance with the License.
+    You may obtain a copy of the License at
+
+        http://www.apache.org/licenses/LICENSE-2.0
+
+    Unless required by applicable law or agreed to in writing, software
+    distributed under the License is distributed on an "AS IS" BASIS,
+    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+    See the License for the specific language governing permissions and
+    limitations under the License.
+*/
+
+#ifndef KCPLUS_ENGINE_HPP
+#define KCPLUS_ENGINE_HPP
+
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <system_error>
+#include <thread>
+#include <vector>
+#include <linux/filter.h>
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+#include "kcplus.hpp"
+#include "kcplus_queue.hpp"
+#include "kcplus_server.hpp"
+#include "kcplus_udp.hpp"
+
+#ifndef SO_ATTACH_REUSEPORT_CBPF
+#define SO_ATTACH_REUSEPORT_CBPF 51
+#endif
+
+namespace ikcp
+{
+    class KCPEngine;
+
+    /**
+     * @brief One worker thread of `KCPEngine`, with its own socket, `KCPServer` and timer wheel. (KCPlus feature)
+     * @details
+     * Everything of a shard is only touched by its own thread, except `post()`.
+     */
+    class KCPShard
+    {
+    public:
+        /**
+         * @brief A function run on the shard thread.
+         */
+        using Task = std::function<void(KCPShard &shard)>;
+
+        ~KCPShard()
+        {
+            ::close(mEventFd);
+        }
+
+        KCPShard(const KCPShard &) = delete;
+        KCPShard &operator=(const KCPShard &) = delete;
+
+        /**
+         * @brief Runs `task` on the shard thread. Thread-safe.
+         * @return `false` if the task queue of the shard is full.
+         */
+        bool post(Task task)
+        {
+            if(!mTasks.tryPush(std::move(task)))
+            {
+                return false;
+            }
+            wakeup();
+            return true;
+        }
+
+        /**
+         * @brief Returns the server of the shard. Shard thread only.
+         */
+        KCPServer &server()
+        {
+            return mServer;
+        }
+
+        /**
+         * @brief Returns the transport of the shard. Shard thread only.
+         */
+        UDPTransport &transport()
+        {
+            return mTransport;
+        }
+
+        /**
+         * @brief Returns index of the shard in its engine.
+         */
+        SizeType index() const
+        {
+            return mIndex;
+        }
+    private:
+        friend class KCPEngine;
+
+        KCPEngine &mEngine;
+        SizeType mIndex;
+        KCPServer mServer;
+        UDPTransport mTransport;
+        MPSCQueue<Task> mTasks;
+        int mEventFd;
+        std::atomic<bool> mNotified;
+        SocketAddress mFrom;
+        DatagramBatch mBatch;
+        std::thread mThread;
+
+        KCPShard(KCPEngine &engine, SizeType index, SizeType queueCapacity)
+            :mEngine(engine),mIndex(index),mTasks(queueCapacity),mEventFd(::eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)),
+            mNotified(false)
+        {
+            if(mEventFd < 0)
+            {
+                throw std::system_error(errno, std::system_category(), "KCPShard: eventfd");
+            }
+        }
+
+        void wakeup()
+        {
+            if(!mNotified.exchange(true))
+            {
+                std::uint64_t value = 1;
+                ssize_t result = ::write(mEventFd, &value, sizeof(value));
+                (void)result;
+            }
+        }
+
+        void runTasks(bool notified)
+        {
+            if(notified)
+            {
+                std::uint64_t value;
+                ssize_t result = ::read(mEventFd, &value, sizeof(value));
+                (void)result;
+                mNotified.store(false);
+            }
+            Task task;
+            while(mTasks.tryPop(task))
+            {
+                task(*this);
+            }
+        }
+
+        void input(const char data[], SizeType size, const SocketAddress &from)
+        {
+            mFrom = from;
+            mServer.input(data, size);
+        }
+
+        void input(const ConstBuffer datagrams[], SizeType count, const SocketAddress &from)
+        {
+            mFrom = from;
+            mServer.input(datagrams, count);
+        }
+
+        void run();
+    };
+
+    /**
+     * @brief Multi-core KCP server: N shards, each with its own `SO_REUSEPORT` socket and thread. (KCPlus feature)
+     * @details
+     * Sessions are pinned to shards by conv: a classic BPF program attached to the reuseport group makes the kernel
+     * deliver datagrams to the socket of `shardOf(conv)`, so the hot path needs no locks. Where that's not available,
+     * datagrams landing on a wrong shard are forwarded to the right one.
+     * Application threads can call `send()`/`post()` safely, they go through a lock-free MPSC queue of the shard.
+     * Receive callbacks and the accept callback run on shard threads.
+     */
+    class KCPEngine
+    {
+    public:
+        /**
+         * @brief Called on the shard thread when a new client arrived. Returns `false` to reject the client.
+         * @details The output function of the session is already set when it's called.
+         */
+        using AcceptCallback = std::function<bool(KCPShard &shard, IUINT32 conv, KCPSession &session)>;
+
+        /**
+         * @brief Called on the shard thread when a packet of `send()` was dropped, because there is no session of
+         * `conv` or it rejected the packet with `SendStatus::WouldBlock`.
+         * @details Set a writable callback on sessions (see `KCPSession::setWatermarks()`) to learn when to resume.
+         */
+        using SendRejectedCallback = std::function<void(KCPShard &shard, IUINT32 conv)>;
+
+        /**
+         * @param numOfShards Number of shards, 0 for number of hardware threads.
+         * @param queueCapacity Capacity of the task queue of each shard.
+         */
+        explicit KCPEngine(SizeType numOfShards = 0, SizeType queueCapacity = 4096)
+            :mRunning(false),mTickInterval(10),mIdleTimeout(0)
+        {
+            if(numOfShards == 0)
+            {
+                numOfShards = std::thread::hardware_concurrency();
+            }
+            if(numOfShards == 0)
+            {
+                numOfShards = 1;
+            }
+            for(SizeType i = 0; i < numOfShards; ++i)
+            {
+                mShards.emplace_back(new KCPShard(*this, i, queueCapacity));
+            }
+        }
+
+        ~KCPEngine()
+        {
+            stop();
+        }
+
+        KCPEngine(const KCPEngine &) = delete;
+        KCPEngine &operator=(const KCPEngine &) = delete;
+
+        /**
+         * @brief Sets the function called when a new client arrived. Call it before `start()`.
+         */
+        void setAcceptCallback(AcceptCallback acceptCallback)
+        {
+            mAcceptFunc = acceptCallback;
+        }
+
+        /**
+         * @brief Sets the function called when a packet of `send()` was dropped by its shard. Call it before `start()`.
+         */
+        void setSendRejectedCallback(SendRejectedCallback sendRejectedCallback)
+        {
+            mSendRejectedFunc = sendRejectedCallback;
+        }
+
+        /**
+         * @brief Sets idle timeout of sessions. Call it before `start()`.
+         * @see KCPServer::setIdleTimeout()
+         */
+        void setIdleTimeout(IUINT32 idleTimeout)
+        {
+            mIdleTimeout = idleTimeout;
+        }
+
+        /**
+         * @brief Sets how often shards update their sessions. Call it before `start()`.
+         * @param tickInterval Interval in millisec, by default it's 10ms.
+         */
+        void setTickInterval(IUINT32 tickInterval)
+        {
+            mTickInterval = tickInterval;
+        }
+
+        /**
+         * @brief Binds every shard to `address` and starts shard threads.
+         * @throw std::system_error If sockets can not be set up.
+         */
+        void start(const SocketAddress &address)
+        {
+            for(auto &shard : mShards)
+            {
+                shard->mTransport.open(address.storage.ss_family);
+                shard->mTransport.setReusePort(true);
+                shard->mTransport.bind(address);
+                shard->mServer.setIdleTimeout(mIdleTimeout);
+                KCPShard *shardPtr = shard.get();
+                shard->mServer.setAcceptCallback([this, shardPtr](IUINT32 conv, KCPSession &session)
+                {
+                    session.setOutputFunction(shardPtr->mTransport.outputTo(shardPtr->mFrom));
+                    return !mAcceptFunc || mAcceptFunc(*shardPtr, conv, session);
+                });
+            }
+            attachSteeringProgram();
+            mRunning.store(true);
+            for(auto &shard : mShards)
+            {
+                KCPShard *shardPtr = shard.get();
+                shard->mThread = std::thread([shardPtr]()
+                {
+                    shardPtr->run();
+                });
+            }
+        }
+
+        /**
+         * @brief Stops and joins shard threads. Sessions are kept until the engine is destroyed.
+         */
+        void stop()
+        {
+            if(!mRunning.exchange(false))
+            {
+                return;
+            }
+            for(auto &shard : mShards)
+            {
+                shard->wakeup();
+            }
+            for(auto &shard : mShards)
+            {
+                shard->mThread.join();
+            }
+        }
+
+        /**
+         * @brief Returns index of the shard owning sessions of `conv`.
+         * @details Matches the BPF steering program, which reads conv in network byte order.
+         */
+        SizeType shardOf(IUINT32 conv) const
+        {
+            IUINT32 value = ((conv & 0xffu) << 24) | ((conv & 0xff00u) << 8) | ((conv >> 8) & 0xff00u) | (conv >> 24);
+            return static_cast<SizeType>(value % mShards.size());
+        }
+
+        /**
+         * @brief Returns the shard of index `index`.
+         */
+        KCPShard &shard(SizeType index)
+        {
+            return *mShards[index];
+        }
+
+        SizeType getNumOfShards() const
+        {
+            return mShards.size();
+        }
+
+        /**
+         * @brief Runs `task` with the session of `conv` on its shard thread. Thread-safe.
+         * @details `task` is not run if there is no such session.
+         * @return `false` if the task queue of the shard is full.
+         */
+        bool post(IUINT32 conv, std::function<void(KCPSession &session)> task)
+        {
+            return mShards[shardOf(conv)]->post([conv, task](KCPShard &shard)
+            {
+                KCPSession *session = shard.server().find(conv);
+                if(session != nullptr)
+                {
+                    task(*session);
+                    shard.server().wakeup(conv);
+                }
+            });
+        }
+
+        /**
+         * @brief Sends a high-level packet to the session of `conv`. Thread-safe.
+         * @details Data is copied. The packet is dropped if there is no such session, or if the session is over its
+         * high watermark, and the send rejected callback is called on the shard thread then.
+         * @return `false` if the task queue of the shard is full.
+         * @see setSendRejectedCallback()
+         */
+        bool send(IUINT32 conv, const char data[], SizeType size)
+        {
+            std::shared_ptr<std::vector<char>> packet = std::make_shared<std::vector<char>>(data, data + size);
+            return mShards[shardOf(conv)]->post([this, conv, packet](KCPShard &shard)
+            {
+                if(!shard.server().send(conv, packet->data(), packet->size()) && mSendRejectedFunc)
+                {
+                    mSendRejectedFunc(shard, conv);
+                }
+            });
+        }
+    private:
+        friend class KCPShard;
+
+        std::vector<std::unique_ptr<KCPShard>> mShards;
+        std::atomic<bool> mRunning;
+        AcceptCallback mAcceptFunc;
+        SendRejectedCallback mSendRejectedFunc;
+        IUINT32 mTickInterval;
+        IUINT32 mIdleTimeout;
+
+        // Makes the kernel pick socket `shardOf(conv)` of the reuseport group. Falls back to forwarding on failure.
+        void attachSteeringProgram()
+        {
+            sock_filter code[] = {
+                { BPF_LD | BPF_W | BPF_ABS, 0, 0, 0 }, // A = first 4 bytes of UDP payload, which is conv.
+                { BPF_ALU | BPF_MOD | BPF_K, 0, 0, static_cast<std::uint32_t>(mShards.size()) },
+                { BPF_RET | BPF_A, 0, 0, 0 },
+            };
+            sock_fprog program;
+            program.len = sizeof(code) / sizeof(code[0]);
+            program.filter = code;
+            ::setsockopt(mShards[0]->mTransport.fd(), SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF, &program, sizeof(program));
+        }
+    };
+
+    inline void KCPShard::run()
+    {
+        const SizeType MaxBatchesPerTick = 16;
+        pollfd fds[2];
+        fds[0].fd = mTransport.fd();
+        fds[0].events = POLLIN;
+        fds[1].fd = mEventFd;
+        fds[1].events = POLLIN;
+        auto dispatch = [this](const ConstBuffer datagrams[], SizeType count, const SocketAddress &from)
+        {
+            input(datagrams, count, from);
+        };
+        while(mEngine.mRunning.load())
+        {
+            fds[1].revents = 0;
+            ::poll(fds, 2, static_cast<int>(mEngine.mTickInterval));
+            runTasks((fds[1].revents & POLLIN) != 0);
+            for(SizeType i = 0; i < MaxBatchesPerTick; ++i)
+            {
+                SizeType received = mTransport.receive([this, &dispatch](const char data[], SizeType size, const SocketAddress &from)
+                {
+                    if(size >= KCPOverhead)
+                    {
+                        SizeType owner = mEngine.shardOf(ikcp_getconv(data));
+                        if(owner != mIndex)
+                        {
+                            std::shared_ptr<std::vector<char>> packet = std::make_shared<std::vector<char>>(data, data + size);
+                            mEngine.mShards[owner]->post([packet, from](KCPShard &shard)
+                            {
+                                shard.input(packet->data(), packet->size(), from);
+                            });
+                            return;
+                        }
+                    }
+                    mBatch.add(data, size, from, dispatch);
+                });
+                mBatch.dispatch(dispatch);
+                if(received == 0)
+                {
+                    break;
+                }
+            }
+            Clock::tick();
+            mServer.update();
+            mTransport.flush();
+        }
+    }
+}
+
+#endif // KCPLUS_ENGINE_HPP
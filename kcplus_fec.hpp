@@ -0,0 +1,723 @@
+/*
+    Copyright 2017 Miigon
+
+    Licensed under the Apache License, Version 2.0 (the "License");
+    you may not use this file except in compliance with the License.
+    You may obtain a copy of the License at
+
+        http://www.apache.org/licenses/LICENSE-2.0
+
+    Unless required by applicable law or agreed to in writing, software
+    distributed under the License is distributed on an "AS IS" BASIS,
+    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+    See the License for the specific language governing permissions and
+    limitations under the License.
+*/
+
+#ifndef KCPLUS_FEC_HPP
+#define KCPLUS_FEC_HPP
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <stdexcept>
+#include <vector>
+#include "kcplus.hpp"
+
+#if (defined(__x86_64__) || defined(__i386__)) && (defined(__GNUC__) || defined(__clang__))
+#include <immintrin.h>
+#define KCPLUS_FEC_X86 1
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+#include <arm_neon.h>
+#define KCPLUS_FEC_NEON 1
+#endif
+
+namespace ikcp
+{
+    /**
+     * @brief Systematic Reed-Solomon erasure code over GF(2^8), for `FECEncoder`/`FECDecoder`. (KCPlus feature)
+     * @details
+     * Parity shards are rows of a Cauchy matrix, so any `dataShards` of the `dataShards + parityShards` shards are
+     * enough to rebuild the others. With one parity shard it's as cheap as XOR parity.
+     * Multiplying a shard by a constant is split into two 16-entry tables by nibbles, which maps to one byte shuffle
+     * per nibble: AVX2 or SSSE3 on x86 (picked at runtime), NEON on AArch64, and a portable loop elsewhere.
+     */
+    class ReedSolomon
+    {
+    public:
+        /**
+         * @brief Products of a constant with every nibble, low and high.
+         */
+        struct MulTable
+        {
+            unsigned char low[16];
+            unsigned char high[16];
+        };
+
+        /**
+         * @throw std::invalid_argument If there are no data shards, or more than 256 shards in total.
+         */
+        ReedSolomon(SizeType dataShards, SizeType parityShards)
+            :mDataShards(dataShards),mParityShards(parityShards)
+        {
+            if(dataShards == 0 || dataShards + parityShards > 256)
+            {
+                throw std::invalid_argument("ReedSolomon: between 1 and 256 shards are supported");
+            }
+            mParityTables.resize(parityShards * dataShards);
+            for(SizeType i = 0; i < parityShards; ++i)
+            {
+                for(SizeType j = 0; j < dataShards; ++j)
+                {
+                    mParityTables[i * dataShards + j] = tableOf(coefficient(dataShards + i, j));
+                }
+            }
+        }
+
+        SizeType dataShards() const
+        {
+            return mDataShards;
+        }
+
+        SizeType parityShards() const
+        {
+            return mParityShards;
+        }
+
+        /**
+         * @brief Computes parity shard `index` of `data`. Every shard is `size` bytes.
+         */
+        void encode(const unsigned char *const data[], SizeType index, unsigned char parity[], SizeType size) const
+        {
+            std::memset(parity, 0, size);
+            for(SizeType j = 0; j < mDataShards; ++j)
+            {
+                mulAdd(mParityTables[index * mDataShards + j], data[j], parity, size);
+            }
+        }
+
+        /**
+         * @brief Rebuilds missing data shards.
+         * @param shards Every shard by index, data shards first. Missing data shards are written in place.
+         * @param present Whether each shard was received. At least `dataShards` of them must be.
+         * @param size Size of every shard.
+         * @return `false` if too few shards are present.
+         */
+        bool reconstruct(unsigned char *const shards[], const bool present[], SizeType size) const
+        {
+            const SizeType k = mDataShards;
+            std::vector<SizeType> rows;
+            rows.reserve(k);
+            for(SizeType index = 0; index < k + mParityShards && rows.size() < k; ++index)
+            {
+                if(present[index])
+                {
+                    rows.push_back(index);
+                }
+            }
+            if(rows.size() < k)
+            {
+                return false;
+            }
+            // Rows of the encoding matrix for the shards we have, inverted by Gauss-Jordan elimination.
+            std::vector<unsigned char> matrix(k * k), inverse(k * k, 0);
+            for(SizeType r = 0; r < k; ++r)
+            {
+                for(SizeType c = 0; c < k; ++c)
+                {
+                    matrix[r * k + c] = rows[r] < k ? (rows[r] == c ? 1 : 0) : coefficient(rows[r], c);
+                }
+                inverse[r * k + r] = 1;
+            }
+            for(SizeType c = 0; c < k; ++c)
+            {
+                SizeType pivot = c;
+                while(matrix[pivot * k + c] == 0)
+                {
+                    ++pivot; // Always found, every square submatrix of a Cauchy matrix is invertible.
+                }
+                if(pivot != c)
+                {
+                    std::swap_ranges(&matrix[pivot * k], &matrix[pivot * k] + k, &matrix[c * k]);
+                    std::swap_ranges(&inverse[pivot * k], &inverse[pivot * k] + k, &inverse[c * k]);
+                }
+                unsigned char scale = divide(1, matrix[c * k + c]);
+                for(SizeType i = 0; i < k; ++i)
+                {
+                    matrix[c * k + i] = multiply(matrix[c * k + i], scale);
+                    inverse[c * k + i] = multiply(inverse[c * k + i], scale);
+                }
+                for(SizeType r = 0; r < k; ++r)
+                {
+                    unsigned char factor = matrix[r * k + c];
+                    if(r == c || factor == 0)
+                    {
+                        continue;
+                    }
+                    for(SizeType i = 0; i < k; ++i)
+                    {
+                        matrix[r * k + i] ^= multiply(factor, matrix[c * k + i]);
+                        inverse[r * k + i] ^= multiply(factor, inverse[c * k + i]);
+                    }
+                }
+            }
+            for(SizeType j = 0; j < k; ++j)
+            {
+                if(present[j])
+                {
+                    continue;
+                }
+                std::memset(shards[j], 0, size);
+                for(SizeType r = 0; r < k; ++r)
+                {
+                    unsigned char factor = inverse[j * k + r];
+                    if(factor != 0)
+                    {
+                        mulAdd(tableOf(factor), shards[rows[r]], shards[j], size);
+                    }
+                }
+            }
+            return true;
+        }
+
+        /**
+         * @brief `dst[i] ^= c * src[i]` for `size` bytes, where `table` is `tableOf(c)`.
+         */
+        static void mulAdd(const MulTable &table, const unsigned char src[], unsigned char dst[], SizeType size)
+        {
+            SizeType done = 0;
+#if defined(KCPLUS_FEC_X86)
+            done = kernel()(table, src, dst, size);
+#elif defined(KCPLUS_FEC_NEON)
+            uint8x16_t low = vld1q_u8(table.low);
+            uint8x16_t high = vld1q_u8(table.high);
+            uint8x16_t mask = vdupq_n_u8(0x0f);
+            for(; done + 16 <= size; done += 16)
+            {
+                uint8x16_t x = vld1q_u8(src + done);
+                uint8x16_t product = veorq_u8(vqtbl1q_u8(low, vandq_u8(x, mask)), vqtbl1q_u8(high, vshrq_n_u8(x, 4)));
+                vst1q_u8(dst + done, veorq_u8(vld1q_u8(dst + done), product));
+            }
+#endif
+            for(SizeType i = done; i < size; ++i)
+            {
+                dst[i] ^= table.low[src[i] & 0x0f] ^ table.high[src[i] >> 4];
+            }
+        }
+
+        static MulTable tableOf(unsigned char c)
+        {
+            MulTable table;
+            for(unsigned i = 0; i < 16; ++i)
+            {
+                table.low[i] = multiply(c, static_cast<unsigned char>(i));
+                table.high[i] = multiply(c, static_cast<unsigned char>(i << 4));
+            }
+            return table;
+        }
+
+        static unsigned char multiply(unsigned char a, unsigned char b)
+        {
+            if(a == 0 || b == 0)
+            {
+                return 0;
+            }
+            const Tables &tables = fieldTables();
+            return tables.exp[tables.log[a] + tables.log[b]];
+        }
+
+        static unsigned char divide(unsigned char a, unsigned char b)
+        {
+            if(a == 0)
+            {
+                return 0;
+            }
+            const Tables &tables = fieldTables();
+            return tables.exp[tables.log[a] + 255 - tables.log[b]];
+        }
+    private:
+        SizeType mDataShards;
+        SizeType mParityShards;
+        std::vector<MulTable> mParityTables; // Row major, `parityShards` rows of `dataShards`.
+
+        struct Tables
+        {
+            unsigned char exp[512];
+            unsigned char log[256];
+
+            Tables()
+            {
+                unsigned x = 1;
+                for(unsigned i = 0; i < 255; ++i)
+                {
+                    exp[i] = static_cast<unsigned char>(x);
+                    log[x] = static_cast<unsigned char>(i);
+                    x <<= 1;
+                    if(x & 0x100)
+                    {
+                        x ^= 0x11d; // x^8 + x^4 + x^3 + x^2 + 1
+                    }
+                }
+                for(unsigned i = 255; i < 512; ++i)
+                {
+                    exp[i] = exp[i - 255];
+                }
+                log[0] = 0;
+            }
+        };
+
+        static const Tables &fieldTables()
+        {
+            static const Tables tables;
+            return tables;
+        }
+
+        // Row `row` of the encoding matrix below the identity: 1 / (row ^ column), distinct for row >= dataShards.
+        static unsigned char coefficient(SizeType row, SizeType column)
+        {
+            return divide(1, static_cast<unsigned char>(row ^ column));
+        }
+
+#if defined(KCPLUS_FEC_X86)
+        using Kernel = SizeType (*)(const MulTable &, const unsigned char *, unsigned char *, SizeType);
+
+        static Kernel kernel()
+        {
+            static const Kernel selected = selectKernel();
+            return selected;
+        }
+
+        static Kernel selectKernel()
+        {
+            __builtin_cpu_init();
+            if(__builtin_cpu_supports("avx2"))
+            {
+                return mulAddAVX2;
+            }
+            if(__builtin_cpu_supports("ssse3"))
+            {
+                return mulAddSSSE3;
+            }
+            return mulAddNone;
+        }
+
+        static SizeType mulAddNone(const MulTable &, const unsigned char *, unsigned char *, SizeType)
+        {
+            return 0;
+        }
+
+        __attribute__((target("ssse3")))
+        static SizeType mulAddSSSE3(const MulTable &table, const unsigned char *src, unsigned char *dst, SizeType size)
+        {
+            __m128i low = _mm_loadu_si128(reinterpret_cast<const __m128i *>(table.low));
+            __m128i high = _mm_loadu_si128(reinterpret_cast<const __m128i *>(table.high));
+            __m128i mask = _mm_set1_epi8(0x0f);
+            SizeType done = 0;
+            for(; done + 16 <= size; done += 16)
+            {
+                __m128i x = _mm_loadu_si128(reinterpret_cast<const __m128i *>(src + done));
+                __m128i product = _mm_xor_si128(_mm_shuffle_epi8(low, _mm_and_si128(x, mask)),
+                    _mm_shuffle_epi8(high, _mm_and_si128(_mm_srli_epi64(x, 4), mask)));
+                __m128i *out = reinterpret_cast<__m128i *>(dst + done);
+                _mm_storeu_si128(out, _mm_xor_si128(_mm_loadu_si128(out), product));
+            }
+            return done;
+        }
+
+        __attribute__((target("avx2")))
+        static SizeType mulAddAVX2(const MulTable &table, const unsigned char *src, unsigned char *dst, SizeType size)
+        {
+            __m256i low = _mm256_broadcastsi128_si256(_mm_loadu_si128(reinterpret_cast<const __m128i *>(table.low)));
+            __m256i high = _mm256_broadcastsi128_si256(_mm_loadu_si128(reinterpret_cast<const __m128i *>(table.high)));
+            __m256i mask = _mm256_set1_epi8(0x0f);
+            SizeType done = 0;
+            for(; done + 32 <= size; done += 32)
+            {
+                __m256i x = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(src + done));
+                __m256i product = _mm256_xor_si256(_mm256_shuffle_epi8(low, _mm256_and_si256(x, mask)),
+                    _mm256_shuffle_epi8(high, _mm256_and_si256(_mm256_srli_epi64(x, 4), mask)));
+                __m256i *out = reinterpret_cast<__m256i *>(dst + done);
+                _mm256_storeu_si256(out, _mm256_xor_si256(_mm256_loadu_si256(out), product));
+            }
+            return done;
+        }
+#endif
+    };
+
+    /**
+     * @brief Wire format shared by `FECEncoder` and `FECDecoder`. (KCPlus feature)
+     * @details
+     * Every datagram starts with the group number (32 bits, little endian), the shard index and the number of data
+     * shards in the group (only set on parity shards). Data shards are followed by the length of the low-level packet
+     * (16 bits, little endian), which is protected by parity as well, and the packet itself.
+     */
+    struct FECFormat
+    {
+        constexpr static const SizeType HeaderSize = 6;
+        constexpr static const SizeType LengthSize = 2;
+        /**
+         * @brief Bytes added to every low-level packet. Lower the MTU of sessions by it.
+         */
+        constexpr static const SizeType Overhead = HeaderSize + LengthSize;
+    };
+
+    /**
+     * @brief Adds Reed-Solomon parity to the low-level packets of a session. (KCPlus feature)
+     * @details
+     * Sits between the output function of a session and the transport. Low-level packets are sent right away with a
+     * small header, and after every `dataShards` packets, `parityShards` parity packets follow, so up to
+     * `parityShards` lost packets of a group are rebuilt by `FECDecoder` without waiting for a retransmit.
+     * Call `flush()` when the session went quiet (eg. every update interval), otherwise the tail of a burst waits for
+     * the group to fill up before it's protected.
+     * @code
+     * ikcp::FECEncoder encoder(10, 3);
+     * session.setMTU(1400 - ikcp::FECFormat::Overhead);
+     * session.setOutputFunction([&](const char data[], ikcp::SizeType size)
+     * {
+     *     encoder.output(data, size, sendDatagram);
+     * });
+     * @endcode
+     * Not thread-safe.
+     */
+    class FECEncoder
+    {
+    public:
+        /**
+         * @param dataShards Low-level packets per group.
+         * @param parityShards Parity packets per group. Each one costs one packet of bandwidth per group.
+         * @param maxPacketSize Largest low-level packet, ie. the MTU of the session.
+         * @throw std::invalid_argument See `ReedSolomon`.
+         */
+        FECEncoder(SizeType dataShards, SizeType parityShards, SizeType maxPacketSize = 1500)
+            :mCodec(dataShards, parityShards),mShardStride(FECFormat::HeaderSize + FECFormat::LengthSize + maxPacketSize),
+            mShards((dataShards + parityShards) * mShardStride),mGroup(0),mCount(0),mMaxLength(0)
+        {
+        }
+
+        /**
+         * @brief Sends a low-level packet through `output`, followed by parity packets if it completed a group.
+         * @param sink Called as `sink(const char data[], SizeType size)` for every datagram.
+         * @return `false` if the packet is larger than `maxPacketSize` and was sent without protection.
+         */
+        template<class Output>
+        bool output(const char data[], SizeType size, Output &&sink)
+        {
+            if(size > mShardStride - FECFormat::HeaderSize - FECFormat::LengthSize)
+            {
+                flush(sink);
+                std::vector<char> datagram(FECFormat::Overhead + size);
+                writeHeader(datagram.data(), mGroup++, 0, 0);
+                writeLength(datagram.data() + FECFormat::HeaderSize, size);
+                std::memcpy(datagram.data() + FECFormat::Overhead, data, size);
+                sink(datagram.data(), datagram.size());
+                return false;
+            }
+            char *shard = shardAt(mCount);
+            writeHeader(shard, mGroup, static_cast<unsigned char>(mCount), 0);
+            writeLength(shard + FECFormat::HeaderSize, size);
+            std::memcpy(shard + FECFormat::Overhead, data, size);
+            mLengths[mCount] = FECFormat::LengthSize + size;
+            mMaxLength = std::max(mMaxLength, mLengths[mCount]);
+            sink(static_cast<const char *>(shard), FECFormat::Overhead + size);
+            if(++mCount == mCodec.dataShards())
+            {
+                flush(sink);
+            }
+            return true;
+        }
+
+        /**
+         * @brief Sends parity packets of the group so far, and starts a new group.
+         * @param sink Called as `sink(const char data[], SizeType size)` for every datagram.
+         */
+        template<class Output>
+        void flush(Output &&sink)
+        {
+            if(mCount == 0)
+            {
+                return;
+            }
+            const SizeType k = mCodec.dataShards();
+            unsigned char *data[256];
+            for(SizeType j = 0; j < k; ++j)
+            {
+                unsigned char *protectedBytes = reinterpret_cast<unsigned char *>(shardAt(j) + FECFormat::HeaderSize);
+                SizeType length = j < mCount ? mLengths[j] : 0; // Shards never sent count as empty.
+                std::memset(protectedBytes + length, 0, mMaxLength - length);
+                data[j] = protectedBytes;
+            }
+            for(SizeType i = 0; i < mCodec.parityShards(); ++i)
+            {
+                char *shard = shardAt(k + i);
+                writeHeader(shard, mGroup, static_cast<unsigned char>(k + i), static_cast<unsigned char>(mCount));
+                mCodec.encode(data, i, reinterpret_cast<unsigned char *>(shard + FECFormat::HeaderSize), mMaxLength);
+                sink(static_cast<const char *>(shard), FECFormat::HeaderSize + mMaxLength);
+            }
+            ++mGroup;
+            mCount = 0;
+            mMaxLength = 0;
+        }
+    private:
+        ReedSolomon mCodec;
+        SizeType mShardStride;
+        std::vector<char> mShards;
+        IUINT32 mGroup;
+        SizeType mCount;            // Data shards in the current group.
+        SizeType mMaxLength;        // Longest protected part in the current group.
+        SizeType mLengths[256];
+
+        char *shardAt(SizeType index)
+        {
+            return mShards.data() + index * mShardStride;
+        }
+
+        static void writeHeader(char header[], IUINT32 group, unsigned char index, unsigned char count)
+        {
+            header[0] = static_cast<char>(group & 0xff);
+            header[1] = static_cast<char>((group >> 8) & 0xff);
+            header[2] = static_cast<char>((group >> 16) & 0xff);
+            header[3] = static_cast<char>((group >> 24) & 0xff);
+            header[4] = static_cast<char>(index);
+            header[5] = static_cast<char>(count);
+        }
+
+        static void writeLength(char length[], SizeType size)
+        {
+            length[0] = static_cast<char>(size & 0xff);
+            length[1] = static_cast<char>((size >> 8) & 0xff);
+        }
+    };
+
+    /**
+     * @brief Strips what `FECEncoder` added, and rebuilds lost low-level packets from parity. (KCPlus feature)
+     * @details
+     * Sits between the transport and `input()` of a session. Packets are passed on as soon as they arrive, and lost
+     * ones as soon as enough shards of their group did. The last few groups are kept for that, older shards are only
+     * passed on.
+     * @code
+     * ikcp::FECDecoder decoder(10, 3);
+     * onDatagram([&](const char data[], ikcp::SizeType size)
+     * {
+     *     decoder.input(data, size, [&](const char packet[], ikcp::SizeType packetSize)
+     *     {
+     *         session.input(packet, packetSize);
+     *     });
+     * });
+     * @endcode
+     * Not thread-safe.
+     */
+    class FECDecoder
+    {
+    public:
+        constexpr static const SizeType DefaultWindow = 16;
+
+        /**
+         * @param dataShards Same as the encoder.
+         * @param parityShards Same as the encoder.
+         * @param maxPacketSize Same as the encoder.
+         * @param window Number of recent groups kept for recovery.
+         * @throw std::invalid_argument See `ReedSolomon`.
+         */
+        FECDecoder(SizeType dataShards, SizeType parityShards, SizeType maxPacketSize = 1500,
+            SizeType window = DefaultWindow)
+            :mCodec(dataShards, parityShards),mShardStride(FECFormat::LengthSize + maxPacketSize),
+            mGroups(std::max<SizeType>(window, 1)),mRecovered(0)
+        {
+            for(Group &group : mGroups)
+            {
+                group.shards.resize((dataShards + parityShards) * mShardStride);
+                group.present.assign(dataShards + parityShards, false);
+            }
+        }
+
+        /**
+         * @brief Handles a datagram sent by `FECEncoder`.
+         * @param sink Called as `sink(const char packet[], SizeType size)` for every low-level packet passed on
+         * or rebuilt.
+         * @return `false` if the datagram is malformed.
+         */
+        template<class Input>
+        bool input(const char data[], SizeType size, Input &&sink)
+        {
+            if(size < FECFormat::HeaderSize)
+            {
+                return false;
+            }
+            const unsigned char *bytes = reinterpret_cast<const unsigned char *>(data);
+            IUINT32 number = static_cast<IUINT32>(bytes[0]) | (static_cast<IUINT32>(bytes[1]) << 8) |
+                (static_cast<IUINT32>(bytes[2]) << 16) | (static_cast<IUINT32>(bytes[3]) << 24);
+            SizeType index = bytes[4];
+            SizeType count = bytes[5];
+            const SizeType k = mCodec.dataShards();
+            if(index >= k + mCodec.parityShards() || (index >= k && (count == 0 || count > k)))
+            {
+                return false;
+            }
+            const char *protectedBytes = data + FECFormat::HeaderSize;
+            SizeType protectedSize = size - FECFormat::HeaderSize;
+            if(index < k)
+            {
+                if(protectedSize < FECFormat::LengthSize ||
+                    readLength(protectedBytes) != protectedSize - FECFormat::LengthSize)
+                {
+                    return false;
+                }
+            }
+            if(protectedSize > mShardStride)
+            {
+                // Too large to be kept, only pass it on.
+                if(index < k)
+                {
+                    sink(protectedBytes + FECFormat::LengthSize, protectedSize - FECFormat::LengthSize);
+                }
+                return true;
+            }
+
+            Group &group = mGroups[number % mGroups.size()];
+            if(!group.used || static_cast<IINT32>(number - group.number) > 0)
+            {
+                group.reset(number);
+            }
+            else if(group.number != number)
+            {
+                // Older than the window, nothing to recover.
+                if(index < k)
+                {
+                    sink(protectedBytes + FECFormat::LengthSize, protectedSize - FECFormat::LengthSize);
+                }
+                return true;
+            }
+            if(group.present[index] || group.complete)
+            {
+                return true;    // Duplicate, or rebuilt already.
+            }
+            std::memcpy(group.shards.data() + index * mShardStride, protectedBytes, protectedSize);
+            group.present[index] = true;
+            group.lengths[index] = protectedSize;
+            ++group.received;
+            if(index < k)
+            {
+                sink(protectedBytes + FECFormat::LengthSize, protectedSize - FECFormat::LengthSize);
+                ++group.dataReceived;
+            }
+            else
+            {
+                group.parityLength = protectedSize;
+                if(group.count == 0)
+                {
+                    // Shards after the count were never sent, they are empty.
+                    group.count = count;
+                    for(SizeType j = count; j < k; ++j)
+                    {
+                        if(!group.present[j])
+                        {
+                            group.present[j] = true;
+                            group.lengths[j] = 0;
+                            ++group.received;
+                            ++group.dataReceived;
+                        }
+                    }
+                }
+            }
+            if(group.dataReceived == k)
+            {
+                group.complete = true;
+            }
+            else if(group.received >= k && group.parityLength != 0)
+            {
+                recover(group, sink);
+            }
+            return true;
+        }
+
+        /**
+         * @brief Returns number of low-level packets rebuilt from parity.
+         */
+        std::uint64_t recovered() const
+        {
+            return mRecovered;
+        }
+    private:
+        struct Group
+        {
+            IUINT32 number = 0;
+            bool used = false;
+            bool complete = false;
+            SizeType count = 0;             // Data shards in the group, known from a parity shard.
+            SizeType received = 0;
+            SizeType dataReceived = 0;
+            SizeType parityLength = 0;
+            std::vector<char> shards;
+            std::vector<bool> present;
+            SizeType lengths[256];
+
+            void reset(IUINT32 newNumber)
+            {
+                number = newNumber;
+                used = true;
+                complete = false;
+                count = 0;
+                received = 0;
+                dataReceived = 0;
+                parityLength = 0;
+                std::fill(present.begin(), present.end(), false);
+            }
+        };
+
+        ReedSolomon mCodec;
+        SizeType mShardStride;
+        std::vector<Group> mGroups;
+        std::uint64_t mRecovered;
+
+        template<class Input>
+        void recover(Group &group, Input &sink)
+        {
+            const SizeType k = mCodec.dataShards();
+            const SizeType total = k + mCodec.parityShards();
+            const SizeType size = group.parityLength;
+            unsigned char *shards[256];
+            bool present[256];
+            for(SizeType i = 0; i < total; ++i)
+            {
+                shards[i] = reinterpret_cast<unsigned char *>(group.shards.data() + i * mShardStride);
+                present[i] = group.present[i];
+                if(present[i])
+                {
+                    if(group.lengths[i] > size)
+                    {
+                        return; // Doesn't match the parity, give up on the group.
+                    }
+                    std::memset(shards[i] + group.lengths[i], 0, size - group.lengths[i]);
+                }
+            }
+            if(!mCodec.reconstruct(shards, present, size))
+            {
+                return;
+            }
+            group.complete = true;
+            for(SizeType j = 0; j < k; ++j)
+            {
+                if(present[j])
+                {
+                    continue;
+                }
+                const char *shard = reinterpret_cast<const char *>(shards[j]);
+                SizeType length = readLength(shard);
+                if(length == 0 || length > size - FECFormat::LengthSize)
+                {
+                    continue;
+                }
+                ++mRecovered;
+                sink(shard + FECFormat::LengthSize, length);
+            }
+        }
+
+        static SizeType readLength(const char length[])
+        {
+            const unsigned char *bytes = reinterpret_cast<const unsigned char *>(length);
+            return static_cast<SizeType>(bytes[0]) | (static_cast<SizeType>(bytes[1]) << 8);
+        }
+    };
+}
+
+#endif // KCPLUS_FEC_HPP
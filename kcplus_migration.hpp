@@ -0,0 +1,313 @@
+/*
+    Copyright 2017 Miigon
+
+    Licensed under the Apache License, Version 2.0 (the "License");
+    you may not use this file except in compliance with the License.
+    You may obtain a copy of the License at
+
+        http://www.apache.org/licenses/LICENSE-2.0
+
+    Unless required by applicable law or agreed to in writing, software
+    distributed under the License is distributed on an "AS IS" BASIS,
+    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+    See the License for the specific language governing permissions and
+    limitations under the License.
+*/
+
+#ifndef KCPLUS_MIGRATION_HPP
+#define KCPLUS_MIGRATION_HPP
+
+#include <cstdint>
+#include <cstring>
+#include <random>
+#include <vector>
+#include "kcplus.hpp"
+#include "kcplus_server.hpp"
+#include "kcplus_udp.hpp"
+
+namespace ikcp
+{
+    /**
+     * @brief Wire format of migratable sessions: every low-level packet is prefixed by the session token.
+     * (KCPlus feature)
+     * @details
+     * The token is 8 bytes, little-endian. Clients send 0 until they learned it from the first packet of the server.
+     */
+    struct MigrationFormat
+    {
+        constexpr static const SizeType TokenSize = 8;
+        constexpr static const SizeType Overhead = TokenSize;
+
+        static void writeToken(char data[], std::uint64_t token)
+        {
+            WireFormat::encode64(token, data);
+        }
+
+        static std::uint64_t readToken(const char data[])
+        {
+            return WireFormat::decode64(data);
+        }
+    };
+
+    /**
+     * @brief Client side of migratable sessions, learns the token and puts it in front of every packet.
+     * (KCPlus feature)
+     * @details
+     * Put it between the client's session and its socket. The client can then change address (NAT rebinding,
+     * switching networks) without the server dropping the session, as long as it keeps sending.
+     * Reduce the MTU of the session by `MigrationFormat::Overhead`.
+     * Not thread-safe.
+     */
+    class MigrationClient
+    {
+    public:
+        /**
+         * @brief Sends a low-level packet through `sink`, prefixed by the token.
+         * @param sink Called as `sink(const char data[], SizeType size)`.
+         */
+        template<class Output>
+        void output(const char data[], SizeType size, Output &&sink)
+        {
+            mBuffer.resize(MigrationFormat::Overhead + size);
+            MigrationFormat::writeToken(mBuffer.data(), mToken);
+            std::memcpy(mBuffer.data() + MigrationFormat::Overhead, data, size);
+            sink(static_cast<const char *>(mBuffer.data()), mBuffer.size());
+        }
+
+        /**
+         * @brief Strips the token of a datagram from the server, and passes the packet to `sink`.
+         * @param sink Called as `sink(const char data[], SizeType size)`, typically for `KCPSession::input()`.
+         * @return `false` if the datagram is too short.
+         */
+        template<class Input>
+        bool input(const char data[], SizeType size, Input &&sink)
+        {
+            if(size < MigrationFormat::Overhead)
+            {
+                return false;
+            }
+            mToken = MigrationFormat::readToken(data);
+            sink(data + MigrationFormat::Overhead, size - MigrationFormat::Overhead);
+            return true;
+        }
+
+        /**
+         * @brief Returns the token, 0 until the server sent one.
+         */
+        std::uint64_t token() const
+        {
+            return mToken;
+        }
+    private:
+        std::uint64_t mToken = 0;
+        std::vector<char> mBuffer;
+    };
+
+    /**
+     * @brief Server side of migratable sessions: the current address and token of every session. (KCPlus feature)
+     * @details
+     * Sessions are keyed by conv, never by address. Each accepted session gets a random token, which the server
+     * puts in front of its packets. Datagrams from the address of a session are dispatched as usual. Datagrams
+     * from another address are only dispatched if they carry the session's token, and if KCP accepts them the
+     * session moves to that address in place: same `ikcpcb`, windows and in-flight segments, no reconnect.
+     * The token guards against off-path spoofing only, it's sent in clear. Against on-path attackers, encrypt
+     * (`kcplus_crypto.hpp`) inside the token prefix.
+     * Used by `KCPReactor::setMigration()`. Not thread-safe.
+     */
+    class PeerTable
+    {
+    public:
+        struct Peer
+        {
+            SocketAddress address;
+            std::uint64_t token = 0;
+        };
+
+        explicit PeerTable(SizeType initialCapacity = 1024)
+            :mPeers(initialCapacity)
+        {
+        }
+
+        /**
+         * @brief Dispatches a datagram received from `from` to `server`, creating the peer of new sessions.
+         * @return The session it was dispatched to, `nullptr` if it was malformed, rejected or failed
+         * authentication.
+         */
+        KCPSession *input(KCPServer &server, const char data[], SizeType size, const SocketAddress &from)
+        {
+            if(size < MigrationFormat::Overhead + KCPOverhead)
+            {
+                return nullptr;
+            }
+            std::uint64_t token = MigrationFormat::readToken(data);
+            const char *packet = data + MigrationFormat::Overhead;
+            SizeType packetSize = size - MigrationFormat::Overhead;
+            IUINT32 conv = ikcp_getconv(packet);
+            KCPSession *session = server.find(conv);
+            if(session == nullptr)
+            {
+                if(token != 0)
+                {
+                    // A session which is gone, the client has to start over.
+                    ++mRejected;
+                    return nullptr;
+                }
+                // The peer has to exist for the output function set up by the accept callback.
+                Peer &peer = *mPeers.emplace(conv).first;
+                peer.address = from;
+                peer.token = newToken();
+                session = server.input(packet, packetSize);
+                if(session == nullptr)
+                {
+                    mPeers.erase(conv);
+                }
+                return session;
+            }
+            Peer *peer = mPeers.find(conv);
+            if(peer == nullptr || peer->address == from)
+            {
+                return server.input(packet, packetSize);
+            }
+            if(token != peer->token)
+            {
+                ++mRejected;
+                return nullptr;
+            }
+            std::uint64_t errors = session->stats().inputErrors;
+            session = server.input(packet, packetSize);
+            if(session != nullptr && session->stats().inputErrors == errors)
+            {
+                peer = mPeers.find(conv);
+                peer->address = from;
+                ++mMigrations;
+            }
+            return session;
+        }
+
+        /**
+         * @brief Same as `input(KCPServer &, const char [], SizeType, const SocketAddress &)` for a batch of datagrams
+         * received from `from`.
+         * @details Runs of datagrams of sessions already at `from` go through
+         * `KCPServer::input(const ConstBuffer[], SizeType)` at once. Others, which may create or move a session, are
+         * dispatched one by one.
+         * @return Number of datagrams dispatched to a session.
+         */
+        SizeType input(KCPServer &server, const ConstBuffer datagrams[], SizeType count, const SocketAddress &from)
+        {
+            SizeType dispatched = 0;
+            mRun.clear();
+            for(SizeType i = 0; i < count; ++i)
+            {
+                const char *data = static_cast<const char *>(datagrams[i].data);
+                SizeType size = datagrams[i].size;
+                if(size < MigrationFormat::Overhead + KCPOverhead)
+                {
+                    continue;
+                }
+                IUINT32 conv = ikcp_getconv(data + MigrationFormat::Overhead);
+                const Peer *peer = mPeers.find(conv);
+                if(server.find(conv) != nullptr && (peer == nullptr || peer->address == from))
+                {
+                    mRun.push_back(ConstBuffer{data + MigrationFormat::Overhead, size - MigrationFormat::Overhead});
+                    continue;
+                }
+                dispatched += dispatchRun(server);
+                if(input(server, data, size, from) != nullptr)
+                {
+                    ++dispatched;
+                }
+            }
+            return dispatched + dispatchRun(server);
+        }
+
+        /**
+         * @brief Returns an output function sending packets of `conv` to its current address, with its token.
+         * @see KCPSession::setOutputFunction()
+         */
+        KCPSession::OutputFunction outputTo(UDPTransport &transport, IUINT32 conv)
+        {
+            return [this, &transport, conv](const char buf[], SizeType len)
+            {
+                const Peer *peer = mPeers.find(conv);
+                if(peer == nullptr)
+                {
+                    return;
+                }
+                mBuffer.resize(MigrationFormat::Overhead + len);
+                MigrationFormat::writeToken(mBuffer.data(), peer->token);
+                std::memcpy(mBuffer.data() + MigrationFormat::Overhead, buf, len);
+                transport.queue(mBuffer.data(), mBuffer.size(), peer->address);
+            };
+        }
+
+        /**
+         * @brief Returns the peer of `conv`, `nullptr` if there is none.
+         */
+        const Peer *find(IUINT32 conv) const
+        {
+            return mPeers.find(conv);
+        }
+
+        /**
+         * @brief Forgets peers whose session is no longer in `server`, eg. evicted or closed.
+         */
+        void prune(KCPServer &server)
+        {
+            mGone.clear();
+            mPeers.forEach([&](IUINT32 conv, Peer &)
+            {
+                if(server.find(conv) == nullptr)
+                {
+                    mGone.push_back(conv);
+                }
+            });
+            for(IUINT32 conv : mGone)
+            {
+                mPeers.erase(conv);
+            }
+        }
+
+        /**
+         * @brief Returns how many times a session moved to a new address.
+         */
+        std::uint64_t migrations() const
+        {
+            return mMigrations;
+        }
+
+        /**
+         * @brief Returns number of datagrams dropped for a wrong or stale token.
+         */
+        std::uint64_t rejected() const
+        {
+            return mRejected;
+        }
+    private:
+        SessionTable<Peer> mPeers;
+        std::random_device mRandom;     // Tokens must not be predictable from each other.
+        std::vector<char> mBuffer;
+        std::vector<IUINT32> mGone;
+        std::vector<ConstBuffer> mRun;      // Datagrams of `input()` batches, without their token.
+        std::uint64_t mMigrations = 0;
+        std::uint64_t mRejected = 0;
+
+        SizeType dispatchRun(KCPServer &server)
+        {
+            SizeType dispatched = server.input(static_cast<const ConstBuffer *>(mRun.data()), mRun.size());
+            mRun.clear();
+            return dispatched;
+        }
+
+        std::uint64_t newToken()
+        {
+            std::uint64_t token;
+            do
+            {
+                token = static_cast<std::uint64_t>(mRandom()) << 32 | static_cast<std::uint32_t>(mRandom());
+            } while(token == 0);
+            return token;
+        }
+    };
+}
+
+#endif // KCPLUS_MIGRATION_HPP
@@ -0,0 +1,468 @@
+/*
+    Copyright 2017 Miigon
+
+    Licensed under the Apache License, Version 2.0 (the "License");
+    you may not use this file except in compliance with the License.
+    You may obtain a copy of the License at
+
+        http://www.apache.org/licenses/LICENSE-2.0
+
+    Unless required by applicable law or agreed to in writing, software
+    distributed under the License is distributed on an "AS IS" BASIS,
+    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+    See the License for the specific language governing permissions and
+    limitations under the License.
+*/
+
+#ifndef KCPLUS_PACING_HPP
+#define KCPLUS_PACING_HPP
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <functional>
+#include <utility>
+#include <vector>
+#include "kcplus.hpp"
+
+namespace ikcp
+{
+    class Pacer;
+
+    /**
+     * @brief Token bucket, timestamps in microsec. (KCPlus feature)
+     * @details
+     * Tokens are bytes, filled at `rate` up to `burst`. A packet may leave once the bucket isn't in debt, and takes
+     * its size out of it, so packets larger than the burst still go out, just later.
+     */
+    class TokenBucket
+    {
+    public:
+        /**
+         * @param rate Bytes per millisec, 0 for unlimited.
+         * @param burst Bytes that can leave back to back after a quiet period.
+         */
+        explicit TokenBucket(double rate = 0, SizeType burst = 4 * 1500)
+            :mRate(rate),mBurst(static_cast<double>(burst)),mTokens(static_cast<double>(burst)),mLast(0)
+        {
+        }
+
+        void setRate(double rate)
+        {
+            mRate = rate;
+        }
+
+        double rate() const
+        {
+            return mRate;
+        }
+
+        /**
+         * @brief Returns the earliest time a packet may leave, `now` if right away.
+         */
+        std::uint64_t departure(std::uint64_t now)
+        {
+            refill(now);
+            // Packets scheduled ahead (timed output) moved the bucket past `now`.
+            std::uint64_t base = std::max(now, mLast);
+            if(mRate <= 0 || mTokens >= 0)
+            {
+                return base;
+            }
+            return base + static_cast<std::uint64_t>(-mTokens * 1000 / mRate) + 1;
+        }
+
+        /**
+         * @brief Takes a packet of `size` bytes out of the bucket.
+         */
+        void consume(SizeType size, std::uint64_t now)
+        {
+            refill(now);
+            if(mRate > 0)
+            {
+                mTokens -= static_cast<double>(size);
+            }
+        }
+    private:
+        double mRate;
+        double mBurst;
+        double mTokens;
+        std::uint64_t mLast;
+
+        void refill(std::uint64_t now)
+        {
+            if(now > mLast)
+            {
+                mTokens = std::min(mBurst, mTokens + static_cast<double>(now - mLast) * mRate / 1000);
+                mLast = now;
+            }
+        }
+    };
+
+    /**
+     * @brief Wakes the pacers of many sessions with one high-resolution timer. (KCPlus feature)
+     * @details
+     * Pacers holding packets are kept in a heap by their next departure. Sleep until `nextDeparture()` (the loop
+     * of a reactor can use it as timeout), then call `poll()` to send what's due.
+     * Not thread-safe, like the pacers it wakes.
+     */
+    class PacingScheduler
+    {
+    public:
+        PacingScheduler() = default;
+        PacingScheduler(const PacingScheduler &) = delete;
+        PacingScheduler &operator=(const PacingScheduler &) = delete;
+
+        /**
+         * @brief Returns the current time in microsec, of the clock pacers and `SO_TXTIME` use (`CLOCK_MONOTONIC`).
+         */
+        static std::uint64_t now()
+        {
+            return static_cast<std::uint64_t>(std::chrono::duration_cast<std::chrono::microseconds>(
+                std::chrono::steady_clock::now().time_since_epoch()).count());
+        }
+
+        /**
+         * @brief Sends packets of all pacers which are due at `now`.
+         * @return Number of pacers woken up.
+         */
+        inline SizeType poll(std::uint64_t now);
+
+        /**
+         * @brief Returns when the next pacer is due, in microsec. Only valid if not `empty()`.
+         */
+        std::uint64_t nextDeparture() const
+        {
+            return mHeap.front().due;
+        }
+
+        /**
+         * @brief Returns whether no pacer is holding packets.
+         */
+        bool empty() const
+        {
+            return mHeap.empty();
+        }
+    private:
+        friend class Pacer;
+
+        struct Entry
+        {
+            std::uint64_t due;
+            Pacer *pacer;
+        };
+
+        std::vector<Entry> mHeap;
+
+        // Implemented after `Pacer`, as they keep its heap index up to date.
+        inline void schedule(Pacer &pacer, std::uint64_t due);
+        inline void cancel(Pacer &pacer);
+        inline void place(SizeType index);
+        inline SizeType siftUp(SizeType index);
+        inline void siftDown(SizeType index);
+    };
+
+    /**
+     * @brief Spreads low-level packets of a session over time, instead of bursting the whole window. (KCPlus feature)
+     * @details
+     * Put it between a session and the socket: packets leave right away while the token bucket allows, the rest
+     * are held and sent by `release()` (or a `PacingScheduler`) as tokens come back. The rate usually comes from a
+     * congestion controller, or `rateFor()` estimates it from the session's window and RTT:
+     * @code
+     * ikcp::PacingScheduler scheduler;
+     * ikcp::Pacer pacer(transport.outputTo(address), &scheduler);
+     * session.setOutputFunction([&](const char data[], ikcp::SizeType size)
+     * {
+     *     pacer.output(data, size);
+     * });
+     * // After every session.update():
+     * pacer.setRate(ikcp::Pacer::rateFor(session.stats()));
+     * // In the loop, sleeping until scheduler.nextDeparture():
+     * scheduler.poll(ikcp::PacingScheduler::now());
+     * transport.flush();
+     * @endcode
+     * With `setTimedOutput()`, packets are never held: each one is handed over at once with its departure time, for
+     * the kernel to pace them (`SO_TXTIME` with the fq qdisc, see `UDPTransport::setTxTime()`).
+     * Not thread-safe.
+     */
+    class Pacer
+    {
+    public:
+        /**
+         * @brief Output taking the departure time in nanosec of `CLOCK_MONOTONIC`, as `SCM_TXTIME` wants it.
+         */
+        using TimedOutputFunction = std::function<void(const char buf[], SizeType len, std::uint64_t txtime)>;
+
+        /**
+         * @param output Where packets are sent to.
+         * @param scheduler Scheduler waking this pacer, `nullptr` to call `release()` yourself.
+         * @param rate Bytes per millisec, 0 to send everything right away.
+         * @param burst Bytes which can leave back to back.
+         * @param maxQueued Bytes held at most, further packets are dropped for KCP to resend.
+         */
+        explicit Pacer(KCPSession::OutputFunction output, PacingScheduler *scheduler = nullptr, double rate = 0,
+            SizeType burst = 4 * 1500, SizeType maxQueued = 1024 * 1024)
+            :mOutput(std::move(output)),mScheduler(scheduler),mBucket(rate, burst),mMaxQueued(maxQueued)
+        {
+        }
+
+        ~Pacer()
+        {
+            if(mScheduler != nullptr)
+            {
+                mScheduler->cancel(*this);
+            }
+        }
+
+        Pacer(const Pacer &) = delete;
+        Pacer &operator=(const Pacer &) = delete;
+
+        /**
+         * @brief Estimates a pacing rate from a session: its effective window per RTT, times `gain`.
+         * @details The gain above 1 leaves room for the window to grow. Returns 0 (not pacing) until RTT is known.
+         */
+        static double rateFor(const SessionStats &stats, double gain = 1.25)
+        {
+            if(stats.rtt <= 0)
+            {
+                return 0;
+            }
+            IUINT32 window = std::min(stats.sendWindow, stats.remoteWindow);
+            if(stats.congestionWindow != 0)
+            {
+                window = std::min(window, stats.congestionWindow);
+            }
+            return gain * window * stats.mtu / stats.rtt;
+        }
+
+        /**
+         * @brief Sets the rate in bytes per millisec, 0 to stop pacing.
+         */
+        void setRate(double rate)
+        {
+            mBucket.setRate(rate);
+            if(!mSizes.empty())
+            {
+                scheduleNext(PacingScheduler::now());
+            }
+        }
+
+        double rate() const
+        {
+            return mBucket.rate();
+        }
+
+        /**
+         * @brief Hands packets to `output` with their departure time, instead of holding them.
+         * @param output Set it empty to go back to holding packets.
+         */
+        void setTimedOutput(TimedOutputFunction output)
+        {
+            mTimedOutput = std::move(output);
+        }
+
+        /**
+         * @brief Sends a low-level packet now, or holds it until the bucket allows.
+         */
+        void output(const char data[], SizeType size)
+        {
+            std::uint64_t now = PacingScheduler::now();
+            if(mTimedOutput)
+            {
+                std::uint64_t departure = mBucket.departure(now);
+                mBucket.consume(size, departure);
+                mTimedOutput(data, size, departure * 1000);
+                return;
+            }
+            if(mSizes.empty() && mBucket.departure(now) == now)
+            {
+                mBucket.consume(size, now);
+                mOutput(data, size);
+                return;
+            }
+            if(mQueuedBytes + size > mMaxQueued)
+            {
+                ++mDropped;
+                return;
+            }
+            if(mHead != 0 && mHead == mBytes.size())
+            {
+                mBytes.clear();
+                mHead = 0;
+            }
+            mBytes.insert(mBytes.end(), data, data + size);
+            mSizes.push_back(size);
+            mQueuedBytes += size;
+            if(mSizes.size() == 1)
+            {
+                scheduleNext(now);
+            }
+        }
+
+        /**
+         * @brief Sends held packets which are due at `now`, in microsec of `PacingScheduler::now()`.
+         * @return When the next held packet is due, 0 if none is held.
+         */
+        std::uint64_t release(std::uint64_t now)
+        {
+            while(!mSizes.empty() && mBucket.departure(now) <= now)
+            {
+                SizeType size = mSizes.front();
+                mBucket.consume(size, now);
+                mOutput(&mBytes[mHead], size);
+                mHead += size;
+                mQueuedBytes -= size;
+                mSizes.pop_front();
+            }
+            if(mHead > mBytes.size() / 2)
+            {
+                mBytes.erase(mBytes.begin(), mBytes.begin() + static_cast<std::ptrdiff_t>(mHead));
+                mHead = 0;
+            }
+            return scheduleNext(now);
+        }
+
+        /**
+         * @brief Returns bytes being held.
+         */
+        SizeType queuedBytes() const
+        {
+            return mQueuedBytes;
+        }
+
+        /**
+         * @brief Returns number of packets dropped because `maxQueued` was reached.
+         */
+        std::uint64_t dropped() const
+        {
+            return mDropped;
+        }
+    private:
+        friend class PacingScheduler;
+
+        KCPSession::OutputFunction mOutput;
+        TimedOutputFunction mTimedOutput;
+        PacingScheduler *mScheduler;
+        TokenBucket mBucket;
+        SizeType mMaxQueued;
+        std::vector<char> mBytes;               // Held packets back to back, from `mHead` on.
+        SizeType mHead = 0;
+        std::deque<SizeType> mSizes;
+        SizeType mQueuedBytes = 0;
+        std::uint64_t mDropped = 0;
+        SizeType mHeapIndex = NotScheduled;     // Position in the heap of `mScheduler`.
+
+        constexpr static const SizeType NotScheduled = static_cast<SizeType>(-1);
+
+        std::uint64_t scheduleNext(std::uint64_t now)
+        {
+            if(mSizes.empty())
+            {
+                if(mScheduler != nullptr)
+                {
+                    mScheduler->cancel(*this);
+                }
+                return 0;
+            }
+            std::uint64_t due = mBucket.departure(now);
+            if(mScheduler != nullptr)
+            {
+                mScheduler->schedule(*this, due);
+            }
+            return due;
+        }
+    };
+
+    SizeType PacingScheduler::poll(std::uint64_t now)
+    {
+        SizeType woken = 0;
+        while(!mHeap.empty() && mHeap.front().due <= now)
+        {
+            ++woken;
+            mHeap.front().pacer->release(now); // Reschedules or cancels it.
+        }
+        return woken;
+    }
+
+    void PacingScheduler::schedule(Pacer &pacer, std::uint64_t due)
+    {
+        if(pacer.mHeapIndex == Pacer::NotScheduled)
+        {
+            pacer.mHeapIndex = mHeap.size();
+            mHeap.push_back(Entry{due, &pacer});
+        }
+        else
+        {
+            mHeap[pacer.mHeapIndex].due = due;
+        }
+        place(pacer.mHeapIndex);
+    }
+
+    void PacingScheduler::cancel(Pacer &pacer)
+    {
+        SizeType index = pacer.mHeapIndex;
+        if(index == Pacer::NotScheduled)
+        {
+            return;
+        }
+        pacer.mHeapIndex = Pacer::NotScheduled;
+        if(index != mHeap.size() - 1)
+        {
+            mHeap[index] = mHeap.back();
+            mHeap[index].pacer->mHeapIndex = index;
+            mHeap.pop_back();
+            place(index);
+            return;
+        }
+        mHeap.pop_back();
+    }
+
+    void PacingScheduler::place(SizeType index)
+    {
+        siftDown(siftUp(index));
+    }
+
+    SizeType PacingScheduler::siftUp(SizeType index)
+    {
+        while(index > 0)
+        {
+            SizeType parent = (index - 1) / 2;
+            if(mHeap[parent].due <= mHeap[index].due)
+            {
+                break;
+            }
+            std::swap(mHeap[parent], mHeap[index]);
+            mHeap[index].pacer->mHeapIndex = index;
+            mHeap[parent].pacer->mHeapIndex = parent;
+            index = parent;
+        }
+        return index;
+    }
+
+    void PacingScheduler::siftDown(SizeType index)
+    {
+        for(;;)
+        {
+            SizeType smallest = index;
+            for(SizeType child = 2 * index + 1; child <= 2 * index + 2 && child < mHeap.size(); ++child)
+            {
+                if(mHeap[child].due < mHeap[smallest].due)
+                {
+                    smallest = child;
+                }
+            }
+            if(smallest == index)
+            {
+                return;
+            }
+            std::swap(mHeap[smallest], mHeap[index]);
+            mHeap[index].pacer->mHeapIndex = index;
+            mHeap[smallest].pacer->mHeapIndex = smallest;
+            index = smallest;
+        }
+    }
+}
+
+#endif // KCPLUS_PACING_HPP
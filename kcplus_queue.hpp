@@ -0,0 +1,160 @@
+/*
+    Copyright 2017 Miigon
+
+    Licensed under the Apache License, Version 2.0 (the "License");
+    you may not use this file except in compliance with the License.
+    You may obtain a copy of the License at
+
+        http://www.apache.org/licenses/LICENSE-2.0
+
+    Unless required by applicable law or agreed to in writing, software
+    distributed under the License is distributed on an "AS IS" BASIS,
+    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+    See the License for the specific language governing permissions and
+    limitations under the License.
+*/
+
+#ifndef KCPLUS_QUEUE_HPP
+#define KCPLUS_QUEUE_HPP
+
+#include <atomic>
+#include <cstddef>
+#include <memory>
+#include <utility>
+
+namespace ikcp
+{
+    using SizeType = std::size_t;
+
+    /**
+     * @brief Bounded lock-free multi-producer single-consumer queue. (KCPlus feature)
+     * @details
+     * A ring of cells tagged with sequence numbers: producers claim a cell with one CAS, and the consumer never
+     * writes shared counters other than its own. No allocation after construction.
+     * `tryPush()` can be called from any thread, `tryPop()` only from one thread at a time.
+     * @tparam T Element type, must be default constructible and movable.
+     */
+    template<class T>
+    class MPSCQueue
+    {
+    public:
+        /**
+         * @param capacity Maximum number of elements, rounded up to a power of two.
+         */
+        explicit MPSCQueue(SizeType capacity)
+            :mMask(roundUp(capacity) - 1),mCells(new Cell[mMask + 1]),mTail(0),mHead(0)
+        {
+            for(SizeType i = 0; i <= mMask; ++i)
+            {
+                mCells[i].sequence.store(i, std::memory_order_relaxed);
+            }
+        }
+
+        MPSCQueue(const MPSCQueue &) = delete;
+        MPSCQueue &operator=(const MPSCQueue &) = delete;
+
+        /**
+         * @brief Pushes an element. Thread-safe.
+         * @return `false` if the queue is full, `value` is left untouched then.
+         */
+        bool tryPush(T &&value)
+        {
+            SizeType tail = mTail.load(std::memory_order_relaxed);
+            for(;;)
+            {
+                Cell &cell = mCells[tail & mMask];
+                SizeType sequence = cell.sequence.load(std::memory_order_acquire);
+                std::ptrdiff_t difference = static_cast<std::ptrdiff_t>(sequence) - static_cast<std::ptrdiff_t>(tail);
+                if(difference == 0)
+                {
+                    if(mTail.compare_exchange_weak(tail, tail + 1, std::memory_order_relaxed))
+                    {
+                        cell.value = std::move(value);
+                        cell.sequence.store(tail + 1, std::memory_order_release);
+                        return true;
+                    }
+                }
+                else if(difference < 0)
+                {
+                    return false;
+                }
+                else
+                {
+                    tail = mTail.load(std::memory_order_relaxed);
+                }
+            }
+        }
+
+        bool tryPush(const T &value)
+        {
+            T copy(value);
+            return tryPush(std::move(copy));
+        }
+
+        /**
+         * @brief Pops an element. Consumer thread only.
+         * @return `false` if the queue is empty.
+         */
+        bool tryPop(T &value)
+        {
+            SizeType head = mHead.load(std::memory_order_relaxed);
+            Cell &cell = mCells[head & mMask];
+            SizeType sequence = cell.sequence.load(std::memory_order_acquire);
+            if(sequence != head + 1)
+            {
+                return false;
+            }
+            value = std::move(cell.value);
+            cell.value = T();
+            cell.sequence.store(head + mMask + 1, std::memory_order_release);
+            mHead.store(head + 1, std::memory_order_relaxed);
+            return true;
+        }
+
+        /**
+         * @brief Returns approximate number of elements.
+         */
+        SizeType size() const
+        {
+            SizeType tail = mTail.load(std::memory_order_relaxed);
+            SizeType head = mHead.load(std::memory_order_relaxed);
+            return tail >= head ? tail - head : 0;
+        }
+
+        /**
+         * @brief Returns maximum number of elements.
+         */
+        SizeType capacity() const
+        {
+            return mMask + 1;
+        }
+    private:
+        struct Cell
+        {
+            std::atomic<SizeType> sequence;
+            T value;
+        };
+
+        constexpr static const SizeType CacheLineSize = 64;
+
+        // Producers and the consumer write different cache lines.
+        const SizeType mMask;
+        std::unique_ptr<Cell []> mCells;
+        char mPadding0[CacheLineSize];
+        std::atomic<SizeType> mTail;
+        char mPadding1[CacheLineSize - sizeof(std::atomic<SizeType>)];
+        std::atomic<SizeType> mHead; // Written by the consumer only.
+
+        static SizeType roundUp(SizeType capacity)
+        {
+            SizeType result = 2;
+            while(result < capacity)
+            {
+                result *= 2;
+            }
+            return result;
+        }
+    };
+}
+
+#endif // KCPLUS_QUEUE_HPP
@@ -0,0 +1,587 @@
+/*
+    Copyright 2017 Miigon
+
+    Licensed under the Apache License, Version 2.0 (the "License");
+    you may not use this file except in compliance with the License.
+    You may obtain a copy of the License at
+
+        http://www.apache.org/licenses/LICENSE-2.0
+
+    Unless required by applicable law or agreed to in writing, software
+    distributed under the License is distributed on an "AS IS" BASIS,
+    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+    See the License for the specific language governing permissions and
+    limitations under the License.
+*/
+
+#ifndef KCPLUS_REACTOR_HPP
+#define KCPLUS_REACTOR_HPP
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstring>
+#include <functional>
+#include <memory>
+#include <system_error>
+#include <vector>
+#include <sys/epoll.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include "kcplus.hpp"
+#include "kcplus_migration.hpp"
+#include "kcplus_server.hpp"
+#include "kcplus_udp.hpp"
+
+#if !defined(KCPLUS_NO_IO_URING) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#if defined(IORING_RECV_MULTISHOT) && defined(__NR_io_uring_setup)
+#define KCPLUS_HAS_IO_URING 1
+#endif
+#endif
+#endif
+
+namespace ikcp
+{
+#ifdef KCPLUS_HAS_IO_URING
+    /**
+     * @brief Receives datagrams of a UDP socket through io_uring, without liburing. (KCPlus feature)
+     * @details
+     * A single multishot `recvmsg` keeps receiving into a group of buffers provided to the kernel, one datagram per
+     * buffer. Datagrams are handed over in place, and buffers are provided again by the next `receive()`, in as
+     * few requests as possible. Needs Linux 6.0 or newer.
+     * Not thread-safe.
+     */
+    class IOUringReceiver
+    {
+    public:
+        /**
+         * @param fd Bound UDP socket.
+         * @param numOfBuffers Number of provided buffers (at most 65536).
+         * @param bufferSize Maximum size of a datagram, larger ones are dropped.
+         * @throw std::system_error If io_uring is not available.
+         */
+        IOUringReceiver(int fd, SizeType numOfBuffers, SizeType bufferSize)
+            :mSocket(fd),mRingFd(-1),mRing(MAP_FAILED),mRingSize(0),mSqes(MAP_FAILED),mSqesSize(0),
+            mNumOfBuffers(std::min<SizeType>(std::max<SizeType>(numOfBuffers, 1), 65536)),
+            mBufferStride(sizeof(io_uring_recvmsg_out) + sizeof(sockaddr_storage) + bufferSize),
+            mArmed(false),mToSubmit(0),mSkipFlags(0)
+        {
+            try
+            {
+                setUp();
+            }
+            catch(...)
+            {
+                tearDown();
+                throw;
+            }
+        }
+
+        ~IOUringReceiver()
+        {
+            tearDown();
+        }
+
+        IOUringReceiver(const IOUringReceiver &) = delete;
+        IOUringReceiver &operator=(const IOUringReceiver &) = delete;
+
+        /**
+         * @brief Waits for datagrams up to `timeout` millisec, and calls `function` for each received one.
+         * @details Data stays valid until the next `receive()`, but `from` only until `function` returns.
+         * @param function Called as `function(const char data[], SizeType size, const SocketAddress &from)`.
+         * @return Number of datagrams received.
+         */
+        template<class Function>
+        SizeType receive(int timeout, Function &&function)
+        {
+            if(!mArmed)
+            {
+                arm();
+            }
+            __kernel_timespec timespec;
+            timespec.tv_sec = timeout / 1000;
+            timespec.tv_nsec = static_cast<long long>(timeout % 1000) * 1000000;
+            io_uring_getevents_arg arg;
+            std::memset(&arg, 0, sizeof(arg));
+            arg.ts = reinterpret_cast<std::uintptr_t>(&timespec);
+            unsigned minComplete = timeout > 0 && completionsReady() == 0 ? 1 : 0;
+            long result = ::syscall(__NR_io_uring_enter, mRingFd, mToSubmit, minComplete,
+                IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG, &arg, sizeof(arg));
+            if(result >= 0)
+            {
+                mToSubmit = 0;
+            }
+            SizeType received = 0;
+            unsigned head = *mCqHead;
+            unsigned tail = __atomic_load_n(mCqTail, __ATOMIC_ACQUIRE);
+            for(; head != tail; ++head)
+            {
+                const io_uring_cqe &cqe = mCqes[head & *mCqMask];
+                if(cqe.user_data != ReceiveRequest)
+                {
+                    continue;
+                }
+                if((cqe.flags & IORING_CQE_F_MORE) == 0)
+                {
+                    mArmed = false; // Stopped, eg. by running out of buffers. Rearmed on the next call.
+                }
+                if(cqe.res < 0 || (cqe.flags & IORING_CQE_F_BUFFER) == 0)
+                {
+                    continue;
+                }
+                unsigned short bufferId = static_cast<unsigned short>(cqe.flags >> IORING_CQE_BUFFER_SHIFT);
+                char *buffer = mBuffers.get() + bufferId * mBufferStride;
+                const io_uring_recvmsg_out *out = reinterpret_cast<const io_uring_recvmsg_out *>(buffer);
+                if((out->flags & MSG_TRUNC) == 0)
+                {
+                    const char *name = buffer + sizeof(io_uring_recvmsg_out);
+                    SocketAddress from(reinterpret_cast<const sockaddr *>(name),
+                        static_cast<socklen_t>(std::min<SizeType>(out->namelen, sizeof(sockaddr_storage))));
+                    function(name + sizeof(sockaddr_storage), static_cast<SizeType>(out->payloadlen), from);
+                    ++received;
+                }
+                mUsed.push_back(bufferId);
+            }
+            __atomic_store_n(mCqHead, head, __ATOMIC_RELEASE);
+            provideUsed();
+            return received;
+        }
+    private:
+        int mSocket;
+        int mRingFd;
+        void *mRing;
+        SizeType mRingSize;
+        void *mSqes;
+        SizeType mSqesSize;
+        std::unique_ptr<char []> mBuffers;
+        SizeType mNumOfBuffers;
+        SizeType mBufferStride;
+        std::vector<unsigned short> mUsed;
+        bool mArmed;
+        unsigned mToSubmit;
+        unsigned char mSkipFlags;
+        msghdr mMessage;
+
+        unsigned *mSqHead;
+        unsigned *mSqTail;
+        unsigned *mSqMask;
+        unsigned *mSqEntries;
+        unsigned *mSqArray;
+        unsigned *mCqHead;
+        unsigned *mCqTail;
+        unsigned *mCqMask;
+        io_uring_cqe *mCqes;
+
+        constexpr static const unsigned BufferGroup = 0;
+        constexpr static const unsigned long long ReceiveRequest = 0;
+        constexpr static const unsigned long long ProvideRequest = 1;
+
+        void setUp()
+        {
+            io_uring_params params;
+            std::memset(&params, 0, sizeof(params));
+            params.flags = IORING_SETUP_CQSIZE;
+            params.cq_entries = static_cast<unsigned>(mNumOfBuffers * 2);
+            mRingFd = static_cast<int>(::syscall(__NR_io_uring_setup, 64, &params));
+            if(mRingFd < 0)
+            {
+                throw std::system_error(errno, std::system_category(), "IOUringReceiver: io_uring_setup");
+            }
+            if((params.features & IORING_FEAT_SINGLE_MMAP) == 0 || (params.features & IORING_FEAT_EXT_ARG) == 0)
+            {
+                throw std::system_error(ENOSYS, std::system_category(), "IOUringReceiver: kernel too old");
+            }
+            if((params.features & IORING_FEAT_CQE_SKIP) != 0)
+            {
+                mSkipFlags = IOSQE_CQE_SKIP_SUCCESS; // Successful provides need no completion.
+            }
+            mRingSize = std::max<SizeType>(params.sq_off.array + params.sq_entries * sizeof(unsigned),
+                params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe));
+            mRing = ::mmap(nullptr, mRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, mRingFd,
+                IORING_OFF_SQ_RING);
+            mSqesSize = params.sq_entries * sizeof(io_uring_sqe);
+            mSqes = ::mmap(nullptr, mSqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, mRingFd,
+                IORING_OFF_SQES);
+            if(mRing == MAP_FAILED || mSqes == MAP_FAILED)
+            {
+                throw std::system_error(errno, std::system_category(), "IOUringReceiver: mmap");
+            }
+            char *ring = static_cast<char *>(mRing);
+            mSqHead = reinterpret_cast<unsigned *>(ring + params.sq_off.head);
+            mSqTail = reinterpret_cast<unsigned *>(ring + params.sq_off.tail);
+            mSqMask = reinterpret_cast<unsigned *>(ring + params.sq_off.ring_mask);
+            mSqEntries = reinterpret_cast<unsigned *>(ring + params.sq_off.ring_entries);
+            mSqArray = reinterpret_cast<unsigned *>(ring + params.sq_off.array);
+            mCqHead = reinterpret_cast<unsigned *>(ring + params.cq_off.head);
+            mCqTail = reinterpret_cast<unsigned *>(ring + params.cq_off.tail);
+            mCqMask = reinterpret_cast<unsigned *>(ring + params.cq_off.ring_mask);
+            mCqes = reinterpret_cast<io_uring_cqe *>(ring + params.cq_off.cqes);
+
+            mBuffers.reset(new char[mNumOfBuffers * mBufferStride]);
+            mUsed.reserve(mNumOfBuffers);
+            provide(0, mNumOfBuffers);
+            if(::syscall(__NR_io_uring_enter, mRingFd, mToSubmit, 0, 0, nullptr, 0) < 0)
+            {
+                throw std::system_error(errno, std::system_category(), "IOUringReceiver: provide buffers");
+            }
+            mToSubmit = 0;
+
+            // Multishot recvmsg only looks at the lengths: every buffer starts with io_uring_recvmsg_out, then
+            // the source address, then the payload.
+            std::memset(&mMessage, 0, sizeof(mMessage));
+            mMessage.msg_namelen = sizeof(sockaddr_storage);
+        }
+
+        void tearDown()
+        {
+            if(mRingFd >= 0)
+            {
+                ::close(mRingFd); // Also cancels the pending recvmsg and drops provided buffers.
+            }
+            if(mRing != MAP_FAILED)
+            {
+                ::munmap(mRing, mRingSize);
+            }
+            if(mSqes != MAP_FAILED)
+            {
+                ::munmap(mSqes, mSqesSize);
+            }
+        }
+
+        io_uring_sqe &nextRequest()
+        {
+            unsigned tail = *mSqTail;
+            if(tail - __atomic_load_n(mSqHead, __ATOMIC_ACQUIRE) == *mSqEntries)
+            {
+                // Full, submit without waiting to make room.
+                ::syscall(__NR_io_uring_enter, mRingFd, mToSubmit, 0, 0, nullptr, 0);
+                mToSubmit = 0;
+            }
+            unsigned index = tail & *mSqMask;
+            io_uring_sqe &sqe = static_cast<io_uring_sqe *>(mSqes)[index];
+            std::memset(&sqe, 0, sizeof(sqe));
+            mSqArray[index] = index;
+            __atomic_store_n(mSqTail, tail + 1, __ATOMIC_RELEASE);
+            ++mToSubmit;
+            return sqe;
+        }
+
+        void arm()
+        {
+            io_uring_sqe &sqe = nextRequest();
+            sqe.opcode = IORING_OP_RECVMSG;
+            sqe.fd = mSocket;
+            sqe.addr = reinterpret_cast<std::uintptr_t>(&mMessage);
+            sqe.len = 1;
+            sqe.ioprio = IORING_RECV_MULTISHOT;
+            sqe.flags = IOSQE_BUFFER_SELECT;
+            sqe.buf_group = BufferGroup;
+            sqe.user_data = ReceiveRequest;
+            mArmed = true;
+        }
+
+        /**
+         * @brief Queues a request giving buffers `[first, first + count)` back to the kernel.
+         */
+        void provide(SizeType first, SizeType count)
+        {
+            io_uring_sqe &sqe = nextRequest();
+            sqe.opcode = IORING_OP_PROVIDE_BUFFERS;
+            sqe.fd = static_cast<int>(count);
+            sqe.addr = reinterpret_cast<std::uintptr_t>(mBuffers.get() + first * mBufferStride);
+            sqe.len = static_cast<unsigned>(mBufferStride);
+            sqe.off = static_cast<unsigned long long>(first);
+            sqe.buf_group = BufferGroup;
+            sqe.flags = mSkipFlags;
+            sqe.user_data = ProvideRequest;
+        }
+
+        /**
+         * @brief Provides the buffers used by the last batch again, one request per run of consecutive ids.
+         * @details They are submitted before the recvmsg is rearmed, so it has buffers to receive into.
+         */
+        void provideUsed()
+        {
+            if(mUsed.empty())
+            {
+                return;
+            }
+            std::sort(mUsed.begin(), mUsed.end());
+            SizeType first = mUsed[0];
+            SizeType count = 1;
+            for(SizeType i = 1; i < mUsed.size(); ++i)
+            {
+                if(mUsed[i] == first + count)
+                {
+                    ++count;
+                    continue;
+                }
+                provide(first, count);
+                first = mUsed[i];
+                count = 1;
+            }
+            provide(first, count);
+            mUsed.clear();
+        }
+
+        unsigned completionsReady() const
+        {
+            return __atomic_load_n(mCqTail, __ATOMIC_ACQUIRE) - *mCqHead;
+        }
+    };
+#endif
+
+    /**
+     * @brief Single-threaded event loop owning a UDP socket, the sessions and their timers. (KCPlus feature)
+     * @details
+     * Wires a `UDPTransport` and a `KCPServer` together: datagrams are dispatched to sessions as they arrive,
+     * sessions are updated when their timers in the wheel are due, and low-level packets are sent in one batch per
+     * loop iteration. Turn on `server().setFlushAfterInput(true)` to send ACKs of an iteration's input in its batch.
+     * Two backends:
+     * - `Backend::Epoll`: waits on epoll, then reads batches with `recvmmsg()`.
+     * - `Backend::IOUring`: one multishot `recvmsg` over provided buffers (see `IOUringReceiver`), datagrams are
+     *   passed to `input()` straight from the buffers the kernel wrote. Only if `KCPLUS_HAS_IO_URING` is defined.
+     *
+     * Callbacks run on the thread calling `run()`. Use `KCPEngine` to spread sessions over several threads.
+     */
+    class KCPReactor
+    {
+    public:
+        enum class Backend
+        {
+            Epoll,
+            IOUring
+        };
+
+        /**
+         * @brief Called when a new client arrived. Returns `false` to reject the client.
+         * @details The output function of the session is already set when it's called.
+         */
+        using AcceptCallback = std::function<bool(IUINT32 conv, KCPSession &session, const SocketAddress &from)>;
+
+        /**
+         * @param backend How datagrams are received.
+         * @param numOfBuffers Number of receive buffers, which is also the batch size of the epoll backend.
+         * @param bufferSize Maximum size of a datagram.
+         */
+        explicit KCPReactor(Backend backend = Backend::Epoll, SizeType numOfBuffers = 256, SizeType bufferSize = 2048)
+            :mBackend(backend),mNumOfBuffers(numOfBuffers),mBufferSize(bufferSize),mTransport(numOfBuffers, bufferSize),
+            mEpollFd(-1),mRunning(false),mTickInterval(10)
+        {
+#ifndef KCPLUS_HAS_IO_URING
+            if(mBackend == Backend::IOUring)
+            {
+                throw std::system_error(ENOSYS, std::system_category(), "KCPReactor: built without io_uring");
+            }
+#endif
+            mServer.setAcceptCallback([this](IUINT32 conv, KCPSession &session)
+            {
+                if(mMigration)
+                {
+                    session.setOutputFunction(mPeers.outputTo(mTransport, conv));
+                }
+                else
+                {
+                    session.setOutputFunction(mTransport.outputTo(*mFrom));
+                }
+                return !mAcceptFunc || mAcceptFunc(conv, session, *mFrom);
+            });
+        }
+
+        ~KCPReactor()
+        {
+            if(mEpollFd >= 0)
+            {
+                ::close(mEpollFd);
+            }
+        }
+
+        KCPReactor(const KCPReactor &) = delete;
+        KCPReactor &operator=(const KCPReactor &) = delete;
+
+        /**
+         * @brief Sets the function called when a new client arrived.
+         */
+        void setAcceptCallback(AcceptCallback acceptCallback)
+        {
+            mAcceptFunc = acceptCallback;
+        }
+
+        /**
+         * @brief Turns on/off connection migration, call it before any client arrived.
+         * @details
+         * Sessions then follow their client to a new address (NAT rebinding, network switch) instead of being lost,
+         * authenticated by a token in front of every packet, see `PeerTable`. Clients must use `MigrationClient`,
+         * and sessions on both sides an MTU reduced by `MigrationFormat::Overhead`.
+         */
+        void setMigration(bool migration)
+        {
+            mMigration = migration;
+        }
+
+        /**
+         * @brief Returns addresses and tokens of sessions, when migration is on. Loop thread only.
+         */
+        const PeerTable &peers() const
+        {
+            return mPeers;
+        }
+
+        /**
+         * @brief Sets the longest time the loop sleeps, so timers are checked at least this often.
+         * @param tickInterval Interval in millisec, by default it's 10ms.
+         */
+        void setTickInterval(IUINT32 tickInterval)
+        {
+            mTickInterval = tickInterval;
+        }
+
+        /**
+         * @brief Opens the socket and binds it to `address`.
+         * @throw std::system_error If the socket or the backend can not be set up.
+         */
+        void bind(const SocketAddress &address)
+        {
+            mTransport.open(address.storage.ss_family);
+            mTransport.bind(address);
+#ifdef KCPLUS_HAS_IO_URING
+            if(mBackend == Backend::IOUring)
+            {
+                mReceiver.reset(new IOUringReceiver(mTransport.fd(), mNumOfBuffers, mBufferSize));
+                return;
+            }
+#endif
+            mEpollFd = ::epoll_create1(EPOLL_CLOEXEC);
+            if(mEpollFd < 0)
+            {
+                throw std::system_error(errno, std::system_category(), "KCPReactor: epoll_create1");
+            }
+            epoll_event event;
+            std::memset(&event, 0, sizeof(event));
+            event.events = EPOLLIN;
+            if(::epoll_ctl(mEpollFd, EPOLL_CTL_ADD, mTransport.fd(), &event) != 0)
+            {
+                throw std::system_error(errno, std::system_category(), "KCPReactor: epoll_ctl");
+            }
+        }
+
+        /**
+         * @brief Runs the loop until `stop()` is called.
+         */
+        void run()
+        {
+            mRunning.store(true);
+            while(mRunning.load())
+            {
+                runOnce(static_cast<int>(mTickInterval));
+            }
+        }
+
+        /**
+         * @brief Stops `run()` within one tick interval. Thread-safe.
+         */
+        void stop()
+        {
+            mRunning.store(false);
+        }
+
+        /**
+         * @brief Runs one iteration: waits up to `timeout` millisec for datagrams, dispatches them, updates sessions
+         * which are due and sends what they output.
+         * @details Use it instead of `run()` to drive the reactor from another loop.
+         * @return Number of datagrams received.
+         */
+        SizeType runOnce(int timeout)
+        {
+            SizeType received = 0;
+            auto dispatch = [this](const ConstBuffer datagrams[], SizeType count, const SocketAddress &from)
+            {
+                // Only the accept callback looks at the source.
+                mFrom = &from;
+                if(mMigration)
+                {
+                    mPeers.input(mServer, datagrams, count, from);
+                }
+                else
+                {
+                    mServer.input(datagrams, count);
+                }
+            };
+            auto collect = [this, &dispatch](const char data[], SizeType size, const SocketAddress &from)
+            {
+                mBatch.add(data, size, from, dispatch);
+            };
+#ifdef KCPLUS_HAS_IO_URING
+            if(mReceiver != nullptr)
+            {
+                received = mReceiver->receive(timeout, collect);
+                mBatch.dispatch(dispatch);
+            }
+#endif
+            if(mEpollFd >= 0)
+            {
+                epoll_event event;
+                if(::epoll_wait(mEpollFd, &event, 1, timeout) > 0)
+                {
+                    SizeType batch;
+                    do
+                    {
+                        batch = mTransport.receive(collect);
+                        mBatch.dispatch(dispatch);
+                        received += batch;
+                    } while(batch == mNumOfBuffers);
+                }
+            }
+            Clock::tick();
+            mServer.update();
+            if(mMigration && static_cast<IINT32>(Clock::now() - mLastPrune) >= static_cast<IINT32>(PruneInterval))
+            {
+                mPeers.prune(mServer);
+                mLastPrune = Clock::now();
+            }
+            mTransport.flush();
+            return received;
+        }
+
+        /**
+         * @brief Returns the session table. Loop thread only.
+         */
+        KCPServer &server()
+        {
+            return mServer;
+        }
+
+        /**
+         * @brief Returns the transport, eg. for `setGSO()`. Loop thread only.
+         */
+        UDPTransport &transport()
+        {
+            return mTransport;
+        }
+    private:
+        Backend mBackend;
+        SizeType mNumOfBuffers;
+        SizeType mBufferSize;
+        UDPTransport mTransport;
+        KCPServer mServer;
+        AcceptCallback mAcceptFunc;
+        int mEpollFd;
+#ifdef KCPLUS_HAS_IO_URING
+        std::unique_ptr<IOUringReceiver> mReceiver;
+#endif
+        std::atomic<bool> mRunning;
+        IUINT32 mTickInterval;
+        DatagramBatch mBatch;
+        const SocketAddress *mFrom = nullptr; // Source of the datagrams being dispatched.
+        bool mMigration = false;
+        PeerTable mPeers;
+        IUINT32 mLastPrune = 0;
+
+        constexpr static const IUINT32 PruneInterval = 1000;
+    };
+}
+
+#endif // KCPLUS_REACTOR_HPP
@@ -0,0 +1,775 @@
+/*
+    Copyright 2017 Miigon
+
+    Licensed under the Apache License, Version 2.0 (the "License");
+    you may not use this file except in compliance with the License.
+    You may obtain a copy of the License at
+
+        http://www.apache.org/licenses/LICENSE-2.0
+
+    Unless required by applicable law or agreed to in writing, software
+    distributed under the License is distributed on an "AS IS" BASIS,
+    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+    See the License for the specific language governing permissions and
+    limitations under the License.
+*/
+
+#ifndef KCPLUS_SERVER_HPP
+#define KCPLUS_SERVER_HPP
+
+#include <algorithm>
+#include <functional>
+#include <memory>
+#include <utility>
+#include <vector>
+#include "kcplus.hpp"
+#include "kcplus_timer.hpp"
+
+namespace ikcp
+{
+    /**
+     * @brief Open-addressing hash map from conv to `Value`. (KCPlus feature)
+     * @details
+     * Linear probing over a compact key array, with backward-shift deletion (no tombstones).
+     * Capacity is always a power of two and the load factor is kept under 1/2.
+     * Pointers returned by `find()`/`emplace()` are invalidated by the next `emplace()`/`erase()`.
+     * Not thread-safe.
+     * @tparam Value Mapped type, must be default constructible and movable.
+     */
+    template<class Value>
+    class SessionTable
+    {
+    public:
+        /**
+         * @param initialCapacity Expected number of entries.
+         */
+        explicit SessionTable(SizeType initialCapacity = 16)
+            :mSize(0)
+        {
+            SizeType capacity = 16;
+            while(capacity < initialCapacity * 2)
+            {
+                capacity *= 2;
+            }
+            mKeys.resize(capacity);
+            mValues.resize(capacity);
+        }
+
+        /**
+         * @brief Returns the value mapped to `conv`, or `nullptr` if there is none.
+         */
+        Value *find(IUINT32 conv)
+        {
+            SizeType index;
+            return lookup(conv, index) ? &mValues[index] : nullptr;
+        }
+
+        const Value *find(IUINT32 conv) const
+        {
+            SizeType index;
+            return lookup(conv, index) ? &mValues[index] : nullptr;
+        }
+
+        /**
+         * @brief Inserts a default constructed value for `conv` if there is none.
+         * @return The value mapped to `conv`, and whether it was newly inserted.
+         */
+        std::pair<Value *, bool> emplace(IUINT32 conv)
+        {
+            SizeType index;
+            if(lookup(conv, index))
+            {
+                return std::make_pair(&mValues[index], false);
+            }
+            if((mSize + 1) * 2 > mKeys.size())
+            {
+                rehash(mKeys.size() * 2);
+                lookup(conv, index);
+            }
+            mKeys[index].conv = conv;
+            mKeys[index].used = true;
+            ++mSize;
+            return std::make_pair(&mValues[index], true);
+        }
+
+        /**
+         * @brief Removes the value mapped to `conv`.
+         * @return `true` if there was one.
+         */
+        bool erase(IUINT32 conv)
+        {
+            SizeType index;
+            if(!lookup(conv, index))
+            {
+                return false;
+            }
+            SizeType mask = mKeys.size() - 1;
+            SizeType hole = index;
+            // Backward-shift: move following entries of the same probe run into the hole.
+            for(SizeType next = (hole + 1) & mask; mKeys[next].used; next = (next + 1) & mask)
+            {
+                SizeType home = slotOf(mKeys[next].conv);
+                if(((next - home) & mask) >= ((next - hole) & mask))
+                {
+                    mKeys[hole] = mKeys[next];
+                    mValues[hole] = std::move(mValues[next]);
+                    hole = next;
+                }
+            }
+            mKeys[hole].used = false;
+            mValues[hole] = Value();
+            --mSize;
+            return true;
+        }
+
+        /**
+         * @brief Calls `function(conv, value)` for every entry.
+         * @note Do not insert or erase entries inside `function`.
+         */
+        template<class Function>
+        void forEach(Function function)
+        {
+            for(SizeType i = 0; i < mKeys.size(); ++i)
+            {
+                if(mKeys[i].used)
+                {
+                    function(mKeys[i].conv, mValues[i]);
+                }
+            }
+        }
+
+        SizeType size() const
+        {
+            return mSize;
+        }
+
+        bool empty() const
+        {
+            return mSize == 0;
+        }
+    private:
+        struct Key
+        {
+            IUINT32 conv = 0;
+            bool used = false;
+        };
+
+        std::vector<Key> mKeys;
+        std::vector<Value> mValues;
+        SizeType mSize;
+
+        SizeType slotOf(IUINT32 conv) const
+        {
+            // Fibonacci hashing, convs are often sequential.
+            return static_cast<SizeType>(conv * 2654435769u) & (mKeys.size() - 1);
+        }
+
+        // Returns whether `conv` is found. `index` receives its slot, or the empty slot to insert it into.
+        bool lookup(IUINT32 conv, SizeType &index) const
+        {
+            SizeType mask = mKeys.size() - 1;
+            for(index = slotOf(conv); mKeys[index].used; index = (index + 1) & mask)
+            {
+                if(mKeys[index].conv == conv)
+                {
+                    return true;
+                }
+            }
+            return false;
+        }
+
+        void rehash(SizeType capacity)
+        {
+            std::vector<Key> keys(capacity);
+            std::vector<Value> values(capacity);
+            keys.swap(mKeys);
+            values.swap(mValues);
+            mSize = 0;
+            for(SizeType i = 0; i < keys.size(); ++i)
+            {
+                if(keys[i].used)
+                {
+                    *emplace(keys[i].conv).first = std::move(values[i]);
+                }
+            }
+        }
+    };
+
+    /**
+     * @brief Demultiplexes low-level packets of many clients to their `KCPSession`s by conv. (KCPlus feature)
+     * @details
+     * Sessions are created lazily on first contact: the accept callback is called with the new session, where you
+     * should set up its output function (and anything else), or reject the client.
+     * Sessions not receiving any packet for the idle timeout are evicted in `update()`.
+     *
+     * Sessions are kept in a `TimerWheel` at the time `whenToUpdate()` tells, so `update()` only updates sessions
+     * which are due. Sessions with nothing to send are only updated every idle update interval, until they receive a
+     * packet or `wakeup()` is called. So if you `send()` directly on a session, call `wakeup()` afterwards, or just
+     * use `send()` of the server.
+     *
+     * Not thread-safe, use one server per thread.
+     */
+    class KCPServer
+    {
+    public:
+        /**
+         * @brief Called when a packet with unknown conv arrived. Returns `false` to reject the client.
+         */
+        using AcceptCallback = std::function<bool(IUINT32 conv, KCPSession &session)>;
+        /**
+         * @brief Called right before a session is destroyed because of idle timeout.
+         */
+        using EvictCallback = std::function<void(IUINT32 conv, KCPSession &session)>;
+        /**
+         * @brief Configures a newly constructed session, before it's pooled or accepted.
+         */
+        using SessionTemplate = std::function<void(KCPSession &session)>;
+
+        /**
+         * @param initialCapacity Expected number of sessions.
+         */
+        explicit KCPServer(SizeType initialCapacity = 1024)
+            :mSessions(initialCapacity),mIdleTimeout(0),mIdleUpdateInterval(1000),mCurrent(0),mDispatching(0),
+            mPoolSize(0),mFlushAfterInput(false),mStarted(false)
+        {
+        }
+
+        ~KCPServer()
+        {
+            mSessions.forEach([this](IUINT32, std::unique_ptr<Client> &client)
+            {
+                mWheel.cancel(*client);
+            });
+        }
+
+        KCPServer(const KCPServer &) = delete;
+        KCPServer &operator=(const KCPServer &) = delete;
+
+        /**
+         * @brief Sets the function called when a new client arrived.
+         * @details Without it, every new client is accepted with a default session.
+         */
+        void setAcceptCallback(AcceptCallback acceptCallback)
+        {
+            mAcceptFunc = acceptCallback;
+        }
+
+        /**
+         * @brief Sets the function called when an idle session is evicted.
+         */
+        void setEvictCallback(EvictCallback evictCallback)
+        {
+            mEvictFunc = evictCallback;
+        }
+
+        /**
+         * @brief Keeps up to `size` released sessions to be recycled for new clients. (KCPlus feature)
+         * @details
+         * Closed, evicted and rejected sessions are `reset()` into the pool instead of being destroyed, and new
+         * clients take a session from it, so reconnect storms don't construct and destroy KCP control blocks. The
+         * pool is filled up right away.
+         * `sessionTemplate` is applied once to every constructed session, so put anything that allocates there,
+         * like `setMTU()`, window sizes, `setProperties()` or `setStreamMode()`. Recycled sessions keep it, and also
+         * keep callbacks set by the accept callback, which sets them again for the new client anyway.
+         * @param size Maximum number of pooled sessions, 0 disables pooling. By default it's 0.
+         * @param sessionTemplate Applied to every constructed session, pooled or not.
+         */
+        void setSessionPool(SizeType size, SessionTemplate sessionTemplate = SessionTemplate())
+        {
+            mPoolSize = size;
+            mTemplate = sessionTemplate;
+            if(mPool.size() > mPoolSize)
+            {
+                mPool.resize(mPoolSize);
+            }
+            mPool.reserve(mPoolSize);
+            while(mPool.size() < mPoolSize)
+            {
+                mPool.push_back(construct(0));
+            }
+        }
+
+        /**
+         * @brief Sets how long a session can stay without receiving packets before being evicted.
+         * @param idleTimeout Idle timeout in millisec, 0 disables eviction. By default it's 0.
+         */
+        void setIdleTimeout(IUINT32 idleTimeout)
+        {
+            mIdleTimeout = idleTimeout;
+        }
+
+        /**
+         * @brief Sets how often sessions with nothing to send are updated.
+         * @param idleUpdateInterval Interval in millisec, by default it's 1000ms.
+         */
+        void setIdleUpdateInterval(IUINT32 idleUpdateInterval)
+        {
+            mIdleUpdateInterval = idleUpdateInterval;
+        }
+
+        /**
+         * @brief Turns on/off flushing sessions which received packets once per loop iteration.
+         * @details
+         * KCP only sends the ACKs of received packets on next flush, which can be a whole internal interval later.
+         * Flushing after every `input()` sends them right away, but as one tiny datagram per input. With this on,
+         * sessions which received packets are marked dirty instead, and `update()` (or `flushDirty()`) flushes each of
+         * them exactly once, so a loop iteration sends the ACKs of all its input in one transport flush.
+         */
+        void setFlushAfterInput(bool flushAfterInput)
+        {
+            mFlushAfterInput = flushAfterInput;
+        }
+
+        /**
+         * @brief If you received a low-level packet from any client, call this function.
+         * @details The packet is dispatched to the session of its conv, which is created if it doesn't exist.
+         * @param data Data of the low-level packet.
+         * @param size Size of data.
+         * @return The session the packet was dispatched to, `nullptr` if the packet is malformed or rejected.
+         */
+        KCPSession *input(const char data[], SizeType size)
+        {
+            if(size < KCPOverhead)
+            {
+                return nullptr;
+            }
+            DispatchScope scope(*this);
+            IUINT32 conv = ikcp_getconv(data);
+            Client *client = clientFor(conv);
+            if(client == nullptr)
+            {
+                return nullptr;
+            }
+            client->lastActive = mCurrent;
+            client->session.input(data, size);
+            // Callbacks of the session may have closed it.
+            client = live(conv);
+            if(client == nullptr)
+            {
+                return nullptr;
+            }
+            markDirty(*client);
+            schedule(*client, true);
+            return &client->session;
+        }
+
+        /**
+         * @brief Same as `input(const char data[], SizeType size)` for a batch of low-level packets, eg. from
+         * `recvmmsg()`.
+         * @details Consecutive packets of the same conv are fed to their session at once, see
+         * `KCPSession::input(const ConstBuffer datagrams[], SizeType count)`.
+         * @return Number of packets dispatched to a session.
+         */
+        SizeType input(const ConstBuffer datagrams[], SizeType count)
+        {
+            DispatchScope scope(*this);
+            SizeType dispatched = 0;
+            SizeType i = 0;
+            while(i < count)
+            {
+                if(datagrams[i].size < KCPOverhead)
+                {
+                    ++i;
+                    continue;
+                }
+                IUINT32 conv = ikcp_getconv(datagrams[i].data);
+                SizeType end = i + 1;
+                while(end < count && datagrams[end].size >= KCPOverhead && ikcp_getconv(datagrams[end].data) == conv)
+                {
+                    ++end;
+                }
+                Client *client = clientFor(conv);
+                if(client != nullptr)
+                {
+                    client->lastActive = mCurrent;
+                    client->session.input(datagrams + i, end - i);
+                    dispatched += end - i;
+                    client = live(conv);
+                }
+                if(client != nullptr)
+                {
+                    markDirty(*client);
+                    schedule(*client, true);
+                }
+                i = end;
+            }
+            return dispatched;
+        }
+
+        /**
+         * @brief Sends a high-level packet to the session of `conv`.
+         * @return `false` if there is no such session, or the session rejected the packet with
+         * `SendStatus::WouldBlock` (see `KCPSession::setWatermarks()`). Wait for its writable callback then.
+         * @see KCPSession::send()
+         */
+        bool send(IUINT32 conv, const void *data, SizeType size)
+        {
+            Client *client = live(conv);
+            if(client == nullptr || client->session.send(data, size) == SendStatus::WouldBlock)
+            {
+                return false;
+            }
+            schedule(*client, true);
+            return true;
+        }
+
+        /**
+         * @brief Reschedules the session of `conv` by its `whenToUpdate()`.
+         * @details Call it after sending packets on the session directly.
+         * @return `false` if there is no such session.
+         */
+        bool wakeup(IUINT32 conv)
+        {
+            Client *client = live(conv);
+            if(client == nullptr)
+            {
+                return false;
+            }
+            schedule(*client, true);
+            return true;
+        }
+
+        /**
+         * @brief Returns the session of `conv`, or `nullptr` if there is none.
+         */
+        KCPSession *find(IUINT32 conv)
+        {
+            Client *client = live(conv);
+            return client != nullptr ? &client->session : nullptr;
+        }
+
+        /**
+         * @brief Destroys the session of `conv`. The evict callback is not called.
+         * @details
+         * Can be called from callbacks of sessions, eg. a receive callback running in `input()`. The session is gone
+         * for the server right away then, but only destroyed once `input()` or `update()` returns.
+         * @return `true` if there was one.
+         */
+        bool close(IUINT32 conv)
+        {
+            Client *client = live(conv);
+            if(client == nullptr)
+            {
+                return false;
+            }
+            mWheel.cancel(*client);
+            if(mDispatching != 0)
+            {
+                client->closing = true;
+                client->dirty = false;
+                mClosing.push_back(conv);
+                return true;
+            }
+            release(*mSessions.find(conv));
+            return mSessions.erase(conv);
+        }
+
+        /**
+         * @brief Updates sessions which are due, flushes dirty ones (see `setFlushAfterInput()`), and evicts idle ones.
+         * @details
+         * While `MemoryAccounting` is over its global limit, sessions using the most memory are evicted too (the evict
+         * callback is called), until usage is back to 3/4 of the limit.
+         * @param currentTimestamp Current timestamp in millisec.
+         * @see KCPSession::update()
+         */
+        void update(IUINT32 currentTimestamp)
+        {
+            DispatchScope scope(*this);
+            mCurrent = currentTimestamp;
+            if(!mStarted)
+            {
+                // Sessions accepted before the first update have no real timestamp yet.
+                mSessions.forEach([this](IUINT32, std::unique_ptr<Client> &client)
+                {
+                    client->lastActive = mCurrent;
+                });
+                mStarted = true;
+            }
+            mWheel.advance(mCurrent, [this](Client &client)
+            {
+                if(isIdle(client))
+                {
+                    client.dirty = false; // Not to be flushed and rescheduled by `flushDirty()`.
+                    mEvictList.push_back(client.conv);
+                    return;
+                }
+                // Dirty clients stay dirty, `update()` only flushes when KCP's interval is due.
+                client.session.update(mCurrent);
+                if(!client.closing)
+                {
+                    schedule(client, false);
+                }
+            });
+            flushDirty();
+            for(IUINT32 conv : mEvictList)
+            {
+                // The evict callback may have closed it already.
+                Client *client = live(conv);
+                if(client == nullptr)
+                {
+                    continue;
+                }
+                if(mEvictFunc)
+                {
+                    mEvictFunc(conv, client->session);
+                }
+                mWheel.cancel(*client);
+                release(*mSessions.find(conv));
+                mSessions.erase(conv);
+            }
+            mEvictList.clear();
+            if(MemoryAccounting::isGloballyOver())
+            {
+                evictForMemory();
+            }
+        }
+
+        /**
+         * @brief Flushes sessions which received packets since the last call, each once. See `setFlushAfterInput()`.
+         * @details Already called by `update()`.
+         * @return Number of sessions flushed.
+         */
+        SizeType flushDirty()
+        {
+            DispatchScope scope(*this);
+            SizeType flushed = 0;
+            for(IUINT32 conv : mDirtyList)
+            {
+                // Sessions closed meanwhile are gone, or came back clean.
+                Client *client = live(conv);
+                if(client == nullptr || !client->dirty)
+                {
+                    continue;
+                }
+                client->dirty = false;
+                client->session.flush();
+                if(!client->closing)
+                {
+                    schedule(*client, true);
+                }
+                ++flushed;
+            }
+            mDirtyList.clear();
+            return flushed;
+        }
+
+        /**
+         * @brief Same as `update(IUINT32 currentTimestamp)`, with the timestamp of `Clock::now()`.
+         * @details Call `Clock::tick()` once per event loop iteration before it.
+         */
+        void update()
+        {
+            update(Clock::now());
+        }
+
+        /**
+         * @brief Returns number of sessions.
+         */
+        SizeType size() const
+        {
+            return mSessions.size();
+        }
+    private:
+        struct Client : TimerWheelNode
+        {
+            explicit Client(IUINT32 conv)
+                :session(conv),conv(conv),lastActive(0),dirty(false),closing(false)
+            {
+            }
+
+            void reset(IUINT32 newConv)
+            {
+                session.reset(newConv);
+                conv = newConv;
+                lastActive = 0;
+                dirty = false;
+                closing = false;
+            }
+
+            KCPSession session;
+            IUINT32 conv;
+            IUINT32 lastActive;
+            bool dirty;                 // In `mDirtyList`, waiting for `flushDirty()`.
+            bool closing;               // In `mClosing`, closed from a callback.
+        };
+
+        // Defers destruction of sessions closed from their callbacks until the outermost scope ends.
+        class DispatchScope
+        {
+        public:
+            explicit DispatchScope(KCPServer &server)
+                :mServer(server)
+            {
+                ++mServer.mDispatching;
+            }
+
+            DispatchScope(const DispatchScope &) = delete;
+            DispatchScope &operator=(const DispatchScope &) = delete;
+
+            ~DispatchScope()
+            {
+                if(--mServer.mDispatching == 0)
+                {
+                    mServer.destroyClosing();
+                }
+            }
+        private:
+            KCPServer &mServer;
+        };
+
+        SessionTable<std::unique_ptr<Client>> mSessions;
+        TimerWheel<Client> mWheel;
+        AcceptCallback mAcceptFunc;
+        EvictCallback mEvictFunc;
+        IUINT32 mIdleTimeout;
+        IUINT32 mIdleUpdateInterval;
+        IUINT32 mCurrent;
+        std::vector<IUINT32> mEvictList;
+        std::vector<IUINT32> mDirtyList;
+        std::vector<IUINT32> mClosing;
+        SizeType mDispatching;      // Depth of `DispatchScope`s.
+        std::vector<std::unique_ptr<Client>> mPool;
+        SizeType mPoolSize;
+        SessionTemplate mTemplate;
+        bool mFlushAfterInput;
+        bool mStarted;              // Whether `update()` was called yet.
+
+        std::unique_ptr<Client> construct(IUINT32 conv)
+        {
+            std::unique_ptr<Client> client(new Client(conv));
+            if(mTemplate)
+            {
+                mTemplate(client->session);
+            }
+            return client;
+        }
+
+        std::unique_ptr<Client> acquire(IUINT32 conv)
+        {
+            if(mPool.empty())
+            {
+                return construct(conv);
+            }
+            std::unique_ptr<Client> client = std::move(mPool.back());
+            mPool.pop_back();
+            client->reset(conv);
+            return client;
+        }
+
+        // Evicts the sessions using the most memory, until global usage is back to 3/4 of the limit.
+        void evictForMemory()
+        {
+            std::vector<std::pair<SizeType, IUINT32>> usage;
+            usage.reserve(mSessions.size());
+            mSessions.forEach([&usage](IUINT32 conv, std::unique_ptr<Client> &client)
+            {
+                usage.emplace_back(client->session.memoryUsage(), conv);
+            });
+            std::sort(usage.begin(), usage.end(), std::greater<std::pair<SizeType, IUINT32>>());
+            for(const std::pair<SizeType, IUINT32> &entry : usage)
+            {
+                if(!MemoryAccounting::isGloballyOver(true))
+                {
+                    break;
+                }
+                // The evict callback may have closed it already.
+                Client *client = live(entry.second);
+                if(client == nullptr)
+                {
+                    continue;
+                }
+                if(mEvictFunc)
+                {
+                    mEvictFunc(entry.second, client->session);
+                }
+                mWheel.cancel(*client);
+                release(*mSessions.find(entry.second));
+                mSessions.erase(entry.second);
+                GlobalStats::add(GlobalStats::MemoryEvictions, 1);
+            }
+        }
+
+        void markDirty(Client &client)
+        {
+            if(mFlushAfterInput && !client.dirty)
+            {
+                client.dirty = true;
+                mDirtyList.push_back(client.conv);
+            }
+        }
+
+        // Returns the client of `conv`, `nullptr` if there is none or it's closing.
+        Client *live(IUINT32 conv)
+        {
+            std::unique_ptr<Client> *entry = mSessions.find(conv);
+            return entry != nullptr && !(*entry)->closing ? entry->get() : nullptr;
+        }
+
+        // Destroys sessions closed from callbacks, once no callback runs anymore.
+        void destroyClosing()
+        {
+            for(IUINT32 conv : mClosing)
+            {
+                std::unique_ptr<Client> *entry = mSessions.find(conv);
+                if(entry != nullptr && (*entry)->closing)
+                {
+                    mWheel.cancel(**entry);
+                    release(*entry);
+                    mSessions.erase(conv);
+                }
+            }
+            mClosing.clear();
+        }
+
+        // Finds the client of `conv`, or accepts a new one. `nullptr` if rejected or closing.
+        Client *clientFor(IUINT32 conv)
+        {
+            std::unique_ptr<Client> *entry = mSessions.find(conv);
+            if(entry != nullptr)
+            {
+                return (*entry)->closing ? nullptr : entry->get();
+            }
+            std::unique_ptr<Client> client(acquire(conv));
+            if(mAcceptFunc && !mAcceptFunc(conv, client->session))
+            {
+                release(client);
+                return nullptr;
+            }
+            Client *accepted = client.get();
+            *mSessions.emplace(conv).first = std::move(client);
+            return accepted;
+        }
+
+        // Takes the client out of `client` if the pool has room, otherwise leaves it to be destroyed.
+        void release(std::unique_ptr<Client> &client)
+        {
+            if(mPool.size() < mPoolSize)
+            {
+                client->reset(0);
+                mPool.push_back(std::move(client));
+            }
+        }
+
+        bool isIdle(const Client &client) const
+        {
+            return mIdleTimeout != 0 && static_cast<IINT32>(mCurrent - client.lastActive) >= static_cast<IINT32>(mIdleTimeout);
+        }
+
+        // `active` means the session just received or sent packets, which must be flushed in time.
+        void schedule(Client &client, bool active)
+        {
+            IUINT32 next = mCurrent + mIdleUpdateInterval;
+            if(active || client.session.getNumOfPendingPackets() != 0 || client.session.hasReceivablePacket())
+            {
+                next = client.session.whenToUpdate(mCurrent);
+            }
+            if(mIdleTimeout != 0 && static_cast<IINT32>(client.lastActive + mIdleTimeout - next) < 0)
+            {
+                next = client.lastActive + mIdleTimeout;
+            }
+            mWheel.schedule(client, next);
+        }
+    };
+}
+
+#endif // KCPLUS_SERVER_HPP
@@ -0,0 +1,299 @@
+/*
+    Copyright 2017 Miigon
+
+    Licensed under the Apache License, Version 2.0 (the "License");
+    you may not use this file except in compliance with the License.
+    You may obtain a copy of the License at
+
+        http://www.apache.org/licenses/LICENSE-2.0
+
+    Unless required by applicable law or agreed to in writing, software
+    distributed under the License is distributed on an "AS IS" BASIS,
+    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+    See the License for the specific language governing permissions and
+    limitations under the License.
+*/
+
+#ifndef KCPLUS_TIMER_HPP
+#define KCPLUS_TIMER_HPP
+
+#include "kcplus.hpp"
+
+namespace ikcp
+{
+    /**
+     * @brief Intrusive node of `TimerWheel`. Derive from it to make an object schedulable. (KCPlus feature)
+     */
+    class TimerWheelNode
+    {
+    public:
+        TimerWheelNode()
+            :mPrev(nullptr),mNext(nullptr),mExpire(0)
+        {
+        }
+
+        TimerWheelNode(const TimerWheelNode &) = delete;
+        TimerWheelNode &operator=(const TimerWheelNode &) = delete;
+
+        /**
+         * @brief Returns whether the node is scheduled in a wheel.
+         */
+        bool isScheduled() const
+        {
+            return mNext != nullptr;
+        }
+
+        /**
+         * @brief Returns the timestamp the node is scheduled at.
+         */
+        IUINT32 expireTime() const
+        {
+            return mExpire;
+        }
+    private:
+        template<class Node> friend class TimerWheel;
+
+        TimerWheelNode *mPrev;
+        TimerWheelNode *mNext;
+        IUINT32 mExpire;
+
+        void linkBefore(TimerWheelNode *position)
+        {
+            mPrev = position->mPrev;
+            mNext = position;
+            mPrev->mNext = this;
+            position->mPrev = this;
+        }
+
+        void unlink()
+        {
+            mPrev->mNext = mNext;
+            mNext->mPrev = mPrev;
+            mPrev = nullptr;
+            mNext = nullptr;
+        }
+    };
+
+    /**
+     * @brief Hierarchical timing wheel with millisecond resolution. (KCPlus feature)
+     * @details
+     * 4 levels of 64 slots, covering 2^24 ms (about 4.6 hours) ahead. Farther timers are clamped to that range.
+     * Scheduling and cancelling are O(1), and `advance()` only touches timers which are due, besides moving timers
+     * down a level once in a while.
+     * Used by `KCPServer` to update only sessions that `whenToUpdate()` says are due.
+     * @tparam Node Type of scheduled objects, must derive from `TimerWheelNode`.
+     * @note Cancel scheduled nodes before destroying them.
+     */
+    template<class Node>
+    class TimerWheel
+    {
+    public:
+        /**
+         * @brief Constructs a wheel which starts at the timestamp of the first `advance()`.
+         * @details Nodes scheduled before it expire on that `advance()`.
+         */
+        TimerWheel()
+            :TimerWheel(0)
+        {
+            mStarted = false;
+        }
+
+        /**
+         * @param currentTimestamp Timestamp the wheel starts at.
+         */
+        explicit TimerWheel(IUINT32 currentTimestamp)
+            :mCurrent(currentTimestamp),mSize(0),mStarted(true)
+        {
+            for(int level = 0; level < Levels; ++level)
+            {
+                for(int slot = 0; slot < Slots; ++slot)
+                {
+                    initHead(mSlots[level][slot]);
+                }
+            }
+        }
+
+        TimerWheel(const TimerWheel &) = delete;
+        TimerWheel &operator=(const TimerWheel &) = delete;
+
+        /**
+         * @brief Schedules (or reschedules) `node` to expire at `expireTimestamp`.
+         * @details Timestamps not after the wheel's current time expire on next `advance()`.
+         */
+        void schedule(Node &node, IUINT32 expireTimestamp)
+        {
+            TimerWheelNode &base = node;
+            if(base.isScheduled())
+            {
+                base.unlink();
+                --mSize;
+            }
+            if(static_cast<IINT32>(expireTimestamp - mCurrent) <= 0)
+            {
+                expireTimestamp = mCurrent + 1;
+            }
+            base.mExpire = expireTimestamp;
+            insert(base);
+            ++mSize;
+        }
+
+        /**
+         * @brief Cancels `node` if it is scheduled.
+         */
+        void cancel(Node &node)
+        {
+            TimerWheelNode &base = node;
+            if(base.isScheduled())
+            {
+                base.unlink();
+                --mSize;
+            }
+        }
+
+        /**
+         * @brief Moves the wheel to `currentTimestamp`, calling `function(node)` for every expired node.
+         * @details Expired nodes are unscheduled before `function` is called, which can schedule or cancel any node.
+         * An empty wheel jumps to `currentTimestamp` in any direction, so gaps of 2^31 ms or more before the first
+         * timer don't stall it.
+         */
+        template<class Function>
+        void advance(IUINT32 currentTimestamp, Function function)
+        {
+            if(mSize == 0)
+            {
+                mCurrent = currentTimestamp;
+                mStarted = true;
+                return;
+            }
+            if(!mStarted || static_cast<IINT32>(currentTimestamp - mCurrent) >= static_cast<IINT32>(Range))
+            {
+                // Everything is due.
+                mCurrent = currentTimestamp;
+                mStarted = true;
+                TimerWheelNode expired;
+                initHead(expired);
+                for(int level = 0; level < Levels; ++level)
+                {
+                    for(int slot = 0; slot < Slots; ++slot)
+                    {
+                        splice(mSlots[level][slot], expired);
+                    }
+                }
+                fire(expired, function);
+                return;
+            }
+            while(static_cast<IINT32>(currentTimestamp - mCurrent) > 0)
+            {
+                if(mSize == 0)
+                {
+                    mCurrent = currentTimestamp;
+                    break;
+                }
+                ++mCurrent;
+                // Moves timers of the next round of each level down when lower levels wrap around.
+                for(int level = 1; level < Levels && (mCurrent & ((1u << (SlotBits * level)) - 1)) == 0; ++level)
+                {
+                    cascade(mSlots[level][(mCurrent >> (SlotBits * level)) & SlotMask]);
+                }
+                expire(mSlots[0][mCurrent & SlotMask], function);
+            }
+        }
+
+        /**
+         * @brief Returns the current time of the wheel.
+         */
+        IUINT32 currentTimestamp() const
+        {
+            return mCurrent;
+        }
+
+        /**
+         * @brief Returns number of scheduled nodes.
+         */
+        SizeType size() const
+        {
+            return mSize;
+        }
+    private:
+        constexpr static const int Levels = 4;
+        constexpr static const int SlotBits = 6;
+        constexpr static const int Slots = 1 << SlotBits;
+        constexpr static const IUINT32 SlotMask = Slots - 1;
+        constexpr static const IUINT32 Range = 1u << (SlotBits * Levels);
+
+        TimerWheelNode mSlots[Levels][Slots];
+        IUINT32 mCurrent;
+        SizeType mSize;
+        bool mStarted;              // Whether `mCurrent` is a real timestamp yet.
+
+        void insert(TimerWheelNode &node)
+        {
+            IUINT32 delta = node.mExpire - mCurrent;
+            if(delta >= Range)
+            {
+                delta = Range - 1;
+                node.mExpire = mCurrent + delta;
+            }
+            int level = 0;
+            while(delta >= (1u << (SlotBits * (level + 1))))
+            {
+                ++level;
+            }
+            node.linkBefore(&mSlots[level][(node.mExpire >> (SlotBits * level)) & SlotMask]);
+        }
+
+        void cascade(TimerWheelNode &head)
+        {
+            while(head.mNext != &head)
+            {
+                TimerWheelNode *node = head.mNext;
+                node->unlink();
+                insert(*node);
+            }
+        }
+
+        static void initHead(TimerWheelNode &head)
+        {
+            head.mPrev = &head;
+            head.mNext = &head;
+        }
+
+        // Moves all nodes of list `from` to the end of list `to`.
+        static void splice(TimerWheelNode &from, TimerWheelNode &to)
+        {
+            if(from.mNext == &from)
+            {
+                return;
+            }
+            from.mNext->mPrev = to.mPrev;
+            to.mPrev->mNext = from.mNext;
+            from.mPrev->mNext = &to;
+            to.mPrev = from.mPrev;
+            initHead(from);
+        }
+
+        template<class Function>
+        void expire(TimerWheelNode &head, Function &function)
+        {
+            // Detaches the slot first, so `function` can schedule nodes into it safely.
+            TimerWheelNode expired;
+            initHead(expired);
+            splice(head, expired);
+            fire(expired, function);
+        }
+
+        template<class Function>
+        void fire(TimerWheelNode &expired, Function &function)
+        {
+            while(expired.mNext != &expired)
+            {
+                TimerWheelNode *node = expired.mNext;
+                node->unlink();
+                --mSize;
+                function(static_cast<Node &>(*node));
+            }
+        }
+    };
+}
+
+#endif // KCPLUS_TIMER_HPP
@@ -0,0 +1,372 @@
+/*
+    Copyright 2017 Miigon
+
+    Licensed under the Apache License, Version 2.0 (the "License");
+    you may not use this file except in compliance with the License.
+    You may obtain a copy of the License at
+
+        http://www.apache.org/licenses/LICENSE-2.0
+
+    Unless required by applicable law or agreed to in writing, software
+    distributed under the License is distributed on an "AS IS" BASIS,
+    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+    See the License for the specific language governing permissions and
+    limitations under the License.
+*/
+
+#ifndef KCPLUS_TRACE_HPP
+#define KCPLUS_TRACE_HPP
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+// Events recorded when tracing is on, one bit per `Trace::Event`. Default: all of them.
+#ifndef KCPLUS_TRACE_EVENTS
+#define KCPLUS_TRACE_EVENTS 0xffffffffu
+#endif
+
+// Records kept per thread, a power of two. Older ones are overwritten.
+#ifndef KCPLUS_TRACE_CAPACITY
+#define KCPLUS_TRACE_CAPACITY 16384
+#endif
+
+namespace ikcp
+{
+    using SizeType = std::size_t;
+
+    /**
+     * @brief Low-overhead recorder of hot-path events, exported as a Chrome/Perfetto trace. (KCPlus feature)
+     * @details
+     * Sessions record input, output, send, receive, retransmit and update events when `kcplus.hpp` is compiled with
+     * `KCPLUS_TRACE` defined, and `KCPLUS_TRACE_EVENTS` selects which of them. Otherwise the trace points compile to
+     * nothing.
+     * Every thread writes fixed-size binary records into its own ring of `KCPLUS_TRACE_CAPACITY` records, without
+     * locks, allocation or read-modify-write. `toChromeTrace()` can be called from any thread and anytime, records
+     * overwritten while it copies them are left out. Rings of exited threads are kept until `clear()`.
+     */
+    class Trace
+    {
+    public:
+        enum Event
+        {
+            Input,          // Low-level packets given to a session at once, with their number. Has a duration.
+            Output,         // Low-level packet sent by a session, with its size.
+            Send,           // High-level packet sent, with its size.
+            Receive,        // High-level packet received, with its size.
+            Retransmit,     // Low-level packet carrying retransmitted segments, with their number.
+            Update,         // `update()` of a session, with its timestamp. Has a duration.
+            NumOfEvents
+        };
+
+        struct Record
+        {
+            std::uint64_t timestamp;    // Nanosec, steady clock.
+            std::uint64_t duration;     // Nanosec, 0 for instant events.
+            std::uint32_t conv;
+            Event event;
+            std::uint64_t arg;
+        };
+
+        constexpr static const SizeType Capacity = KCPLUS_TRACE_CAPACITY;
+
+        static_assert((Capacity & (Capacity - 1)) == 0 && Capacity != 0,
+            "KCPLUS_TRACE_CAPACITY must be a power of two");
+
+        /**
+         * @brief Returns whether `event` is compiled in.
+         */
+        constexpr static bool isEnabled(Event event)
+        {
+            return ((static_cast<std::uint32_t>(KCPLUS_TRACE_EVENTS) >> event) & 1) != 0;
+        }
+
+        /**
+         * @brief Returns the current timestamp of records.
+         */
+        static std::uint64_t now()
+        {
+            return static_cast<std::uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(
+                std::chrono::steady_clock::now().time_since_epoch()).count());
+        }
+
+        /**
+         * @brief Records an event without duration on the calling thread.
+         */
+        static void instant(Event event, std::uint32_t conv, std::uint64_t arg)
+        {
+            if(isEnabled(event))
+            {
+                local().ring->write(now(), 0, conv, event, arg);
+            }
+        }
+
+        /**
+         * @brief Records an event which started at `start` and ends now on the calling thread.
+         */
+        static void complete(Event event, std::uint64_t start, std::uint32_t conv, std::uint64_t arg)
+        {
+            if(isEnabled(event))
+            {
+                local().ring->write(start, now() - start, conv, event, arg);
+            }
+        }
+
+        /**
+         * @brief Returns the name of `event`, as used by `toChromeTrace()`.
+         */
+        static const char *name(Event event)
+        {
+            static const char *const names[NumOfEvents] = {
+                "input", "output", "send", "receive", "retransmit", "update"
+            };
+            return names[event];
+        }
+
+        /**
+         * @brief Copies the records of every thread, oldest first per thread.
+         * @param threads Receives the thread index of each record, if not `nullptr`.
+         */
+        static std::vector<Record> snapshot(std::vector<SizeType> *threads = nullptr)
+        {
+            std::vector<Record> records;
+            std::lock_guard<std::mutex> lock(registry().mutex);
+            for(SizeType i = 0; i < registry().rings.size(); ++i)
+            {
+                registry().rings[i]->copy(records);
+                if(threads != nullptr)
+                {
+                    threads->resize(records.size(), i);
+                }
+            }
+            return records;
+        }
+
+        /**
+         * @brief Formats every record in Chrome trace event JSON format, which Perfetto and `chrome://tracing` load.
+         * @details
+         * Events with a duration are complete ("X") events, others instant ("i") ones. Timestamps are in microsec.
+         * Each thread which recorded events is a track.
+         */
+        static std::string toChromeTrace()
+        {
+            std::vector<SizeType> threads;
+            std::vector<Record> records = snapshot(&threads);
+            std::string json = "{\"traceEvents\":[";
+            for(SizeType i = 0; i < records.size(); ++i)
+            {
+                const Record &record = records[i];
+                if(i != 0)
+                {
+                    json += ',';
+                }
+                json += "\n{\"name\":\"";
+                json += name(record.event);
+                json += "\",\"cat\":\"kcplus\",\"ph\":\"";
+                json += hasDuration(record.event) ? "X" : "i";
+                json += "\",\"ts\":";
+                appendMicrosec(json, record.timestamp);
+                if(hasDuration(record.event))
+                {
+                    json += ",\"dur\":";
+                    appendMicrosec(json, record.duration);
+                }
+                else
+                {
+                    json += ",\"s\":\"t\"";
+                }
+                json += ",\"pid\":1,\"tid\":" + std::to_string(threads[i] + 1);
+                json += ",\"args\":{\"conv\":" + std::to_string(record.conv);
+                json += ",\"" + std::string(argName(record.event)) + "\":" + std::to_string(record.arg) + "}}";
+            }
+            json += "\n]}\n";
+            return json;
+        }
+
+        /**
+         * @brief Drops every record, and the rings of exited threads.
+         */
+        static void clear()
+        {
+            std::lock_guard<std::mutex> lock(registry().mutex);
+            std::vector<std::unique_ptr<Ring>> &rings = registry().rings;
+            for(auto &ring : rings)
+            {
+                ring->skip();
+            }
+            rings.erase(std::remove_if(rings.begin(), rings.end(), [](const std::unique_ptr<Ring> &ring)
+            {
+                return !ring->owned.load(std::memory_order_acquire);
+            }), rings.end());
+        }
+    private:
+        // Single-writer ring. The writer claims a record in `mClaimed` before overwriting it and commits it in
+        // `mCommitted` after, so a reader can tell which of the records it copied were overwritten in between.
+        class Ring
+        {
+        public:
+            std::atomic<bool> owned;
+
+            Ring()
+                :owned(true),mClaimed(0),mCommitted(0),mSkipped(0)
+            {
+            }
+
+            void write(std::uint64_t timestamp, std::uint64_t duration, std::uint32_t conv, Event event,
+                std::uint64_t arg)
+            {
+                std::uint64_t index = mCommitted.load(std::memory_order_relaxed);
+                mClaimed.store(index + 1, std::memory_order_relaxed);
+                std::atomic_thread_fence(std::memory_order_release);
+                Slot &slot = mSlots[index & (Capacity - 1)];
+                slot.words[0].store(timestamp, std::memory_order_relaxed);
+                slot.words[1].store(duration, std::memory_order_relaxed);
+                slot.words[2].store(static_cast<std::uint64_t>(conv) << 32 | static_cast<std::uint32_t>(event),
+                    std::memory_order_relaxed);
+                slot.words[3].store(arg, std::memory_order_relaxed);
+                mCommitted.store(index + 1, std::memory_order_release);
+            }
+
+            // Called by readers with the registry locked.
+            void copy(std::vector<Record> &records) const
+            {
+                std::uint64_t end = mCommitted.load(std::memory_order_acquire);
+                std::uint64_t begin = std::max<std::uint64_t>(mSkipped, end > Capacity ? end - Capacity : 0);
+                SizeType first = records.size();
+                for(std::uint64_t i = begin; i < end; ++i)
+                {
+                    const Slot &slot = mSlots[i & (Capacity - 1)];
+                    Record record;
+                    record.timestamp = slot.words[0].load(std::memory_order_relaxed);
+                    record.duration = slot.words[1].load(std::memory_order_relaxed);
+                    std::uint64_t tag = slot.words[2].load(std::memory_order_relaxed);
+                    record.conv = static_cast<std::uint32_t>(tag >> 32);
+                    record.event = static_cast<Event>(static_cast<std::uint32_t>(tag));
+                    record.arg = slot.words[3].load(std::memory_order_relaxed);
+                    records.push_back(record);
+                }
+                std::atomic_thread_fence(std::memory_order_acquire);
+                std::uint64_t claimed = mClaimed.load(std::memory_order_relaxed);
+                if(claimed > begin + Capacity)
+                {
+                    // Those were being overwritten while copying.
+                    SizeType stale = static_cast<SizeType>(std::min<std::uint64_t>(claimed - Capacity - begin,
+                        end - begin));
+                    records.erase(records.begin() + first, records.begin() + first + stale);
+                }
+            }
+
+            // Called by readers with the registry locked.
+            void skip()
+            {
+                mSkipped = mCommitted.load(std::memory_order_acquire);
+            }
+        private:
+            struct Slot
+            {
+                std::atomic<std::uint64_t> words[4];
+            };
+
+            Slot mSlots[Capacity];
+            std::atomic<std::uint64_t> mClaimed;
+            std::atomic<std::uint64_t> mCommitted;
+            std::uint64_t mSkipped;
+        };
+
+        struct Registry
+        {
+            std::mutex mutex;
+            std::vector<std::unique_ptr<Ring>> rings;
+        };
+
+        struct Local
+        {
+            Ring *ring;
+
+            Local()
+                :ring(new Ring)
+            {
+                std::lock_guard<std::mutex> lock(registry().mutex);
+                registry().rings.emplace_back(ring);
+            }
+
+            ~Local()
+            {
+                // The ring stays readable until `clear()`.
+                ring->owned.store(false, std::memory_order_release);
+            }
+        };
+
+        static Registry &registry()
+        {
+            static Registry instance;
+            return instance;
+        }
+
+        static Local &local()
+        {
+            thread_local Local instance;
+            return instance;
+        }
+
+        static bool hasDuration(Event event)
+        {
+            return event == Input || event == Update;
+        }
+
+        static const char *argName(Event event)
+        {
+            switch(event)
+            {
+            case Input:
+                return "packets";
+            case Retransmit:
+                return "segments";
+            case Update:
+                return "timestamp";
+            default:
+                return "bytes";
+            }
+        }
+
+        static void appendMicrosec(std::string &json, std::uint64_t nanosec)
+        {
+            std::string fraction = std::to_string(nanosec % 1000);
+            json += std::to_string(nanosec / 1000) + "." + std::string(3 - fraction.size(), '0') + fraction;
+        }
+    };
+
+    /**
+     * @brief Records an event with the duration of its scope. (KCPlus feature)
+     * @see Trace
+     */
+    class TraceScope
+    {
+    public:
+        TraceScope(Trace::Event event, std::uint32_t conv, std::uint64_t arg)
+            :mStart(Trace::isEnabled(event) ? Trace::now() : 0),mConv(conv),mEvent(event),mArg(arg)
+        {
+        }
+
+        TraceScope(const TraceScope &) = delete;
+        TraceScope &operator=(const TraceScope &) = delete;
+
+        ~TraceScope()
+        {
+            Trace::complete(mEvent, mStart, mConv, mArg);
+        }
+    private:
+        std::uint64_t mStart;
+        std::uint32_t mConv;
+        Trace::Event mEvent;
+        std::uint64_t mArg;
+    };
+}
+
+#endif // KCPLUS_TRACE_HPP
@@ -0,0 +1,485 @@
+/*
+    Copyright 2017 Miigon
+
+    Licensed under the Apache License, Version 2.0 (the "License");
+    you may not use this file except in compliance with the License.
+    You may obtain a copy of the License at
+
+        http://www.apache.org/licenses/LICENSE-2.0
+
+    Unless required by applicable law or agreed to in writing, software
+    distributed under the License is distributed on an "AS IS" BASIS,
+    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+    See the License for the specific language governing permissions and
+    limitations under the License.
+*/
+
+#ifndef KCPLUS_TUNING_HPP
+#define KCPLUS_TUNING_HPP
+
+#include <algorithm>
+#include <cstdint>
+#include <memory>
+#include "kcplus.hpp"
+
+namespace ikcp
+{
+    /**
+     * @brief What a congestion controller learns from a session on every `AdaptiveTuner::update()`. (KCPlus feature)
+     */
+    struct CongestionSample
+    {
+        IUINT32 now;            ///< Current timestamp in millisec.
+        IINT32 rtt;             ///< Smoothed RTT in millisec, 0 before the first measurement.
+        IUINT32 delivered;      ///< Segments acknowledged since the last sample.
+        IUINT32 lost;           ///< Segments resent since the last sample.
+        IUINT32 inflight;       ///< Segments sent but not acknowledged yet.
+        IUINT32 mss;            ///< Payload bytes per segment.
+    };
+
+    /**
+     * @brief Replaces the congestion window of KCP, see `AdaptiveTuner::setCongestionController()`. (KCPlus feature)
+     * @details
+     * KCP's own congestion control is turned off, and the send window is set to what `onSample()` returns, so the
+     * controller decides how many segments are in flight.
+     */
+    class CongestionController
+    {
+    public:
+        virtual ~CongestionController() = default;
+
+        /**
+         * @brief Returns the send window in segments.
+         */
+        virtual IUINT32 onSample(const CongestionSample &sample) = 0;
+
+        /**
+         * @brief Returns the rate packets should be paced at, in bytes per millisec. 0 if not pacing.
+         */
+        virtual double pacingRate() const
+        {
+            return 0;
+        }
+    };
+
+    /**
+     * @brief BBR-like congestion controller. (KCPlus feature)
+     * @details
+     * Models the path instead of reacting to loss: the bottleneck bandwidth is the highest delivery rate of the last
+     * 10 round trips, and the window is twice the bandwidth-delay product. It starts by doubling the rate every round
+     * until bandwidth stops growing, drains the queue it built, and then cycles the pacing gain to probe for more
+     * bandwidth now and then. Every 10 seconds without a lower RTT, it shrinks the window to 4 segments for 200ms to
+     * measure the RTT again.
+     * Only as good as the RTT KCP measures, which is smoothed, so it's "like" BBR. Use `pacingRate()` with a pacer to
+     * get the most out of it.
+     */
+    class BBRController : public CongestionController
+    {
+    public:
+        /**
+         * @param initialWindow Send window in segments until bandwidth is known.
+         */
+        explicit BBRController(IUINT32 initialWindow = 32)
+            :mInitialWindow(initialWindow)
+        {
+            std::fill(mRates, mRates + BandwidthWindow, 0.0);
+        }
+
+        IUINT32 onSample(const CongestionSample &sample) override
+        {
+            mMss = sample.mss;
+            if(!mStarted)
+            {
+                mStarted = true;
+                mRoundStart = sample.now;
+                mLastSample = sample.now;
+                mMinRttStamp = sample.now;
+            }
+            if(sample.rtt > 0 && (mMinRtt == 0 || sample.rtt <= mMinRtt))
+            {
+                mMinRtt = sample.rtt;
+                mMinRttStamp = sample.now;
+            }
+            mRoundDelivered += sample.delivered;
+            mLastSample = sample.now;
+
+            IUINT32 roundLength = static_cast<IUINT32>(mMinRtt > MinRoundLength ? mMinRtt : MinRoundLength);
+            if(static_cast<IINT32>(sample.now - mRoundStart) >= static_cast<IINT32>(roundLength))
+            {
+                endRound(sample);
+            }
+            if(mState != State::ProbeRTT && mMinRtt != 0 &&
+                static_cast<IINT32>(sample.now - mMinRttStamp) >= static_cast<IINT32>(MinRttExpiry))
+            {
+                mState = State::ProbeRTT;
+                mProbeRttEnd = sample.now + ProbeRttDuration;
+            }
+            if(mState == State::ProbeRTT && static_cast<IINT32>(sample.now - mProbeRttEnd) >= 0)
+            {
+                // Whatever was measured at 4 segments in flight is the RTT now.
+                mMinRtt = sample.rtt > 0 ? sample.rtt : mMinRtt;
+                mMinRttStamp = sample.now;
+                mState = mFullBandwidth ? State::ProbeBW : State::Startup;
+            }
+            return window();
+        }
+
+        double pacingRate() const override
+        {
+            return pacingGain() * mBandwidth * mMss;
+        }
+
+        /**
+         * @brief Returns the estimated bottleneck bandwidth in segments per millisec.
+         */
+        double bandwidth() const
+        {
+            return mBandwidth;
+        }
+    private:
+        enum class State
+        {
+            Startup,
+            Drain,
+            ProbeBW,
+            ProbeRTT
+        };
+
+        constexpr static const SizeType BandwidthWindow = 10;       // Rounds the bandwidth filter covers.
+        constexpr static const IINT32 MinRoundLength = 10;
+        constexpr static const IUINT32 MinRttExpiry = 10000;
+        constexpr static const IUINT32 ProbeRttDuration = 200;
+        constexpr static const IUINT32 MinWindow = 4;
+
+        IUINT32 mInitialWindow;
+        IUINT32 mMss = 0;
+        bool mStarted = false;
+        State mState = State::Startup;
+        IUINT32 mRoundStart = 0;
+        IUINT32 mRoundCount = 0;
+        IUINT32 mLastSample = 0;
+        std::uint64_t mRoundDelivered = 0;
+        double mRates[BandwidthWindow];
+        double mBandwidth = 0;
+        double mFullBandwidthCandidate = 0;
+        int mRoundsWithoutGrowth = 0;
+        bool mFullBandwidth = false;
+        int mCycleIndex = 0;
+        IINT32 mMinRtt = 0;
+        IUINT32 mMinRttStamp = 0;
+        IUINT32 mProbeRttEnd = 0;
+        IUINT32 mInflight = 0;
+
+        void endRound(const CongestionSample &sample)
+        {
+            double rate = static_cast<double>(mRoundDelivered) / static_cast<double>(sample.now - mRoundStart);
+            mRates[mRoundCount % BandwidthWindow] = rate;
+            ++mRoundCount;
+            mRoundStart = sample.now;
+            mRoundDelivered = 0;
+            mInflight = sample.inflight;
+            mBandwidth = *std::max_element(mRates, mRates + BandwidthWindow);
+            switch(mState)
+            {
+            case State::Startup:
+                if(mBandwidth >= mFullBandwidthCandidate * 1.25)
+                {
+                    mFullBandwidthCandidate = mBandwidth;
+                    mRoundsWithoutGrowth = 0;
+                }
+                else if(++mRoundsWithoutGrowth >= 3)
+                {
+                    mFullBandwidth = true;
+                    mState = State::Drain;
+                }
+                break;
+            case State::Drain:
+                if(mInflight <= bdp())
+                {
+                    mState = State::ProbeBW;
+                    mCycleIndex = 0;
+                }
+                break;
+            case State::ProbeBW:
+                mCycleIndex = (mCycleIndex + 1) % 8;
+                break;
+            case State::ProbeRTT:
+                break;
+            }
+        }
+
+        IUINT32 bdp() const
+        {
+            return static_cast<IUINT32>(mBandwidth * mMinRtt);
+        }
+
+        double pacingGain() const
+        {
+            static const double cycle[8] = {1.25, 0.75, 1, 1, 1, 1, 1, 1};
+            switch(mState)
+            {
+            case State::Startup:
+                return StartupGain;
+            case State::Drain:
+                return 1 / StartupGain;
+            case State::ProbeBW:
+                return cycle[mCycleIndex];
+            default:
+                return 1;
+            }
+        }
+
+        IUINT32 window() const
+        {
+            if(mState == State::ProbeRTT)
+            {
+                return MinWindow;
+            }
+            if(mBandwidth == 0 || mMinRtt == 0)
+            {
+                return mInitialWindow;
+            }
+            double gain = mState == State::ProbeBW ? 2 : StartupGain;
+            return std::max(MinWindow + 0, static_cast<IUINT32>(gain * mBandwidth * mMinRtt));
+        }
+
+        constexpr static const double StartupGain = 2.885; // 2 / ln(2), doubles the rate every round.
+    };
+
+    /**
+     * @brief Bounds `AdaptiveTuner` keeps session properties within. (KCPlus feature)
+     */
+    struct TuningBounds
+    {
+        IUINT32 period = 1000;          ///< Millisec between adjustments.
+        int minInterval = 10;           ///< See `KCPSession::setInternalInterval()`.
+        int maxInterval = 100;
+        int minFastResend = 2;          ///< See `KCPSession::setFastResendThreshold()`. Used when lossy.
+        int maxFastResend = 4;          ///< Used when clean, to tolerate reordering.
+        IUINT32 minWindow = 32;         ///< Send and receive windows in segments.
+        IUINT32 maxWindow = 1024;
+        int minMTU = 0;                 ///< MTU is only adjusted if `minMTU < maxMTU`.
+        int maxMTU = 0;
+        double lowLoss = 0.005;         ///< Segments resent per segment sent, below which the link counts as clean.
+        double highLoss = 0.02;         ///< Above which the link counts as lossy.
+    };
+
+    /**
+     * @brief Adjusts properties of one session to what its link looks like. (KCPlus feature)
+     * @details
+     * Call `update()` right after every `KCPSession::update()`. Every period, it reads `stats()` and adjusts:
+     * - Internal interval to a quarter of the RTT, so ACKs and resends of fast links aren't held back.
+     * - Fast resend threshold, lower on lossy links and higher on clean ones.
+     * - Send and receive windows to twice the bandwidth-delay product, so fast links aren't window-bound and slow
+     *   ones don't queue.
+     * - MTU, smaller while the link stays lossy without queueing delay and larger again once it's clean, if enabled by
+     *   the bounds.
+     *
+     * With a congestion controller, the send window is left to the controller instead, see
+     * `setCongestionController()`.
+     * Not thread-safe, use it on the thread owning the session.
+     */
+    class AdaptiveTuner
+    {
+    public:
+        explicit AdaptiveTuner(const TuningBounds &bounds = TuningBounds())
+            :mBounds(bounds)
+        {
+        }
+
+        /**
+         * @brief Replaces KCP's congestion window by `controller`, consulted on every `update()`.
+         * @param controller Controller to use, `nullptr` to go back to KCP's own congestion control.
+         */
+        void setCongestionController(std::unique_ptr<CongestionController> controller)
+        {
+            mController = std::move(controller);
+            mControllerApplied = false;
+        }
+
+        /**
+         * @brief Returns the congestion controller, eg. for its pacing rate. `nullptr` if none.
+         */
+        CongestionController *congestionController() const
+        {
+            return mController.get();
+        }
+
+        /**
+         * @brief Feeds the congestion controller, and adjusts the session once a period passed.
+         * @param session Session to tune, always the same one.
+         * @param currentTimestamp Current timestamp in millisec.
+         */
+        template<class Session>
+        void update(Session &session, IUINT32 currentTimestamp)
+        {
+            SessionStats stats = session.stats();
+            std::uint64_t lost = stats.retransmits + stats.fastRetransmits;
+            std::uint64_t fresh = stats.segmentsSent > lost ? stats.segmentsSent - lost : 0;
+            if(!mStarted)
+            {
+                mStarted = true;
+                mLastTune = currentTimestamp;
+                mMTU = static_cast<int>(stats.mtu);
+                mLast = Totals{fresh, lost, stats.datagramsReceived, stats.sendBuffer};
+                mPeriodStart = mLast;
+                return;
+            }
+            // Segments which left the flight and weren't resent were acknowledged.
+            std::int64_t delivered = static_cast<std::int64_t>(fresh - mLast.fresh) -
+                (static_cast<std::int64_t>(stats.sendBuffer) - static_cast<std::int64_t>(mLast.inflight));
+            mPeriodDelivered += static_cast<std::uint64_t>(std::max<std::int64_t>(delivered, 0));
+            if(mController != nullptr)
+            {
+                if(!mControllerApplied)
+                {
+                    session.setCongestionControl(false);
+                    mControllerApplied = true;
+                }
+                CongestionSample sample;
+                sample.now = currentTimestamp;
+                sample.rtt = stats.rtt;
+                sample.delivered = static_cast<IUINT32>(std::max<std::int64_t>(delivered, 0));
+                sample.lost = static_cast<IUINT32>(lost - mLast.lost);
+                sample.inflight = stats.sendBuffer;
+                sample.mss = stats.mtu - static_cast<IUINT32>(KCPOverhead);
+                IUINT32 window = std::min(mController->onSample(sample), mBounds.maxWindow);
+                if(window != mSendWindow)
+                {
+                    session.setMaxSendWindowSize(static_cast<int>(window));
+                    mSendWindow = window;
+                }
+            }
+            mLast = Totals{fresh, lost, stats.datagramsReceived, stats.sendBuffer};
+            IUINT32 elapsed = currentTimestamp - mLastTune;
+            if(static_cast<IINT32>(elapsed) >= static_cast<IINT32>(mBounds.period))
+            {
+                tune(session, stats, elapsed);
+                mLastTune = currentTimestamp;
+                mPeriodStart = mLast;
+                mPeriodDelivered = 0;
+            }
+        }
+
+        /**
+         * @brief Returns the ratio of resent segments in the last period.
+         */
+        double lossRate() const
+        {
+            return mLossRate;
+        }
+    private:
+        struct Totals
+        {
+            std::uint64_t fresh;            // Segments sent for the first time.
+            std::uint64_t lost;             // Segments resent.
+            std::uint64_t received;         // Datagrams received.
+            IUINT32 inflight;
+        };
+
+        TuningBounds mBounds;
+        std::unique_ptr<CongestionController> mController;
+        bool mControllerApplied = false;
+        bool mStarted = false;
+        IUINT32 mLastTune = 0;
+        Totals mLast = Totals();
+        Totals mPeriodStart = Totals();
+        std::uint64_t mPeriodDelivered = 0;
+        double mLossRate = 0;
+        int mInterval = 0;
+        int mFastResend = 0;
+        IUINT32 mSendWindow = 0;
+        IUINT32 mReceiveWindow = 0;
+        int mMTU = 0;
+        IINT32 mMinRtt = 0;
+        int mLossyPeriods = 0;
+        int mCleanPeriods = 0;
+
+        constexpr static const int LossyPeriodsBeforeShrinking = 2;
+        constexpr static const int CleanPeriodsBeforeGrowing = 10;
+
+        template<class Session>
+        void tune(Session &session, const SessionStats &stats, IUINT32 elapsed)
+        {
+            std::uint64_t sent = (mLast.fresh - mPeriodStart.fresh) + (mLast.lost - mPeriodStart.lost);
+            mLossRate = sent != 0 ? static_cast<double>(mLast.lost - mPeriodStart.lost) / static_cast<double>(sent) : 0;
+            bool lossy = sent != 0 && mLossRate >= mBounds.highLoss;
+            bool clean = sent != 0 && mLossRate <= mBounds.lowLoss;
+            if(stats.rtt > 0)
+            {
+                int interval = std::min(std::max(static_cast<int>(stats.rtt) / 4, mBounds.minInterval),
+                    mBounds.maxInterval);
+                if(interval != mInterval)
+                {
+                    session.setInternalInterval(interval);
+                    mInterval = interval;
+                }
+
+                // Windows of twice the bandwidth-delay product, never shrinking while packets queue up.
+                IUINT32 sendWindow = windowFor(static_cast<double>(mPeriodDelivered), elapsed, stats.rtt);
+                if(stats.sendQueue != 0)
+                {
+                    sendWindow = std::max(sendWindow, mSendWindow);
+                }
+                if(mController == nullptr && sendWindow != mSendWindow)
+                {
+                    session.setMaxSendWindowSize(static_cast<int>(sendWindow));
+                    mSendWindow = sendWindow;
+                }
+                IUINT32 receiveWindow = windowFor(static_cast<double>(mLast.received - mPeriodStart.received), elapsed,
+                    stats.rtt);
+                if(receiveWindow != mReceiveWindow)
+                {
+                    session.setMaxReceiveWindowSize(static_cast<int>(receiveWindow));
+                    mReceiveWindow = receiveWindow;
+                }
+            }
+            if(lossy || clean)
+            {
+                int fastResend = lossy ? mBounds.minFastResend : mBounds.maxFastResend;
+                if(fastResend != mFastResend)
+                {
+                    session.setFastResendThreshold(fastResend);
+                    mFastResend = fastResend;
+                }
+            }
+            if(stats.rtt > 0 && (mMinRtt == 0 || stats.rtt < mMinRtt))
+            {
+                mMinRtt = stats.rtt;
+            }
+            // Loss while the RTT is inflated comes from full queues, which smaller packets don't help with.
+            bool queueing = stats.rtt > mMinRtt + mMinRtt / 2;
+            mLossyPeriods = lossy && !queueing ? mLossyPeriods + 1 : 0;
+            mCleanPeriods = clean ? mCleanPeriods + 1 : 0;
+            if(mBounds.minMTU < mBounds.maxMTU)
+            {
+                int mtu = mMTU;
+                if(mLossyPeriods >= LossyPeriodsBeforeShrinking)
+                {
+                    mtu = std::max(mBounds.minMTU, mMTU * 3 / 4);
+                    mLossyPeriods = 0;
+                }
+                else if(mCleanPeriods >= CleanPeriodsBeforeGrowing)
+                {
+                    mtu = std::min(mBounds.maxMTU, mMTU + std::max((mBounds.maxMTU - mBounds.minMTU) / 4, 1));
+                    mCleanPeriods = 0;
+                }
+                mtu = std::min(std::max(mtu, mBounds.minMTU), mBounds.maxMTU);
+                if(mtu != mMTU)
+                {
+                    session.setMTU(mtu);
+                    mMTU = mtu;
+                }
+            }
+        }
+
+        IUINT32 windowFor(double segments, IUINT32 elapsed, IINT32 rtt) const
+        {
+            double bdp = segments / static_cast<double>(elapsed) * static_cast<double>(rtt);
+            IUINT32 window = static_cast<IUINT32>(std::min<double>(2 * bdp, mBounds.maxWindow));
+            return std::max(window, mBounds.minWindow);
+        }
+    };
+}
+
+#endif // KCPLUS_TUNING_HPP
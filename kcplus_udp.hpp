@@ -0,0 +1,596 @@
+/*
+    Copyright 2017 Miigon
+
+    Licensed under the Apache License, Version 2.0 (the "License");
+    you may not use this file except in compliance with the License.
+    You may obtain a copy of the License at
+
+        http://www.apache.org/licenses/LICENSE-2.0
+
+    Unless required by applicable law or agreed to in writing, software
+    distributed under the License is distributed on an "AS IS" BASIS,
+    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+    See the License for the specific language governing permissions and
+    limitations under the License.
+*/
+
+#ifndef KCPLUS_UDP_HPP
+#define KCPLUS_UDP_HPP
+
+#ifndef __linux__
+#error "kcplus_udp.hpp requires Linux (recvmmsg/sendmmsg)."
+#endif
+
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <system_error>
+#include <vector>
+#include <time.h>
+#include <netinet/in.h>
+#include <netinet/udp.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#include "kcplus.hpp"
+
+#ifndef SOL_UDP
+#define SOL_UDP 17
+#endif
+#ifndef UDP_SEGMENT
+#define UDP_SEGMENT 103
+#endif
+#ifndef UDP_GRO
+#define UDP_GRO 104
+#endif
+#ifndef SO_TXTIME
+#define SO_TXTIME 61
+#define SCM_TXTIME SO_TXTIME
+#endif
+
+namespace ikcp
+{
+    /**
+     * @brief A socket address, IPv4 or IPv6. (KCPlus feature)
+     */
+    struct SocketAddress
+    {
+        sockaddr_storage storage;
+        socklen_t length;
+
+        SocketAddress()
+            :length(0)
+        {
+            std::memset(&storage, 0, sizeof(storage));
+        }
+
+        SocketAddress(const sockaddr *address, socklen_t addressLength)
+            :length(addressLength)
+        {
+            std::memset(&storage, 0, sizeof(storage));
+            std::memcpy(&storage, address, addressLength);
+        }
+
+        const sockaddr *get() const
+        {
+            return reinterpret_cast<const sockaddr *>(&storage);
+        }
+
+        bool operator==(const SocketAddress &other) const
+        {
+            return length == other.length && std::memcmp(&storage, &other.storage, length) == 0;
+        }
+
+        bool operator!=(const SocketAddress &other) const
+        {
+            return !(*this == other);
+        }
+    };
+
+    /**
+     * @brief Non-blocking UDP socket batching datagrams with `sendmmsg()`/`recvmmsg()`. (KCPlus feature)
+     * @details
+     * Low-level packets given to output functions created by `outputTo()` are copied into a ring of preallocated
+     * buffers, and sent by a single `sendmmsg()` on `flush()` (or when the ring is full). So call `flush()` of the
+     * transport once after updating/flushing your sessions, instead of one `sendto()` per segment.
+     * `receive()` reads up to a batch of datagrams with a single `recvmmsg()` into preallocated buffers, and hands
+     * them to you, typically for `KCPSession::input()` or `KCPServer::input()`.
+     * For bulk flows, turn on `setGSO()`/`setGRO()` to move many MTU-sized segments per syscall. For paced flows, turn
+     * on `setTxTime()` and let the kernel hold datagrams until their departure time.
+     * Linux only. Not thread-safe.
+     */
+    class UDPTransport
+    {
+    public:
+        /**
+         * @param batchSize Maximum number of datagrams per `sendmmsg()`/`recvmmsg()`.
+         * @param bufferSize Maximum size of a datagram, should be at least the MTU of your sessions.
+         */
+        explicit UDPTransport(SizeType batchSize = 64, SizeType bufferSize = 2048)
+            :mFd(-1),mBatchSize(batchSize),mBufferSize(bufferSize),mRecvBufferSize(bufferSize),mGSO(false),
+            mTxTime(false),mNumOfQueued(0),mNumOfMessages(0),mSendUsed(0),
+            mSendBuffers(batchSize * bufferSize),mSendAddresses(batchSize),mSendSegmentSizes(batchSize),
+            mSendCounts(batchSize),mSendTxTimes(batchSize),mSendIovecs(batchSize),
+            mSendControls(batchSize * SendControlSize),mSendHeaders(batchSize),
+            mRecvBuffers(batchSize * bufferSize),mRecvAddresses(batchSize),mRecvIovecs(batchSize),
+            mRecvControls(batchSize * GROControlSize),mRecvHeaders(batchSize)
+        {
+        }
+
+        ~UDPTransport()
+        {
+            close();
+        }
+
+        UDPTransport(const UDPTransport &) = delete;
+        UDPTransport &operator=(const UDPTransport &) = delete;
+
+        /**
+         * @brief Creates a non-blocking UDP socket.
+         * @param family `AF_INET` or `AF_INET6`.
+         * @throw std::system_error If the socket can not be created.
+         */
+        void open(int family = AF_INET)
+        {
+            close();
+            mFd = ::socket(family, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+            if(mFd < 0)
+            {
+                throw std::system_error(errno, std::system_category(), "UDPTransport: socket");
+            }
+        }
+
+        /**
+         * @brief Turns on/off `SO_REUSEPORT`, call it between `open()` and `bind()`.
+         * @details Lets several transports (eg. one per thread) bind the same address, the kernel spreads
+         * datagrams among them.
+         * @throw std::system_error If the option can not be set.
+         */
+        void setReusePort(bool reusePort)
+        {
+            int value = reusePort ? 1 : 0;
+            if(::setsockopt(mFd, SOL_SOCKET, SO_REUSEPORT, &value, sizeof(value)) != 0)
+            {
+                throw std::system_error(errno, std::system_category(), "UDPTransport: SO_REUSEPORT");
+            }
+        }
+
+        /**
+         * @brief Binds the socket to a local address, opening it first if it's not opened yet.
+         * @throw std::system_error If the address can not be bound.
+         */
+        void bind(const SocketAddress &address)
+        {
+            if(mFd < 0)
+            {
+                open(address.storage.ss_family);
+            }
+            if(::bind(mFd, address.get(), address.length) != 0)
+            {
+                throw std::system_error(errno, std::system_category(), "UDPTransport: bind");
+            }
+        }
+
+        /**
+         * @brief Closes the socket. Queued datagrams are dropped.
+         */
+        void close()
+        {
+            if(mFd >= 0)
+            {
+                ::close(mFd);
+                mFd = -1;
+            }
+            mNumOfQueued = 0;
+            mNumOfMessages = 0;
+            mSendUsed = 0;
+        }
+
+        /**
+         * @brief Returns the socket file descriptor, -1 if not opened.
+         */
+        int fd() const
+        {
+            return mFd;
+        }
+
+        /**
+         * @brief Returns an output function sending low-level packets to `address` through this transport.
+         * @see KCPSession::setOutputFunction()
+         */
+        KCPSession::OutputFunction outputTo(const SocketAddress &address)
+        {
+            return [this, address](const char buf[], SizeType len)
+            {
+                queue(buf, len, address);
+            };
+        }
+
+        /**
+         * @brief Returns an output function sending low-level packets to `address` at the time given with each one.
+         * @details The time is in nanosec of `CLOCK_MONOTONIC`, eg. from `Pacer::setTimedOutput()`. Needs `setTxTime()`.
+         */
+        std::function<void(const char buf[], SizeType len, std::uint64_t txtime)> timedOutputTo(
+            const SocketAddress &address)
+        {
+            return [this, address](const char buf[], SizeType len, std::uint64_t txtime)
+            {
+                queue(buf, len, address, txtime);
+            };
+        }
+
+        /**
+         * @brief Turns on/off UDP generic segmentation offload (`UDP_SEGMENT`).
+         * @details
+         * With GSO, consecutive queued datagrams to the same address and of the same size (except the last one, which
+         * can be smaller) are sent as one super-buffer and split by the kernel or NIC. Full KCP segments are exactly
+         * the MTU set by `KCPSession::setMTU()`, so bulk flows are coalesced at MTU size.
+         * If the kernel refuses a GSO send later, GSO is turned off automatically.
+         * @return `false` if not supported by the kernel (Linux 4.18+).
+         */
+        bool setGSO(bool gso)
+        {
+            if(gso)
+            {
+                int value = 0;
+                if(::setsockopt(mFd, SOL_UDP, UDP_SEGMENT, &value, sizeof(value)) != 0)
+                {
+                    mGSO = false;
+                    return false;
+                }
+            }
+            flush();
+            mGSO = gso;
+            return true;
+        }
+
+        /**
+         * @brief Turns on/off departure times of datagrams (`SO_TXTIME`), for the kernel to pace them.
+         * @details
+         * Datagrams queued with a departure time are held by the qdisc until then, which needs the fq (or etf) qdisc
+         * on the outgoing interface, eg. `tc qdisc replace dev eth0 root fq`. Without it, they leave right
+         * away. Timed datagrams are never merged by GSO, as all segments of a super-buffer leave at once.
+         * Turning it off only stops passing departure times, the socket option can't be cleared.
+         * @return `false` if not supported by the kernel (Linux 4.19+).
+         */
+        bool setTxTime(bool txTime)
+        {
+            if(txTime)
+            {
+                struct
+                {
+                    clockid_t clockid;
+                    std::uint32_t flags;
+                } config = {CLOCK_MONOTONIC, 0}; // struct sock_txtime
+                if(::setsockopt(mFd, SOL_SOCKET, SO_TXTIME, &config, sizeof(config)) != 0)
+                {
+                    mTxTime = false;
+                    return false;
+                }
+            }
+            flush();
+            mTxTime = txTime;
+            return true;
+        }
+
+        /**
+         * @brief Turns on/off UDP generic receive offload (`UDP_GRO`).
+         * @details
+         * With GRO, the kernel coalesces datagrams of the same flow into one buffer, which `receive()` splits back
+         * without copying. Receive buffers are enlarged to `MaxGSOSize` bytes each.
+         * @return `false` if not supported by the kernel (Linux 5.0+).
+         */
+        bool setGRO(bool gro)
+        {
+            int value = gro ? 1 : 0;
+            if(::setsockopt(mFd, SOL_UDP, UDP_GRO, &value, sizeof(value)) != 0)
+            {
+                return false;
+            }
+            if(gro)
+            {
+                mRecvBufferSize = MaxGSOSize;
+            }
+            else
+            {
+                mRecvBufferSize = mBufferSize;
+            }
+            mRecvBuffers.assign(mBatchSize * mRecvBufferSize, 0);
+            return true;
+        }
+
+        /**
+         * @brief Queues a datagram, it will be sent on next `flush()`.
+         * @details Datagrams larger than buffer size are sent immediately, after queued ones.
+         * @param txtime Departure time in nanosec of `CLOCK_MONOTONIC`, 0 for none. Ignored without `setTxTime()`.
+         */
+        void queue(const char data[], SizeType size, const SocketAddress &address, std::uint64_t txtime = 0)
+        {
+            if(!mTxTime)
+            {
+                txtime = 0;
+            }
+            if(size > mBufferSize)
+            {
+                flush();
+                ::sendto(mFd, data, size, 0, address.get(), address.length);
+                return;
+            }
+            if(mSendUsed + size > mSendBuffers.size())
+            {
+                flush();
+            }
+            bool merge = txtime == 0 && canMerge(size, address);
+            if(!merge && mNumOfMessages == mBatchSize)
+            {
+                flush();
+            }
+            char *buffer = &mSendBuffers[mSendUsed];
+            std::memcpy(buffer, data, size);
+            mSendUsed += size;
+            ++mNumOfQueued;
+            if(merge)
+            {
+                // Datagrams of a message are contiguous in the send buffer.
+                mSendIovecs[mNumOfMessages - 1].iov_len += size;
+                ++mSendCounts[mNumOfMessages - 1];
+                return;
+            }
+            SizeType i = mNumOfMessages++;
+            mSendAddresses[i] = address;
+            mSendSegmentSizes[i] = size;
+            mSendCounts[i] = 1;
+            mSendTxTimes[i] = txtime;
+            mSendIovecs[i].iov_base = buffer;
+            mSendIovecs[i].iov_len = size;
+        }
+
+        /**
+         * @brief Sends all queued datagrams.
+         * @details Datagrams the socket can not take right now (`EAGAIN`) are dropped, KCP will resend them.
+         * @return Number of datagrams sent.
+         */
+        SizeType flush()
+        {
+            for(SizeType i = 0; i < mNumOfMessages; ++i)
+            {
+                msghdr &header = mSendHeaders[i].msg_hdr;
+                std::memset(&mSendHeaders[i], 0, sizeof(mmsghdr));
+                header.msg_name = &mSendAddresses[i].storage;
+                header.msg_namelen = mSendAddresses[i].length;
+                header.msg_iov = &mSendIovecs[i];
+                header.msg_iovlen = 1;
+                if(mSendCounts[i] > 1 || mSendTxTimes[i] != 0)
+                {
+                    char *control = &mSendControls[i * SendControlSize];
+                    std::memset(control, 0, SendControlSize);
+                    header.msg_control = control;
+                    header.msg_controllen = SendControlSize;
+                    cmsghdr *cmsg = CMSG_FIRSTHDR(&header);
+                    SizeType used = 0;
+                    if(mSendCounts[i] > 1)
+                    {
+                        cmsg->cmsg_level = SOL_UDP;
+                        cmsg->cmsg_type = UDP_SEGMENT;
+                        cmsg->cmsg_len = CMSG_LEN(sizeof(std::uint16_t));
+                        std::uint16_t segmentSize = static_cast<std::uint16_t>(mSendSegmentSizes[i]);
+                        std::memcpy(CMSG_DATA(cmsg), &segmentSize, sizeof(segmentSize));
+                        used += CMSG_SPACE(sizeof(std::uint16_t));
+                        cmsg = CMSG_NXTHDR(&header, cmsg);
+                    }
+                    if(mSendTxTimes[i] != 0)
+                    {
+                        cmsg->cmsg_level = SOL_SOCKET;
+                        cmsg->cmsg_type = SCM_TXTIME;
+                        cmsg->cmsg_len = CMSG_LEN(sizeof(std::uint64_t));
+                        std::memcpy(CMSG_DATA(cmsg), &mSendTxTimes[i], sizeof(std::uint64_t));
+                        used += CMSG_SPACE(sizeof(std::uint64_t));
+                    }
+                    header.msg_controllen = used;
+                }
+            }
+            SizeType sent = 0;
+            SizeType next = 0;
+            while(next < mNumOfMessages)
+            {
+                int result = ::sendmmsg(mFd, &mSendHeaders[next], static_cast<unsigned int>(mNumOfMessages - next), 0);
+                if(result < 0)
+                {
+                    if(errno == EINTR)
+                    {
+                        continue;
+                    }
+                    if(errno == EAGAIN || errno == EWOULDBLOCK)
+                    {
+                        break;
+                    }
+                    if(mSendCounts[next] > 1 && (errno == EIO || errno == EINVAL))
+                    {
+                        mGSO = false; // Not supported by the device.
+                    }
+                    ++next; // Skips the message causing the error, eg. unreachable destination.
+                    continue;
+                }
+                for(int i = 0; i < result; ++i)
+                {
+                    sent += mSendCounts[next++];
+                }
+            }
+            mNumOfQueued = 0;
+            mNumOfMessages = 0;
+            mSendUsed = 0;
+            return sent;
+        }
+
+        /**
+         * @brief Returns number of queued datagrams.
+         */
+        SizeType getNumOfQueuedDatagrams() const
+        {
+            return mNumOfQueued;
+        }
+
+        /**
+         * @brief Receives a batch of datagrams without blocking.
+         * @details Calls `function(const char data[], SizeType size, const SocketAddress &from)` for every datagram.
+         * Data stays valid until the next `receive()`. Truncated datagrams are skipped.
+         * Buffers coalesced by GRO are split back into datagrams in place.
+         * @return Number of datagrams received, 0 if there is none available.
+         */
+        template<class Function>
+        SizeType receive(Function function)
+        {
+            for(SizeType i = 0; i < mBatchSize; ++i)
+            {
+                mRecvIovecs[i].iov_base = &mRecvBuffers[i * mRecvBufferSize];
+                mRecvIovecs[i].iov_len = mRecvBufferSize;
+                std::memset(&mRecvHeaders[i], 0, sizeof(mmsghdr));
+                mRecvHeaders[i].msg_hdr.msg_name = &mRecvAddresses[i].storage;
+                mRecvHeaders[i].msg_hdr.msg_namelen = sizeof(sockaddr_storage);
+                mRecvHeaders[i].msg_hdr.msg_iov = &mRecvIovecs[i];
+                mRecvHeaders[i].msg_hdr.msg_iovlen = 1;
+                mRecvHeaders[i].msg_hdr.msg_control = &mRecvControls[i * GROControlSize];
+                mRecvHeaders[i].msg_hdr.msg_controllen = GROControlSize;
+            }
+            int result;
+            do
+            {
+                result = ::recvmmsg(mFd, mRecvHeaders.data(), static_cast<unsigned int>(mBatchSize), MSG_DONTWAIT, nullptr);
+            } while(result < 0 && errno == EINTR);
+            if(result <= 0)
+            {
+                return 0;
+            }
+            SizeType received = 0;
+            for(int i = 0; i < result; ++i)
+            {
+                msghdr &header = mRecvHeaders[i].msg_hdr;
+                if(header.msg_flags & MSG_TRUNC)
+                {
+                    continue;
+                }
+                mRecvAddresses[i].length = header.msg_namelen;
+                const char *data = static_cast<const char *>(mRecvIovecs[i].iov_base);
+                SizeType size = static_cast<SizeType>(mRecvHeaders[i].msg_len);
+                SizeType segmentSize = size;
+                for(cmsghdr *cmsg = CMSG_FIRSTHDR(&header); cmsg != nullptr; cmsg = CMSG_NXTHDR(&header, cmsg))
+                {
+                    if(cmsg->cmsg_level == SOL_UDP && cmsg->cmsg_type == UDP_GRO)
+                    {
+                        int value;
+                        std::memcpy(&value, CMSG_DATA(cmsg), sizeof(value));
+                        segmentSize = value > 0 ? static_cast<SizeType>(value) : size;
+                    }
+                }
+                for(SizeType offset = 0; offset < size; offset += segmentSize)
+                {
+                    SizeType length = size - offset < segmentSize ? size - offset : segmentSize;
+                    function(data + offset, length, mRecvAddresses[i]);
+                    ++received;
+                }
+            }
+            return received;
+        }
+
+        /**
+         * @brief Maximum size of a GSO/GRO super-buffer.
+         */
+        constexpr static const SizeType MaxGSOSize = 65535;
+    private:
+        constexpr static const SizeType MaxGSOSegments = 64; // UDP_MAX_SEGMENTS
+        constexpr static const SizeType SendControlSize = CMSG_SPACE(sizeof(std::uint16_t)) +
+            CMSG_SPACE(sizeof(std::uint64_t));  // UDP_SEGMENT and SCM_TXTIME
+        constexpr static const SizeType GROControlSize = CMSG_SPACE(sizeof(int));
+
+        int mFd;
+        SizeType mBatchSize;
+        SizeType mBufferSize;
+        SizeType mRecvBufferSize;
+        bool mGSO;
+        bool mTxTime;
+
+        SizeType mNumOfQueued;
+        SizeType mNumOfMessages;
+        SizeType mSendUsed;
+        std::vector<char> mSendBuffers;
+        std::vector<SocketAddress> mSendAddresses;
+        std::vector<SizeType> mSendSegmentSizes;
+        std::vector<SizeType> mSendCounts;
+        std::vector<std::uint64_t> mSendTxTimes;
+        std::vector<iovec> mSendIovecs;
+        std::vector<char> mSendControls;
+        std::vector<mmsghdr> mSendHeaders;
+
+        std::vector<char> mRecvBuffers;
+        std::vector<SocketAddress> mRecvAddresses;
+        std::vector<iovec> mRecvIovecs;
+        std::vector<char> mRecvControls;
+        std::vector<mmsghdr> mRecvHeaders;
+
+        // Whether the datagram can be appended to the last queued message as a GSO segment.
+        bool canMerge(SizeType size, const SocketAddress &address) const
+        {
+            if(!mGSO || mNumOfMessages == 0)
+            {
+                return false;
+            }
+            SizeType last = mNumOfMessages - 1;
+            const iovec &iov = mSendIovecs[last];
+            return mSendAddresses[last] == address && mSendTxTimes[last] == 0 && size <= mSendSegmentSizes[last]
+                && iov.iov_len % mSendSegmentSizes[last] == 0 && mSendCounts[last] < MaxGSOSegments
+                && iov.iov_len + size <= MaxGSOSize;
+        }
+    };
+
+    /**
+     * @brief Collects received datagrams into runs from the same source, to dispatch each run at once. (KCPlus feature)
+     * @details
+     * Feed it from the callback of `UDPTransport::receive()`, and call `dispatch()` after it returns, before the next
+     * `receive()` reuses the buffers. Runs typically go to `KCPServer::input(const ConstBuffer[], SizeType)`, which
+     * feeds the datagrams of a session at once and so acknowledges and delivers them once.
+     * Not thread-safe.
+     */
+    class DatagramBatch
+    {
+    public:
+        /**
+         * @brief Appends a datagram, dispatching the current run first if it came from another source.
+         * @param function Called as `function(const ConstBuffer datagrams[], SizeType count, const SocketAddress &from)`.
+         */
+        template<class Function>
+        void add(const char data[], SizeType size, const SocketAddress &from, Function &&function)
+        {
+            if(!mDatagrams.empty() && from != mFrom)
+            {
+                dispatch(function);
+            }
+            if(mDatagrams.empty())
+            {
+                mFrom = from;
+            }
+            mDatagrams.push_back(ConstBuffer{data, size});
+        }
+
+        /**
+         * @brief Dispatches the current run, if any.
+         * @param function Same as for `add()`.
+         */
+        template<class Function>
+        void dispatch(Function &&function)
+        {
+            if(mDatagrams.empty())
+            {
+                return;
+            }
+            function(static_cast<const ConstBuffer *>(mDatagrams.data()), mDatagrams.size(),
+                static_cast<const SocketAddress &>(mFrom));
+            mDatagrams.clear();
+        }
+    private:
+        std::vector<ConstBuffer> mDatagrams;
+        SocketAddress mFrom;
+    };
+}
+
+#endif // KCPLUS_UDP_HPP